@@ -0,0 +1,372 @@
+#include "accesslog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* the longest line a record formats to, every uri byte escaped */
+#define RECORD_MAX (ACCESSLOG_URI * 4 + 256)
+
+typedef struct stamp_t stamp_t;
+
+/* the date field changes once a second, not once a line */
+struct stamp_t
+{
+  time_t sec;
+  size_t len;
+  char str[32];
+};
+
+/* bumped by the signal handler, each writer reopens when it moves */
+static unsigned hups;
+
+static int log_open (const char *path);
+static void log_reopen (accesslog_t *log);
+static void *log_writer (void *arg);
+static void log_drain (accesslog_t *log, stamp_t *stamp);
+static void log_write (accesslog_t *log, const char *buf, size_t len);
+
+static accesslog_ring_t *ring_new (accesslog_t *log);
+static bool ring_wait (accesslog_t *log, accesslog_ring_t *r, uint64_t head);
+
+static size_t record_format (const accesslog_record_t *rec, char *buf,
+			     stamp_t *stamp);
+
+int
+accesslog_init (accesslog_t *log, const char *path, size_t size, int interval,
+		int mode)
+{
+  *log = (accesslog_t) {
+    .mode = mode,
+    .interval = interval,
+    .hups = __atomic_load_n (&hups, __ATOMIC_RELAXED),
+  };
+
+  /* a power of two, so slots are picked with a mask */
+  for (log->size = 1; log->size < size; log->size <<= 1)
+    ;
+
+  if (!(log->path = strdup (path)))
+    return -1;
+
+  if (!(log->batch = malloc (ACCESSLOG_BATCH)))
+    goto clean_path;
+
+  if ((log->fd = log_open (path)) == -1)
+    goto clean_batch;
+
+  if (pthread_key_create (&log->key, NULL) != 0)
+    goto clean_fd;
+
+  if (pthread_mutex_init (&log->lock, NULL) != 0)
+    goto clean_key;
+
+  if (pthread_cond_init (&log->wake, NULL) != 0)
+    goto clean_lock;
+
+  if (pthread_cond_init (&log->space, NULL) != 0)
+    goto clean_wake;
+
+  if (pthread_create (&log->writer, NULL, log_writer, log) != 0)
+    goto clean_space;
+
+  return 0;
+
+clean_space:
+  pthread_cond_destroy (&log->space);
+
+clean_wake:
+  pthread_cond_destroy (&log->wake);
+
+clean_lock:
+  pthread_mutex_destroy (&log->lock);
+
+clean_key:
+  pthread_key_delete (log->key);
+
+clean_fd:
+  close (log->fd);
+
+clean_batch:
+  free (log->batch);
+
+clean_path:
+  free (log->path);
+  return -1;
+}
+
+void
+accesslog_free (accesslog_t *log)
+{
+  pthread_mutex_lock (&log->lock);
+  log->stop = true;
+  pthread_cond_signal (&log->wake);
+  pthread_cond_broadcast (&log->space);
+  pthread_mutex_unlock (&log->lock);
+
+  /* the writer drains once more before it returns */
+  pthread_join (log->writer, NULL);
+
+  for (accesslog_ring_t *r = log->rings, *next; r; r = next)
+    {
+      next = r->next;
+      free (r);
+    }
+
+  pthread_cond_destroy (&log->space);
+  pthread_cond_destroy (&log->wake);
+  pthread_mutex_destroy (&log->lock);
+  pthread_key_delete (log->key);
+  close (log->fd);
+  free (log->batch);
+  free (log->path);
+}
+
+bool
+accesslog_push (accesslog_t *log, const accesslog_record_t *rec)
+{
+  accesslog_ring_t *r = pthread_getspecific (log->key) ?: ring_new (log);
+
+  if (!r)
+    goto drop;
+
+  uint64_t head = r->head;
+  uint64_t tail = __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE);
+
+  if (head - tail == log->size
+      && !(log->mode == ACCESSLOG_BLOCK && ring_wait (log, r, head)))
+    goto drop;
+
+  accesslog_record_t *slot = &r->records[head & (log->size - 1)];
+  memcpy (slot, rec, offsetof (accesslog_record_t, uri) + rec->uri_len);
+  __atomic_store_n (&r->head, head + 1, __ATOMIC_RELEASE);
+
+  /* half full, the writer should not sleep out its interval */
+  if (head + 1 - tail == log->size / 2)
+    {
+      __atomic_store_n (&log->kick, true, __ATOMIC_RELAXED);
+      pthread_cond_signal (&log->wake);
+    }
+
+  return true;
+
+drop:
+  __atomic_fetch_add (&log->dropped, 1, __ATOMIC_RELAXED);
+  return false;
+}
+
+void
+accesslog_hup (int sig)
+{
+  (void) sig;
+  __atomic_fetch_add (&hups, 1, __ATOMIC_RELAXED);
+}
+
+static int
+log_open (const char *path)
+{
+  return open (path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+static void
+log_reopen (accesslog_t *log)
+{
+  int fd;
+
+  /* rotated away, keep writing the old file if the new one fails */
+  if ((fd = log_open (log->path)) == -1)
+    return;
+
+  close (log->fd);
+  log->fd = fd;
+}
+
+static void *
+log_writer (void *arg)
+{
+  accesslog_t *log = arg;
+  stamp_t stamp = { .sec = -1 };
+
+  for (bool stop = false; !stop;)
+    {
+      struct timespec until;
+      clock_gettime (CLOCK_REALTIME, &until);
+      until.tv_sec += log->interval / 1000;
+      until.tv_nsec += log->interval % 1000 * 1000000L;
+      if (until.tv_nsec >= 1000000000L)
+	{
+	  until.tv_sec++;
+	  until.tv_nsec -= 1000000000L;
+	}
+
+      pthread_mutex_lock (&log->lock);
+      while (!log->stop && !__atomic_load_n (&log->kick, __ATOMIC_RELAXED))
+	if (pthread_cond_timedwait (&log->wake, &log->lock, &until)
+	    == ETIMEDOUT)
+	  break;
+      __atomic_store_n (&log->kick, false, __ATOMIC_RELAXED);
+      stop = log->stop;
+      pthread_mutex_unlock (&log->lock);
+
+      unsigned seen = __atomic_load_n (&hups, __ATOMIC_RELAXED);
+      if (seen != log->hups)
+	{
+	  log->hups = seen;
+	  log_reopen (log);
+	}
+
+      log_drain (log, &stamp);
+    }
+
+  return NULL;
+}
+
+static void
+log_drain (accesslog_t *log, stamp_t *stamp)
+{
+  size_t len = 0;
+  accesslog_ring_t *r = __atomic_load_n (&log->rings, __ATOMIC_ACQUIRE);
+
+  for (; r; r = r->next)
+    {
+      uint64_t tail = r->tail;
+      uint64_t head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+
+      for (; tail != head; tail++)
+	{
+	  if (ACCESSLOG_BATCH - len < RECORD_MAX)
+	    {
+	      log_write (log, log->batch, len);
+	      len = 0;
+	    }
+
+	  accesslog_record_t *rec = &r->records[tail & (log->size - 1)];
+	  len += record_format (rec, log->batch + len, stamp);
+	}
+
+      /* the slots are formatted, the owner may reuse them */
+      __atomic_store_n (&r->tail, tail, __ATOMIC_RELEASE);
+    }
+
+  if (len)
+    log_write (log, log->batch, len);
+
+  if (log->mode == ACCESSLOG_BLOCK)
+    {
+      pthread_mutex_lock (&log->lock);
+      pthread_cond_broadcast (&log->space);
+      pthread_mutex_unlock (&log->lock);
+    }
+}
+
+static void
+log_write (accesslog_t *log, const char *buf, size_t len)
+{
+  while (len)
+    {
+      ssize_t n = write (log->fd, buf, len);
+
+      if (n == -1 && errno == EINTR)
+	continue;
+
+      /* a full disk loses the batch, not the server */
+      if (n <= 0)
+	return;
+
+      buf += n;
+      len -= n;
+    }
+}
+
+static accesslog_ring_t *
+ring_new (accesslog_t *log)
+{
+  void *mem;
+  accesslog_ring_t *r;
+  size_t size = sizeof (*r) + log->size * sizeof (accesslog_record_t);
+
+  /* head and tail sit on lines of their own */
+  if (posix_memalign (&mem, 64, size) != 0)
+    return NULL;
+
+  r = mem;
+  r->head = r->tail = 0;
+
+  if (pthread_setspecific (log->key, r) != 0)
+    {
+      free (r);
+      return NULL;
+    }
+
+  /* pushed once per thread, the writer only ever walks forward */
+  r->next = __atomic_load_n (&log->rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n (&log->rings, &r->next, r, 1,
+				       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+
+  return r;
+}
+
+static bool
+ring_wait (accesslog_t *log, accesslog_ring_t *r, uint64_t head)
+{
+  bool ok;
+
+  pthread_mutex_lock (&log->lock);
+
+  while (!log->stop
+	 && head - __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE) == log->size)
+    {
+      log->kick = true;
+      pthread_cond_signal (&log->wake);
+      pthread_cond_wait (&log->space, &log->lock);
+    }
+
+  ok = !log->stop;
+  pthread_mutex_unlock (&log->lock);
+  return ok;
+}
+
+static size_t
+record_format (const accesslog_record_t *rec, char *buf, stamp_t *stamp)
+{
+  struct tm tm;
+  char *pos = buf;
+  const unsigned char *ip = (const unsigned char *) &rec->addr;
+
+  if (rec->time.tv_sec != stamp->sec)
+    {
+      stamp->sec = rec->time.tv_sec;
+      gmtime_r (&stamp->sec, &tm);
+      stamp->len = strftime (stamp->str, sizeof (stamp->str),
+			     "%d/%b/%Y:%H:%M:%S +0000", &tm);
+    }
+
+  /* common log format, the time taken to answer trails it */
+  pos += sprintf (pos, "%u.%u.%u.%u - - [%.*s] \"%s ", ip[0], ip[1], ip[2],
+		  ip[3], (int) stamp->len, stamp->str, rec->method);
+
+  /* the uri is the client's, quotes and controls are escaped */
+  for (size_t i = 0; i < rec->uri_len; i++)
+    {
+      unsigned char c = rec->uri[i];
+      if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\')
+	pos += sprintf (pos, "\\x%02x", c);
+      else
+	*pos++ = c;
+    }
+
+  pos += sprintf (pos, " %s\" %u ", rec->proto, rec->status);
+  if (rec->size >= 0)
+    pos += sprintf (pos, "%lld", (long long) rec->size);
+  else
+    *pos++ = '-';
+
+  pos += sprintf (pos, " %u.%06u\n", rec->usec / 1000000,
+		  rec->usec % 1000000);
+  return pos - buf;
+}
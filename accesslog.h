@@ -0,0 +1,82 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* records are 256 bytes, longer uris are cut */
+#define ACCESSLOG_URI 200
+#define ACCESSLOG_BATCH (256 << 10)
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+enum
+{
+  ACCESSLOG_DROP,
+  ACCESSLOG_BLOCK,
+};
+
+typedef struct accesslog_t accesslog_t;
+typedef struct accesslog_ring_t accesslog_ring_t;
+typedef struct accesslog_record_t accesslog_record_t;
+
+/* strings the record points to must be static, only the uri is copied */
+struct accesslog_record_t
+{
+  struct timespec time;
+  const char *method;
+  const char *proto;
+  uint32_t addr;
+  uint16_t status;
+  uint16_t uri_len;
+  uint32_t usec;
+  int64_t size;
+  char uri[ACCESSLOG_URI];
+};
+
+/* one per worker, the owner moves head and the writer moves tail */
+struct accesslog_ring_t
+{
+  accesslog_ring_t *next;
+  uint64_t head __attribute__ ((aligned (64)));
+  uint64_t tail __attribute__ ((aligned (64)));
+  accesslog_record_t records[];
+};
+
+struct accesslog_t
+{
+  int fd;
+  int mode;
+  bool stop;
+  bool kick;
+  char *path;
+  char *batch;
+  size_t size;
+  int interval;
+  unsigned hups;
+  uint64_t dropped;
+
+  pthread_key_t key;
+  accesslog_ring_t *rings;
+
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t space;
+};
+
+extern int accesslog_init (accesslog_t *log, const char *path, size_t size,
+			   int interval, int mode) attr_nonnull (1, 2);
+
+extern void accesslog_free (accesslog_t *log) attr_nonnull (1);
+
+extern bool accesslog_push (accesslog_t *log, const accesslog_record_t *rec)
+    attr_nonnull (1, 2);
+
+/* async-signal-safe, every log reopens its file at the writer's next wakeup;
+   the application installs it, usually for SIGHUP */
+extern void accesslog_hup (int sig);
+
+#endif
@@ -73,13 +73,15 @@ arena_aligned_alloc (arena_t *pool, size_t size, size_t align)
   padding = padding ? align - padding : 0;
   void *ptr = pool->pos + padding;
 
-  if (size + padding <= pool->remain)
-    size += padding;
-  else if (!(ptr = block_alloc (pool)))
-    return NULL;
+  if (size + padding > pool->remain)
+    {
+      if (!(ptr = block_alloc (pool)))
+	return NULL;
+      padding = 0;
+    }
 
-  pool->remain -= size;
-  pool->pos = ptr;
+  pool->remain -= size + padding;
+  pool->pos = ptr + size;
   return ptr;
 }
 
@@ -2,12 +2,66 @@
 #define CONFIG_H
 
 #define ROOT "."
+#define MIME NULL
+#define CERT NULL
+#define KEY NULL
+#define UPSTREAM NULL
+#define ACCESSLOG NULL
+#define STATS "/httpd"
 #define PORT 8080
 #define THREADS 16
 #define BACKLOG 32
-#define FLAGS SERVER_REUSEADDR
+#define FLAGS (SERVER_REUSEADDR | SERVER_GZIP | SERVER_NODELAY | SERVER_KTLS \
+	       | SERVER_MICROCACHE | SERVER_METRICS | SERVER_STATS)
+
+#define SEND_CHUNK (512 << 10)
+#define SEND_QUOTA (4 << 20)
+
+#define PIPELINE_MAX 16
+#define BODY_MAX (16 << 20)
+#define BODY_TIMEOUT (10 * 1000)
+#define BODY_MIN_RATE 512
+#define HEADER_TIMEOUT (10 * 1000)
+#define IDLE_TIMEOUT (60 * 1000)
+#define WRITE_TIMEOUT (30 * 1000)
+#define TIMER_TICK 100
+
+#define LIMIT_SIZE (64 << 10)
+#define LIMIT_CONNS 64
+#define LIMIT_RATE 100
+#define LIMIT_BURST 200
+#define H2_STREAMS 128
+
+#define WS_MESSAGE_MAX (1 << 20)
+#define WS_OUTBOX_MAX (4 << 20)
+
+#define PROXY_IDLE 16
+#define PROXY_CONNECT_TIMEOUT (1 * 1000)
+#define PROXY_TIMEOUT (30 * 1000)
+
+#define MICROCACHE_SIZE (32 << 20)
+#define MICROCACHE_ITEM_MAX (1 << 20)
+#define MICROCACHE_WAIT (5 * 1000)
+#define MICROCACHE_PASS 5
+
+#define METRICS_PATH "/metrics"
+
+#define ACCESSLOG_RING 4096
+#define ACCESSLOG_INTERVAL 200
+
+#define TLS_CACHE (20 << 10)
+
+#define GZIP_LEVEL 6
+#define GZIP_MIN (1 << 10)
+#define GZIP_MAX (4 << 20)
+#define GZIP_CACHE (64 << 20)
 
 static const char *indexs[] = { "index.htm", "index.html" };
 static const int indexs_size = sizeof (indexs) / sizeof (*indexs);
 
+/* request fields the micro-cache keys on, answers varying on others are not
+   kept */
+static const char *cache_vary[] = { "Accept-Encoding" };
+static const int cache_vary_size = sizeof (cache_vary) / sizeof (*cache_vary);
+
 #endif
@@ -0,0 +1,75 @@
+#include "gzip.h"
+
+#include <unistd.h>
+
+/* gzip wrapper instead of zlib */
+#define WINDOW_BITS (15 + 16)
+#define MEM_LEVEL 8
+
+void
+gzip_free (gzip_t *zip)
+{
+  deflateEnd (&zip->strm);
+}
+
+size_t
+gzip_bound (size_t size)
+{
+  /* deflateBound plus the gzip header and trailer */
+  return size + (size >> 12) + (size >> 14) + (size >> 25) + 13 + 18;
+}
+
+int
+gzip_init (gzip_t *zip, int fd, size_t size, int level)
+{
+  *zip = (gzip_t) { .fd = fd, .remain = size };
+  return deflateInit2 (&zip->strm, level, Z_DEFLATED, WINDOW_BITS, MEM_LEVEL,
+		       Z_DEFAULT_STRATEGY);
+}
+
+ssize_t
+gzip_read (gzip_t *zip, void *dst, size_t max)
+{
+  static __thread unsigned char in[GZIP_BLOCK_SIZE];
+  z_stream *strm = &zip->strm;
+
+  if (zip->done)
+    return 0;
+
+  strm->next_out = dst;
+  strm->avail_out = max;
+
+  for (int ret; strm->avail_out;)
+    {
+      if (!strm->avail_in && zip->remain)
+	{
+	  ssize_t n;
+	  size_t size = zip->remain < sizeof (in) ? zip->remain : sizeof (in);
+
+	  if ((n = pread (zip->fd, in, size, zip->off)) <= 0)
+	    return -1;
+
+	  zip->off += n;
+	  zip->remain -= n;
+	  strm->next_in = in;
+	  strm->avail_in = n;
+	}
+
+      int flush = zip->remain ? Z_NO_FLUSH : Z_FINISH;
+      if ((ret = deflate (strm, flush)) == Z_STREAM_END)
+	{
+	  zip->done = true;
+	  break;
+	}
+
+      if (ret != Z_OK && ret != Z_BUF_ERROR)
+	return -1;
+    }
+
+  /* the input block is per thread, hand back what was not consumed */
+  zip->off -= strm->avail_in;
+  zip->remain += strm->avail_in;
+  strm->avail_in = 0;
+
+  return max - strm->avail_out;
+}
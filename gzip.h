@@ -0,0 +1,34 @@
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#define GZIP_BLOCK_SIZE (64 << 10)
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+typedef struct gzip_t gzip_t;
+
+struct gzip_t
+{
+  int fd;
+  bool done;
+  off_t off;
+  size_t remain;
+  z_stream strm;
+};
+
+extern void gzip_free (gzip_t *zip) attr_nonnull (1);
+
+extern size_t gzip_bound (size_t size);
+
+extern int gzip_init (gzip_t *zip, int fd, size_t size, int level)
+    attr_nonnull (1);
+
+extern ssize_t gzip_read (gzip_t *zip, void *dst, size_t max)
+    attr_nonnull (1, 2);
+
+#endif
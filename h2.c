@@ -0,0 +1,964 @@
+#include "h2.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define STR(s) s, sizeof (s) - 1
+
+#define get16(p) ((uint16_t) ((p)[0] << 8 | (p)[1]))
+#define get32(p)                                                              \
+  ((uint32_t) (p)[0] << 24 | (uint32_t) (p)[1] << 16 | (p)[2] << 8 | (p)[3])
+
+#define put32(p, v)                                                           \
+  do                                                                          \
+    {                                                                         \
+      (p)[0] = (v) >> 24;                                                     \
+      (p)[1] = (v) >> 16;                                                     \
+      (p)[2] = (v) >> 8;                                                      \
+      (p)[3] = (v);                                                           \
+    }                                                                         \
+  while (0)
+
+static void conn_error (h2_t *h2, int code);
+static bool frame_head (h2_t *h2, int type, int flags, uint32_t id,
+			size_t len);
+static bool frame_put (h2_t *h2, int type, int flags, uint32_t id,
+		       const void *data, size_t len);
+static bool window_put (h2_t *h2, uint32_t id, uint32_t inc);
+
+static h2_stream_t *stream_new (h2_t *h2, uint32_t id);
+static h2_stream_t *stream_find (h2_t *h2, uint32_t id);
+static h2_stream_t *stream_next (h2_t *h2);
+static void stream_close (h2_t *h2, h2_stream_t *st);
+static void stream_finish (h2_t *h2, h2_stream_t *st);
+static ssize_t stream_emit (h2_t *h2, h2_stream_t *st, size_t max);
+static void stream_priority (h2_stream_t *st, const char *value, size_t len);
+
+static void on_frame (h2_t *h2, int type, int flags, uint32_t id,
+		      const uint8_t *data, size_t len);
+static void on_data (h2_t *h2, int flags, uint32_t id, size_t len);
+static void on_headers (h2_t *h2, int flags, uint32_t id,
+			const uint8_t *data, size_t len);
+static void on_block (h2_t *h2, const uint8_t *data, size_t len);
+static void on_settings (h2_t *h2, int flags, const uint8_t *data,
+			 size_t len);
+static void on_window (h2_t *h2, uint32_t id, const uint8_t *data,
+		       size_t len);
+
+static int settings_apply (h2_t *h2, const uint8_t *data, size_t len);
+static bool field_emit (void *arg, const hpack_field_t *field);
+static ssize_t base64_decode (uint8_t *dst, const char *src, size_t len);
+
+void
+h2_free (h2_t *h2)
+{
+  for (; h2->list;)
+    stream_close (h2, h2->list);
+
+  hpack_free (&h2->hpack);
+  free (h2->block.data);
+  free (h2->fields.data);
+  free (h2->fields.strs);
+}
+
+int
+h2_init (h2_t *h2, response_t *out, size_t streams, h2_handler_t *handler,
+	 void *arg)
+{
+  *h2 = (h2_t) {
+    .max_streams = streams,
+    .window = H2_WINDOW_SIZE,
+    .init_window = H2_WINDOW_SIZE,
+    .frame_max = H2_FRAME_SIZE,
+    .hpack = HPACK_INIT (HPACK_TABLE_SIZE),
+    .out = out,
+    .arg = arg,
+    .handler = handler,
+  };
+
+  /* server preface */
+  uint8_t settings[6] = { 0, H2_SETTINGS_MAX_CONCURRENT_STREAMS };
+  put32 (settings + 2, streams);
+
+  if (!frame_put (h2, H2_SETTINGS, 0, 0, settings, sizeof (settings)))
+    return -1;
+
+  return 0;
+}
+
+h2_stream_t *
+h2_upgrade (h2_t *h2, const char *settings, size_t len)
+{
+  ssize_t n;
+  h2_stream_t *st;
+  uint8_t data[H2_UPGRADE_MAX * 3 / 4 + 3];
+
+  /* the settings a client sends along with Upgrade: h2c */
+  if (len > H2_UPGRADE_MAX || (n = base64_decode (data, settings, len)) < 0
+      || n % 6)
+    return NULL;
+
+  if (settings_apply (h2, data, n) != H2_NO_ERROR)
+    return NULL;
+
+  /* the upgraded request becomes stream 1, half closed */
+  if (!(st = stream_new (h2, 1)))
+    return NULL;
+
+  st->remote_end = true;
+  h2->last_id = 1;
+  return st;
+}
+
+size_t
+h2_recv (h2_t *h2, const void *data, size_t len)
+{
+  const uint8_t *pos = data, *end = pos + len;
+
+  if (!h2->preface)
+    {
+      size_t n = len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN;
+
+      if (memcmp (pos, H2_PREFACE, n) != 0)
+	{
+	  h2->error = h2->closing = true;
+	  return len;
+	}
+
+      if (n < H2_PREFACE_LEN)
+	return 0;
+
+      pos += H2_PREFACE_LEN;
+      h2->preface = true;
+    }
+
+  for (size_t size; !h2->error && end - pos >= H2_FRAME_HEAD;)
+    {
+      size = pos[0] << 16 | pos[1] << 8 | pos[2];
+
+      /* we never raise SETTINGS_MAX_FRAME_SIZE */
+      if (size > H2_FRAME_SIZE)
+	{
+	  conn_error (h2, H2_FRAME_SIZE_ERROR);
+	  break;
+	}
+
+      if ((size_t) (end - pos) < H2_FRAME_HEAD + size)
+	break;
+
+      uint32_t id = get32 (pos + 5) & H2_WINDOW_MAX;
+      on_frame (h2, pos[3], pos[4], id, pos + H2_FRAME_HEAD, size);
+      pos += H2_FRAME_HEAD + size;
+    }
+
+  /* after a connection error the rest of the input is noise */
+  return h2->error ? len : (size_t) (pos - (const uint8_t *) data);
+}
+
+bool
+h2_pump (h2_t *h2, size_t budget)
+{
+  for (size_t sent = 0;;)
+    {
+      h2_stream_t *st;
+
+      /* an upgraded stream waits for the client preface */
+      if (h2->error || !h2->preface || !(st = stream_next (h2)))
+	return false;
+
+      /* more is ready than the caller wants queued */
+      if (sent >= budget)
+	return true;
+
+      size_t max = h2->frame_max;
+      if ((int64_t) max > h2->window)
+	max = h2->window;
+      if ((int64_t) max > st->window)
+	max = st->window;
+      if (max > budget - sent)
+	max = budget - sent;
+
+      if (st->incremental)
+	st->stamp = ++h2->turn;
+
+      ssize_t n;
+      if ((n = stream_emit (h2, st, max)) < 0)
+	{
+	  conn_error (h2, H2_INTERNAL_ERROR);
+	  return false;
+	}
+
+      sent += H2_FRAME_HEAD + n;
+    }
+}
+
+void
+h2_reset (h2_t *h2, h2_stream_t *st, int code)
+{
+  uint8_t data[4];
+  put32 (data, code);
+
+  if (!frame_put (h2, H2_RST_STREAM, 0, st->id, data, sizeof (data)))
+    h2->error = true;
+
+  if (st->busy)
+    response_seg_free (&st->body);
+
+  st->busy = false;
+  st->local_end = st->remote_end = true;
+  st->responded = true;
+}
+
+void
+h2_settle (h2_t *h2, h2_stream_t *st)
+{
+  if (!st->responded)
+    h2_reset (h2, st, H2_INTERNAL_ERROR);
+
+  /* the body goes out from h2_pump */
+  if (!st->busy)
+    stream_finish (h2, st);
+}
+
+bool
+h2_respond (h2_t *h2, h2_stream_t *st, int status,
+	    const hpack_field_t *fields, size_t cnt, bool end)
+{
+  size_t len = 0;
+  uint8_t block[H2_FRAME_SIZE];
+  char code[3] = { '0' + status / 100 % 10, '0' + status / 10 % 10,
+		   '0' + status % 10 };
+
+  hpack_field_t field = { STR (":status"), code, sizeof (code) };
+  len += hpack_encode_field (block, &field);
+
+  /* one frame is plenty for our own headers */
+  for (size_t i = 0; i < cnt; i++)
+    {
+      size_t need = HPACK_FIELD_BOUND (fields[i].name_len, fields[i].value_len);
+      if (len + need > sizeof (block))
+	return false;
+
+      len += hpack_encode_field (block + len, &fields[i]);
+    }
+
+  int flags = H2_FLAG_END_HEADERS | (end ? H2_FLAG_END_STREAM : 0);
+  if (!frame_put (h2, H2_HEADERS, flags, st->id, block, len))
+    return false;
+
+  st->responded = true;
+  st->local_end = end;
+  return true;
+}
+
+bool
+h2_send_ref (h2_t *h2, h2_stream_t *st, const void *data, size_t len)
+{
+  (void) h2;
+
+  st->body = (response_seg_t) {
+    .type = RESPONSE_SEG_REF,
+    .len = len,
+    .ref = data,
+  };
+
+  st->busy = true;
+  return true;
+}
+
+bool
+h2_send_blob (h2_t *h2, h2_stream_t *st, resource_blob_t *blob, size_t off,
+	      size_t len)
+{
+  (void) h2;
+
+  st->body = (response_seg_t) {
+    .type = RESPONSE_SEG_BLOB,
+    .off = off,
+    .len = off + len,
+    .blob = blob,
+  };
+
+  st->busy = true;
+  return true;
+}
+
+bool
+h2_send_file (h2_t *h2, h2_stream_t *st, resource_t *file, int fd, off_t off,
+	      size_t len)
+{
+  (void) h2;
+
+  st->body = (response_seg_t) {
+    .type = RESPONSE_SEG_FILE,
+    .len = len,
+    .file = { .fd = fd, .pos = off, .res = file },
+  };
+
+  st->busy = true;
+  return true;
+}
+
+bool
+h2_send_stream (h2_t *h2, h2_stream_t *st, response_read_t *read,
+		response_close_t *close, void *arg)
+{
+  (void) h2;
+
+  st->body = (response_seg_t) {
+    .type = RESPONSE_SEG_STREAM,
+    .stream = { .arg = arg, .read = read, .close = close },
+  };
+
+  st->busy = true;
+  return true;
+}
+
+static inline void
+conn_error (h2_t *h2, int code)
+{
+  uint8_t data[8];
+
+  if (h2->error)
+    return;
+
+  put32 (data, h2->last_id);
+  put32 (data + 4, code);
+
+  frame_put (h2, H2_GOAWAY, 0, 0, data, sizeof (data));
+  h2->error = h2->closing = true;
+}
+
+static inline bool
+frame_head (h2_t *h2, int type, int flags, uint32_t id, size_t len)
+{
+  uint8_t head[H2_FRAME_HEAD] = { len >> 16, len >> 8, len, type, flags };
+  put32 (head + 5, id);
+
+  return response_add_copy (h2->out, head, sizeof (head));
+}
+
+static inline bool
+frame_put (h2_t *h2, int type, int flags, uint32_t id, const void *data,
+	   size_t len)
+{
+  return frame_head (h2, type, flags, id, len)
+	 && response_add_copy (h2->out, data, len);
+}
+
+static inline bool
+window_put (h2_t *h2, uint32_t id, uint32_t inc)
+{
+  uint8_t data[4];
+  put32 (data, inc);
+
+  return frame_put (h2, H2_WINDOW_UPDATE, 0, id, data, sizeof (data));
+}
+
+static inline h2_stream_t *
+stream_new (h2_t *h2, uint32_t id)
+{
+  h2_stream_t *st;
+  if (!(st = calloc (1, sizeof (h2_stream_t))))
+    return NULL;
+
+  st->id = id;
+  st->urgency = H2_URGENCY;
+  st->window = h2->init_window;
+
+  if ((st->next = h2->list))
+    h2->list->prev = st;
+
+  h2->list = st;
+  h2->streams++;
+  return st;
+}
+
+static inline h2_stream_t *
+stream_find (h2_t *h2, uint32_t id)
+{
+  for (h2_stream_t *st = h2->list; st; st = st->next)
+    if (st->id == id)
+      return st;
+
+  return NULL;
+}
+
+static inline bool
+stream_ready (h2_t *h2, h2_stream_t *st)
+{
+  if (!st->busy)
+    return false;
+
+  /* an empty tail needs no credit */
+  if (st->body.type != RESPONSE_SEG_STREAM && st->body.off == st->body.len)
+    return true;
+
+  return h2->window > 0 && st->window > 0;
+}
+
+static inline bool
+stream_before (const h2_stream_t *a, const h2_stream_t *b)
+{
+  /* lower urgency first, then sequential before incremental */
+  if (a->urgency != b->urgency)
+    return a->urgency < b->urgency;
+  if (a->incremental != b->incremental)
+    return !a->incremental;
+
+  /* incremental streams take turns */
+  if (a->incremental && a->stamp != b->stamp)
+    return a->stamp < b->stamp;
+
+  return a->id < b->id;
+}
+
+static inline h2_stream_t *
+stream_next (h2_t *h2)
+{
+  h2_stream_t *best = NULL;
+
+  for (h2_stream_t *st = h2->list; st; st = st->next)
+    if (stream_ready (h2, st) && (!best || stream_before (st, best)))
+      best = st;
+
+  return best;
+}
+
+static inline void
+stream_close (h2_t *h2, h2_stream_t *st)
+{
+  if (st->busy)
+    response_seg_free (&st->body);
+
+  if (st->prev)
+    st->prev->next = st->next;
+  else
+    h2->list = st->next;
+
+  if (st->next)
+    st->next->prev = st->prev;
+
+  h2->streams--;
+  free (st);
+}
+
+static inline ssize_t
+stream_emit (h2_t *h2, h2_stream_t *st, size_t max)
+{
+  bool ok, end;
+  size_t n = st->body.len - st->body.off;
+  response_seg_t *body = &st->body;
+
+  if (body->type == RESPONSE_SEG_STREAM)
+    {
+      ssize_t got;
+      static __thread uint8_t chunk[H2_FRAME_SIZE];
+
+      if (max > sizeof (chunk))
+	max = sizeof (chunk);
+
+      /* a broken producer only takes its own stream down */
+      if ((got = body->stream.read (body->stream.arg, chunk, max)) < 0)
+	{
+	  h2_reset (h2, st, H2_INTERNAL_ERROR);
+	  stream_close (h2, st);
+	  return h2->error ? -1 : 0;
+	}
+
+      n = got;
+      end = n == 0;
+
+      ok = frame_head (h2, H2_DATA, end ? H2_FLAG_END_STREAM : 0, st->id, n)
+	   && response_add_copy (h2->out, chunk, n);
+    }
+  else
+    {
+      if (n > max)
+	n = max;
+
+      end = body->off + n == body->len;
+      ok = frame_head (h2, H2_DATA, end ? H2_FLAG_END_STREAM : 0, st->id, n);
+
+      /* every frame holds its own reference on shared bodies */
+      switch (body->type)
+	{
+	case RESPONSE_SEG_REF:
+	  ok = ok && response_add_ref (h2->out, body->ref + body->off, n);
+	  break;
+
+	case RESPONSE_SEG_BLOB:
+	  ok = response_add_blob (h2->out, respool_blob_hold (body->blob),
+				  body->off, n)
+	       && ok;
+	  break;
+
+	case RESPONSE_SEG_FILE:
+	  ok = response_add_file (h2->out, respool_hold (body->file.res),
+				  body->file.fd, body->file.pos + body->off, n)
+	       && ok;
+	  break;
+	}
+
+      body->off += n;
+    }
+
+  /* a half written frame ruins the connection */
+  if (!ok)
+    return -1;
+
+  h2->window -= n;
+  st->window -= n;
+
+  if (end)
+    {
+      st->local_end = true;
+      response_seg_free (body);
+      st->busy = false;
+      stream_finish (h2, st);
+    }
+
+  return n;
+}
+
+static inline void
+stream_finish (h2_t *h2, h2_stream_t *st)
+{
+  /* headers went out without END_STREAM and no body followed */
+  if (!st->local_end
+      && !frame_put (h2, H2_DATA, H2_FLAG_END_STREAM, st->id, NULL, 0))
+    h2->error = true;
+
+  /* the client may stop sending the rest of its request */
+  if (!st->remote_end)
+    h2_reset (h2, st, H2_NO_ERROR);
+
+  stream_close (h2, st);
+}
+
+static inline void
+stream_priority (h2_stream_t *st, const char *value, size_t len)
+{
+  const char *pos = value, *end = value + len;
+
+  for (const char *next; pos < end; pos = next + 1)
+    {
+      if (!(next = memchr (pos, ',', end - pos)))
+	next = end;
+
+      pos += strspn (pos, " \t");
+      size_t n = next - pos;
+      for (; n && (pos[n - 1] == ' ' || pos[n - 1] == '\t');)
+	n--;
+
+      if (n == 3 && pos[0] == 'u' && pos[1] == '=' && pos[2] >= '0'
+	  && pos[2] <= '7')
+	st->urgency = pos[2] - '0';
+      else if ((n == 1 && pos[0] == 'i') || (n == 4 && !memcmp (pos, "i=?1", 4)))
+	st->incremental = true;
+      else if (n == 4 && !memcmp (pos, "i=?0", 4))
+	st->incremental = false;
+    }
+}
+
+static inline void
+on_frame (h2_t *h2, int type, int flags, uint32_t id, const uint8_t *data,
+	  size_t len)
+{
+  h2_stream_t *st;
+
+  /* header blocks are never interleaved */
+  if (h2->block.id && (type != H2_CONTINUATION || id != h2->block.id))
+    return conn_error (h2, H2_PROTOCOL_ERROR);
+
+  switch (type)
+    {
+    case H2_DATA:
+      return on_data (h2, flags, id, len);
+
+    case H2_HEADERS:
+      return on_headers (h2, flags, id, data, len);
+
+    case H2_CONTINUATION:
+      if (!h2->block.id)
+	return conn_error (h2, H2_PROTOCOL_ERROR);
+
+      h2->block.flags |= flags & H2_FLAG_END_HEADERS;
+      return on_block (h2, data, len);
+
+    case H2_RST_STREAM:
+      if (!id)
+	return conn_error (h2, H2_PROTOCOL_ERROR);
+      if (len != 4)
+	return conn_error (h2, H2_FRAME_SIZE_ERROR);
+
+      if ((st = stream_find (h2, id)))
+	stream_close (h2, st);
+      return;
+
+    case H2_SETTINGS:
+      if (id)
+	return conn_error (h2, H2_PROTOCOL_ERROR);
+      return on_settings (h2, flags, data, len);
+
+    case H2_PING:
+      if (id)
+	return conn_error (h2, H2_PROTOCOL_ERROR);
+      if (len != 8)
+	return conn_error (h2, H2_FRAME_SIZE_ERROR);
+
+      if (!(flags & H2_FLAG_ACK)
+	  && !frame_put (h2, H2_PING, H2_FLAG_ACK, 0, data, len))
+	h2->error = true;
+      return;
+
+    case H2_GOAWAY:
+      if (id)
+	return conn_error (h2, H2_PROTOCOL_ERROR);
+      if (len < 8)
+	return conn_error (h2, H2_FRAME_SIZE_ERROR);
+
+      /* finish what is in flight, take nothing new */
+      h2->closing = true;
+      return;
+
+    case H2_WINDOW_UPDATE:
+      return on_window (h2, id, data, len);
+
+    case H2_PUSH_PROMISE:
+      return conn_error (h2, H2_PROTOCOL_ERROR);
+
+    case H2_PRIORITY_UPDATE:
+      if (id)
+	return conn_error (h2, H2_PROTOCOL_ERROR);
+      if (len < 4)
+	return conn_error (h2, H2_FRAME_SIZE_ERROR);
+
+      if ((st = stream_find (h2, get32 (data) & H2_WINDOW_MAX)))
+	stream_priority (st, (const char *) data + 4, len - 4);
+      return;
+
+    default:
+      /* PRIORITY is deprecated, unknown types are ignored */
+      return;
+    }
+}
+
+static inline void
+on_data (h2_t *h2, int flags, uint32_t id, size_t len)
+{
+  h2_stream_t *st;
+
+  if (!id)
+    return conn_error (h2, H2_PROTOCOL_ERROR);
+
+  st = stream_find (h2, id);
+
+  /* request bodies are not consumed yet, hand the credit back */
+  if (len && !window_put (h2, 0, len))
+    h2->error = true;
+
+  if (st && len && !(flags & H2_FLAG_END_STREAM) && !window_put (h2, id, len))
+    h2->error = true;
+
+  if (st && (flags & H2_FLAG_END_STREAM))
+    st->remote_end = true;
+}
+
+static inline void
+on_headers (h2_t *h2, int flags, uint32_t id, const uint8_t *data,
+	    size_t len)
+{
+  const uint8_t *pos = data, *end = data + len;
+
+  /* clients open odd streams only */
+  if (!id || !(id & 1))
+    return conn_error (h2, H2_PROTOCOL_ERROR);
+
+  if (flags & H2_FLAG_PADDED)
+    {
+      if (!len || data[0] >= len)
+	return conn_error (h2, H2_PROTOCOL_ERROR);
+
+      end -= data[0];
+      pos++;
+    }
+
+  /* stream dependencies are deprecated */
+  if (flags & H2_FLAG_PRIORITY)
+    {
+      if (end - pos < 5)
+	return conn_error (h2, H2_PROTOCOL_ERROR);
+      pos += 5;
+    }
+
+  h2->block.id = id;
+  h2->block.flags = flags;
+  h2->block.len = 0;
+
+  on_block (h2, pos, end - pos);
+}
+
+static inline void
+on_block (h2_t *h2, const uint8_t *data, size_t len)
+{
+  h2_stream_t *st;
+
+  if (h2->block.len + len > H2_BLOCK_MAX)
+    return conn_error (h2, H2_ENHANCE_YOUR_CALM);
+
+  if (h2->block.len + len > h2->block.cap)
+    {
+      uint8_t *buf;
+      size_t cap = h2->block.len + len;
+
+      if (!(buf = realloc (h2->block.data, cap)))
+	return conn_error (h2, H2_INTERNAL_ERROR);
+
+      h2->block.data = buf;
+      h2->block.cap = cap;
+    }
+
+  if (len)
+    memcpy (h2->block.data + h2->block.len, data, len);
+  h2->block.len += len;
+
+  /* wait for the rest of the block */
+  if (!(h2->block.flags & H2_FLAG_END_HEADERS))
+    return;
+
+  uint32_t id = h2->block.id;
+  bool end = h2->block.flags & H2_FLAG_END_STREAM;
+
+  /* always decode, the table must stay in sync */
+  h2->block.id = 0;
+  h2->fields.cnt = h2->fields.len = 0;
+  if (hpack_decode (&h2->hpack, h2->block.data, h2->block.len, field_emit, h2)
+      != 0)
+    return conn_error (h2, H2_COMPRESSION_ERROR);
+
+  /* fields were stored as offsets, the buffer may have moved */
+  for (size_t i = 0; i < h2->fields.cnt; i++)
+    {
+      hpack_field_t *f = &h2->fields.data[i];
+      f->name = h2->fields.strs + (uintptr_t) f->name;
+      f->value = h2->fields.strs + (uintptr_t) f->value;
+    }
+
+  /* trailers, or a stream we already answered */
+  if (id <= h2->last_id)
+    {
+      if ((st = stream_find (h2, id)) && end)
+	st->remote_end = true;
+      return;
+    }
+
+  h2->last_id = id;
+
+  /* nothing new after GOAWAY */
+  if (h2->closing)
+    return;
+
+  if (h2->streams >= h2->max_streams)
+    {
+      uint8_t code[4];
+      put32 (code, H2_REFUSED_STREAM);
+
+      if (!frame_put (h2, H2_RST_STREAM, 0, id, code, sizeof (code)))
+	h2->error = true;
+      return;
+    }
+
+  if (!(st = stream_new (h2, id)))
+    return conn_error (h2, H2_INTERNAL_ERROR);
+
+  st->remote_end = end;
+
+  for (size_t i = 0; i < h2->fields.cnt; i++)
+    {
+      hpack_field_t *f = &h2->fields.data[i];
+      if (f->name_len == 8 && memcmp (f->name, "priority", 8) == 0)
+	stream_priority (st, f->value, f->value_len);
+    }
+
+  h2->handler (h2->arg, st, h2->fields.data, h2->fields.cnt);
+  h2_settle (h2, st);
+}
+
+static inline void
+on_settings (h2_t *h2, int flags, const uint8_t *data, size_t len)
+{
+  int code;
+
+  if (flags & H2_FLAG_ACK)
+    {
+      if (len)
+	conn_error (h2, H2_FRAME_SIZE_ERROR);
+      return;
+    }
+
+  if (len % 6)
+    return conn_error (h2, H2_FRAME_SIZE_ERROR);
+
+  if ((code = settings_apply (h2, data, len)) != H2_NO_ERROR)
+    return conn_error (h2, code);
+
+  if (!frame_put (h2, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0))
+    h2->error = true;
+}
+
+static inline void
+on_window (h2_t *h2, uint32_t id, const uint8_t *data, size_t len)
+{
+  h2_stream_t *st;
+
+  if (len != 4)
+    return conn_error (h2, H2_FRAME_SIZE_ERROR);
+
+  uint32_t inc = get32 (data) & H2_WINDOW_MAX;
+
+  if (!id)
+    {
+      if (!inc)
+	return conn_error (h2, H2_PROTOCOL_ERROR);
+      if ((h2->window += inc) > H2_WINDOW_MAX)
+	return conn_error (h2, H2_FLOW_CONTROL_ERROR);
+      return;
+    }
+
+  if (!(st = stream_find (h2, id)))
+    return;
+
+  if (!inc || (st->window += inc) > H2_WINDOW_MAX)
+    {
+      h2_reset (h2, st, inc ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+      stream_close (h2, st);
+    }
+}
+
+static inline int
+settings_apply (h2_t *h2, const uint8_t *data, size_t len)
+{
+  for (size_t i = 0; i + 6 <= len; i += 6)
+    {
+      uint32_t val = get32 (data + i + 2);
+
+      switch (get16 (data + i))
+	{
+	case H2_SETTINGS_ENABLE_PUSH:
+	  if (val > 1)
+	    return H2_PROTOCOL_ERROR;
+	  break;
+
+	case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+	  if (val > H2_WINDOW_MAX)
+	    return H2_FLOW_CONTROL_ERROR;
+
+	  /* open streams shift by the difference */
+	  for (h2_stream_t *st = h2->list; st; st = st->next)
+	    if ((st->window += (int64_t) val - h2->init_window) > H2_WINDOW_MAX)
+	      return H2_FLOW_CONTROL_ERROR;
+
+	  h2->init_window = val;
+	  break;
+
+	case H2_SETTINGS_MAX_FRAME_SIZE:
+	  if (val < H2_FRAME_SIZE || val > 0xffffff)
+	    return H2_PROTOCOL_ERROR;
+	  h2->frame_max = val;
+	  break;
+	}
+    }
+
+  return H2_NO_ERROR;
+}
+
+static bool
+field_emit (void *arg, const hpack_field_t *field)
+{
+  h2_t *h2 = arg;
+  size_t need = h2->fields.len + field->name_len + field->value_len;
+
+  /* bound the decoded list as well as the block */
+  if (need > H2_BLOCK_MAX * 2)
+    return false;
+
+  if (need > h2->fields.size)
+    {
+      char *strs;
+      size_t size = h2->fields.size ? h2->fields.size : 1024;
+
+      for (; size < need;)
+	size <<= 1;
+
+      if (!(strs = realloc (h2->fields.strs, size)))
+	return false;
+
+      h2->fields.strs = strs;
+      h2->fields.size = size;
+    }
+
+  if (h2->fields.cnt >= h2->fields.cap)
+    {
+      hpack_field_t *data;
+      size_t cap = h2->fields.cap ? h2->fields.cap * 2 : 32;
+
+      if (!(data = realloc (h2->fields.data, cap * sizeof (hpack_field_t))))
+	return false;
+
+      h2->fields.data = data;
+      h2->fields.cap = cap;
+    }
+
+  /* copy out, table entries may be evicted by later fields */
+  char *pos = h2->fields.strs + h2->fields.len;
+  memcpy (pos, field->name, field->name_len);
+  memcpy (pos + field->name_len, field->value, field->value_len);
+
+  h2->fields.data[h2->fields.cnt++] = (hpack_field_t) {
+    .name = (const char *) (uintptr_t) h2->fields.len,
+    .name_len = field->name_len,
+    .value = (const char *) (uintptr_t) (h2->fields.len + field->name_len),
+    .value_len = field->value_len,
+  };
+
+  h2->fields.len = need;
+  return true;
+}
+
+static inline ssize_t
+base64_decode (uint8_t *dst, const char *src, size_t len)
+{
+  size_t n = 0;
+  uint32_t acc = 0;
+  int bits = 0;
+
+  for (size_t i = 0; i < len; i++)
+    {
+      int v, c = src[i];
+
+      if (c >= 'A' && c <= 'Z')
+	v = c - 'A';
+      else if (c >= 'a' && c <= 'z')
+	v = c - 'a' + 26;
+      else if (c >= '0' && c <= '9')
+	v = c - '0' + 52;
+      else if (c == '-' || c == '+')
+	v = 62;
+      else if (c == '_' || c == '/')
+	v = 63;
+      else if (c == '=')
+	break;
+      else
+	return -1;
+
+      acc = acc << 6 | v;
+      if ((bits += 6) >= 8)
+	{
+	  bits -= 8;
+	  dst[n++] = acc >> bits;
+	}
+    }
+
+  return n;
+}
@@ -0,0 +1,177 @@
+#ifndef H2_H
+#define H2_H
+
+#include "hpack.h"
+#include "response.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN (sizeof (H2_PREFACE) - 1)
+
+#define H2_FRAME_HEAD 9
+#define H2_FRAME_SIZE 16384
+#define H2_WINDOW_SIZE 65535
+#define H2_WINDOW_MAX 0x7fffffff
+#define H2_BLOCK_MAX (64 << 10)
+#define H2_URGENCY 3
+#define H2_UPGRADE_MAX 1024
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+enum
+{
+  H2_DATA,
+  H2_HEADERS,
+  H2_PRIORITY,
+  H2_RST_STREAM,
+  H2_SETTINGS,
+  H2_PUSH_PROMISE,
+  H2_PING,
+  H2_GOAWAY,
+  H2_WINDOW_UPDATE,
+  H2_CONTINUATION,
+  H2_PRIORITY_UPDATE = 0x10,
+};
+
+enum
+{
+  H2_NO_ERROR,
+  H2_PROTOCOL_ERROR,
+  H2_INTERNAL_ERROR,
+  H2_FLOW_CONTROL_ERROR,
+  H2_SETTINGS_TIMEOUT,
+  H2_STREAM_CLOSED,
+  H2_FRAME_SIZE_ERROR,
+  H2_REFUSED_STREAM,
+  H2_CANCEL,
+  H2_COMPRESSION_ERROR,
+  H2_CONNECT_ERROR,
+  H2_ENHANCE_YOUR_CALM,
+};
+
+enum
+{
+  H2_FLAG_ACK = 0x01,
+  H2_FLAG_END_STREAM = 0x01,
+  H2_FLAG_END_HEADERS = 0x04,
+  H2_FLAG_PADDED = 0x08,
+  H2_FLAG_PRIORITY = 0x20,
+};
+
+enum
+{
+  H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+  H2_SETTINGS_ENABLE_PUSH,
+  H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+  H2_SETTINGS_INITIAL_WINDOW_SIZE,
+  H2_SETTINGS_MAX_FRAME_SIZE,
+  H2_SETTINGS_MAX_HEADER_LIST_SIZE,
+};
+
+typedef struct h2_t h2_t;
+typedef struct h2_stream_t h2_stream_t;
+
+typedef void h2_handler_t (void *arg, h2_stream_t *st,
+			   const hpack_field_t *fields, size_t cnt);
+
+struct h2_stream_t
+{
+  uint32_t id;
+  int urgency;
+  bool incremental;
+
+  bool busy;
+  bool local_end;
+  bool remote_end;
+  bool responded;
+
+  int64_t window;
+  uint64_t stamp;
+  response_seg_t body;
+
+  h2_stream_t *prev;
+  h2_stream_t *next;
+};
+
+struct h2_t
+{
+  bool error;
+  bool closing;
+  bool preface;
+
+  uint32_t last_id;
+  size_t streams;
+  size_t max_streams;
+  h2_stream_t *list;
+
+  int64_t window;
+  int64_t init_window;
+  size_t frame_max;
+  uint64_t turn;
+
+  hpack_t hpack;
+  response_t *out;
+
+  void *arg;
+  h2_handler_t *handler;
+
+  struct
+  {
+    uint32_t id;
+    uint8_t flags;
+    size_t len;
+    size_t cap;
+    uint8_t *data;
+  } block;
+
+  struct
+  {
+    size_t cnt;
+    size_t cap;
+    hpack_field_t *data;
+    size_t len;
+    size_t size;
+    char *strs;
+  } fields;
+};
+
+#define h2_done(h2) ((h2)->error || ((h2)->closing && !(h2)->streams))
+
+extern void h2_free (h2_t *h2) attr_nonnull (1);
+
+extern int h2_init (h2_t *h2, response_t *out, size_t streams,
+		    h2_handler_t *handler, void *arg) attr_nonnull (1, 2, 4);
+
+extern h2_stream_t *h2_upgrade (h2_t *h2, const char *settings, size_t len)
+    attr_nonnull (1, 2);
+
+extern size_t h2_recv (h2_t *h2, const void *data, size_t len)
+    attr_nonnull (1, 2);
+
+extern bool h2_pump (h2_t *h2, size_t budget) attr_nonnull (1);
+
+extern void h2_reset (h2_t *h2, h2_stream_t *st, int code) attr_nonnull (1, 2);
+
+extern void h2_settle (h2_t *h2, h2_stream_t *st) attr_nonnull (1, 2);
+
+extern bool h2_respond (h2_t *h2, h2_stream_t *st, int status,
+			const hpack_field_t *fields, size_t cnt, bool end)
+    attr_nonnull (1, 2);
+
+extern bool h2_send_ref (h2_t *h2, h2_stream_t *st, const void *data,
+			 size_t len) attr_nonnull (1, 2);
+
+extern bool h2_send_blob (h2_t *h2, h2_stream_t *st, resource_blob_t *blob,
+			  size_t off, size_t len) attr_nonnull (1, 2, 3);
+
+extern bool h2_send_file (h2_t *h2, h2_stream_t *st, resource_t *file, int fd,
+			  off_t off, size_t len) attr_nonnull (1, 2, 3);
+
+extern bool h2_send_stream (h2_t *h2, h2_stream_t *st, response_read_t *read,
+			    response_close_t *close, void *arg)
+    attr_nonnull (1, 2, 3);
+
+#endif
@@ -0,0 +1,448 @@
+#include "hpack.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ENTRY_OVERHEAD 32
+
+#define STR(s) s, sizeof (s) - 1
+
+struct hpack_entry_t
+{
+  size_t name_len;
+  size_t value_len;
+  char data[];
+};
+
+static const hpack_field_t static_table[HPACK_STATIC_NUM + 1] = {
+  [1] = { STR (":authority"), STR ("") },
+  [2] = { STR (":method"), STR ("GET") },
+  [3] = { STR (":method"), STR ("POST") },
+  [4] = { STR (":path"), STR ("/") },
+  [5] = { STR (":path"), STR ("/index.html") },
+  [6] = { STR (":scheme"), STR ("http") },
+  [7] = { STR (":scheme"), STR ("https") },
+  [8] = { STR (":status"), STR ("200") },
+  [9] = { STR (":status"), STR ("204") },
+  [10] = { STR (":status"), STR ("206") },
+  [11] = { STR (":status"), STR ("304") },
+  [12] = { STR (":status"), STR ("400") },
+  [13] = { STR (":status"), STR ("404") },
+  [14] = { STR (":status"), STR ("500") },
+  [15] = { STR ("accept-charset"), STR ("") },
+  [16] = { STR ("accept-encoding"), STR ("gzip, deflate") },
+  [17] = { STR ("accept-language"), STR ("") },
+  [18] = { STR ("accept-ranges"), STR ("") },
+  [19] = { STR ("accept"), STR ("") },
+  [20] = { STR ("access-control-allow-origin"), STR ("") },
+  [21] = { STR ("age"), STR ("") },
+  [22] = { STR ("allow"), STR ("") },
+  [23] = { STR ("authorization"), STR ("") },
+  [24] = { STR ("cache-control"), STR ("") },
+  [25] = { STR ("content-disposition"), STR ("") },
+  [26] = { STR ("content-encoding"), STR ("") },
+  [27] = { STR ("content-language"), STR ("") },
+  [28] = { STR ("content-length"), STR ("") },
+  [29] = { STR ("content-location"), STR ("") },
+  [30] = { STR ("content-range"), STR ("") },
+  [31] = { STR ("content-type"), STR ("") },
+  [32] = { STR ("cookie"), STR ("") },
+  [33] = { STR ("date"), STR ("") },
+  [34] = { STR ("etag"), STR ("") },
+  [35] = { STR ("expect"), STR ("") },
+  [36] = { STR ("expires"), STR ("") },
+  [37] = { STR ("from"), STR ("") },
+  [38] = { STR ("host"), STR ("") },
+  [39] = { STR ("if-match"), STR ("") },
+  [40] = { STR ("if-modified-since"), STR ("") },
+  [41] = { STR ("if-none-match"), STR ("") },
+  [42] = { STR ("if-range"), STR ("") },
+  [43] = { STR ("if-unmodified-since"), STR ("") },
+  [44] = { STR ("last-modified"), STR ("") },
+  [45] = { STR ("link"), STR ("") },
+  [46] = { STR ("location"), STR ("") },
+  [47] = { STR ("max-forwards"), STR ("") },
+  [48] = { STR ("proxy-authenticate"), STR ("") },
+  [49] = { STR ("proxy-authorization"), STR ("") },
+  [50] = { STR ("range"), STR ("") },
+  [51] = { STR ("referer"), STR ("") },
+  [52] = { STR ("refresh"), STR ("") },
+  [53] = { STR ("retry-after"), STR ("") },
+  [54] = { STR ("server"), STR ("") },
+  [55] = { STR ("set-cookie"), STR ("") },
+  [56] = { STR ("strict-transport-security"), STR ("") },
+  [57] = { STR ("transfer-encoding"), STR ("") },
+  [58] = { STR ("user-agent"), STR ("") },
+  [59] = { STR ("vary"), STR ("") },
+  [60] = { STR ("via"), STR ("") },
+  [61] = { STR ("www-authenticate"), STR ("") },
+};
+
+/* canonical code, symbols ordered by code length then value */
+
+static const uint8_t huff_counts[31] = {
+  0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+  0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+static const uint16_t huff_syms[257] = {
+  48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51, 52, 53,
+  54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114,
+  117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80, 81, 82,
+  83, 84, 85, 86, 87, 89, 106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44,
+  59, 88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62, 0, 36, 64, 91, 93, 126,
+  94, 125, 60, 96, 123, 92, 195, 208, 128, 130, 131, 162, 184, 194, 224, 226,
+  153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129, 132,
+  133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170, 173, 178, 181, 185,
+  186, 187, 189, 190, 196, 198, 228, 232, 233, 1, 135, 137, 138, 139, 140,
+  141, 143, 147, 149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175,
+  180, 182, 183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159, 171,
+  206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205,
+  210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214, 221,
+  222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+  6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 23, 24, 25, 26, 27, 28, 29,
+  30, 31, 127, 220, 249, 10, 13, 22, 256,
+};
+
+static bool table_get (hpack_t *hp, size_t index, hpack_field_t *field);
+static bool table_add (hpack_t *hp, hpack_field_t *field);
+static void table_evict (hpack_t *hp, size_t need);
+
+static bool int_decode (const uint8_t **pos, const uint8_t *end, int prefix,
+			size_t *val);
+static bool str_decode (hpack_t *hp, const uint8_t **pos, const uint8_t *end,
+			size_t *used, const char **str, size_t *len);
+static ssize_t huff_decode (char *dst, const uint8_t *src, size_t len);
+
+void
+hpack_free (hpack_t *hp)
+{
+  for (; hp->cnt; hp->cnt--)
+    free (hp->ents[(hp->head - hp->cnt) & (hp->cap - 1)]);
+
+  free (hp->ents);
+  free (hp->scratch.data);
+  *hp = HPACK_INIT (hp->limit);
+}
+
+int
+hpack_decode (hpack_t *hp, const uint8_t *src, size_t len, hpack_emit_t *emit,
+	      void *arg)
+{
+  const uint8_t *pos = src, *end = src + len;
+
+  /* huffman output never exceeds 8/5 of its input */
+  size_t need = len * 8 / 5 + 2;
+  if (need > hp->scratch.cap)
+    {
+      char *data;
+      if (!(data = realloc (hp->scratch.data, need)))
+	return -1;
+
+      hp->scratch.data = data;
+      hp->scratch.cap = need;
+    }
+
+  for (size_t used = 0; pos < end;)
+    {
+      size_t index;
+      hpack_field_t field;
+      uint8_t byte = *pos;
+
+      /* indexed field */
+      if (byte & 0x80)
+	{
+	  if (!int_decode (&pos, end, 7, &index)
+	      || !table_get (hp, index, &field))
+	    return -1;
+	}
+
+      /* dynamic table size update */
+      else if ((byte & 0xe0) == 0x20)
+	{
+	  if (!int_decode (&pos, end, 5, &index) || index > hp->limit)
+	    return -1;
+
+	  table_evict (hp, hp->size > index ? hp->size - index : 0);
+	  hp->max = index;
+	  continue;
+	}
+
+      /* literal, with or without indexing */
+      else
+	{
+	  bool add = byte & 0x40;
+	  if (!int_decode (&pos, end, add ? 6 : 4, &index))
+	    return -1;
+
+	  if (!index)
+	    {
+	      if (!str_decode (hp, &pos, end, &used, &field.name,
+			       &field.name_len))
+		return -1;
+	    }
+	  else if (!table_get (hp, index, &field))
+	    return -1;
+
+	  if (!str_decode (hp, &pos, end, &used, &field.value,
+			   &field.value_len))
+	    return -1;
+
+	  if (add && !table_add (hp, &field))
+	    return -1;
+	}
+
+      if (!emit (arg, &field))
+	return -1;
+    }
+
+  return 0;
+}
+
+int
+hpack_find (const char *name, size_t len)
+{
+  for (int i = 1; i <= HPACK_STATIC_NUM; i++)
+    if (static_table[i].name_len == len
+	&& memcmp (static_table[i].name, name, len) == 0)
+      return i;
+
+  return 0;
+}
+
+size_t
+hpack_encode_int (uint8_t *dst, size_t val, int prefix, uint8_t flags)
+{
+  size_t n = 0, mask = (1 << prefix) - 1;
+
+  if (val < mask)
+    {
+      dst[n++] = flags | val;
+      return n;
+    }
+
+  dst[n++] = flags | mask;
+  for (val -= mask; val >= 0x80; val >>= 7)
+    dst[n++] = 0x80 | (val & 0x7f);
+
+  dst[n++] = val;
+  return n;
+}
+
+size_t
+hpack_encode_field (uint8_t *dst, const hpack_field_t *field)
+{
+  size_t n = 0;
+  int index = hpack_find (field->name, field->name_len);
+
+  /* fully indexed when the static table has the value too */
+  for (int i = index; i && i <= HPACK_STATIC_NUM; i++)
+    {
+      const hpack_field_t *ent = &static_table[i];
+
+      if (ent->name_len != field->name_len
+	  || memcmp (ent->name, field->name, field->name_len) != 0)
+	break;
+
+      if (ent->value_len == field->value_len
+	  && memcmp (ent->value, field->value, field->value_len) == 0)
+	return hpack_encode_int (dst, i, 7, 0x80);
+    }
+
+  /* literal without indexing, our fields churn too fast to be cached */
+  n += hpack_encode_int (dst + n, index, 4, 0x00);
+
+  if (!index)
+    {
+      n += hpack_encode_int (dst + n, field->name_len, 7, 0x00);
+      memcpy (dst + n, field->name, field->name_len);
+      n += field->name_len;
+    }
+
+  n += hpack_encode_int (dst + n, field->value_len, 7, 0x00);
+  memcpy (dst + n, field->value, field->value_len);
+  return n + field->value_len;
+}
+
+static inline bool
+table_get (hpack_t *hp, size_t index, hpack_field_t *field)
+{
+  if (!index)
+    return false;
+
+  if (index <= HPACK_STATIC_NUM)
+    {
+      *field = static_table[index];
+      return true;
+    }
+
+  if ((index -= HPACK_STATIC_NUM) > hp->cnt)
+    return false;
+
+  hpack_entry_t *ent = hp->ents[(hp->head - index) & (hp->cap - 1)];
+  *field = (hpack_field_t) {
+    .name = ent->data,
+    .name_len = ent->name_len,
+    .value = ent->data + ent->name_len,
+    .value_len = ent->value_len,
+  };
+  return true;
+}
+
+static inline bool
+table_add (hpack_t *hp, hpack_field_t *field)
+{
+  hpack_entry_t *ent;
+  size_t size = field->name_len + field->value_len + ENTRY_OVERHEAD;
+
+  /* too large entries just empty the table */
+  if (size > hp->max)
+    {
+      table_evict (hp, hp->size);
+      return true;
+    }
+
+  /* copy before eviction, the name may live in an evicted entry */
+  if (!(ent = malloc (sizeof (hpack_entry_t) + size - ENTRY_OVERHEAD)))
+    return false;
+
+  ent->name_len = field->name_len;
+  ent->value_len = field->value_len;
+  memcpy (ent->data, field->name, field->name_len);
+  memcpy (ent->data + field->name_len, field->value, field->value_len);
+
+  if (hp->size + size > hp->max)
+    table_evict (hp, hp->size + size - hp->max);
+
+  if (!hp->ents)
+    {
+      size_t cap = 1;
+      for (; cap < hp->limit / ENTRY_OVERHEAD;)
+	cap <<= 1;
+
+      if (!(hp->ents = malloc (cap * sizeof (hpack_entry_t *))))
+	return (free (ent), false);
+      hp->cap = cap;
+    }
+
+  hp->ents[hp->head++ & (hp->cap - 1)] = ent;
+  hp->size += size;
+  hp->cnt++;
+
+  /* emit the copy, the source may be gone */
+  field->name = ent->data;
+  field->value = ent->data + ent->name_len;
+  return true;
+}
+
+static inline void
+table_evict (hpack_t *hp, size_t need)
+{
+  /* oldest entries go first */
+  for (size_t freed = 0; freed < need && hp->cnt; hp->cnt--)
+    {
+      hpack_entry_t *ent = hp->ents[(hp->head - hp->cnt) & (hp->cap - 1)];
+      size_t size = ent->name_len + ent->value_len + ENTRY_OVERHEAD;
+
+      freed += size;
+      hp->size -= size;
+      free (ent);
+    }
+}
+
+static inline bool
+int_decode (const uint8_t **pos, const uint8_t *end, int prefix, size_t *val)
+{
+  size_t mask = (1 << prefix) - 1;
+  size_t v = *(*pos)++ & mask;
+
+  if (v < mask)
+    return (*val = v, true);
+
+  for (int shift = 0; *pos < end && shift <= 21; shift += 7)
+    {
+      uint8_t byte = *(*pos)++;
+      v += (size_t) (byte & 0x7f) << shift;
+
+      if (!(byte & 0x80))
+	return (*val = v, true);
+    }
+
+  return false;
+}
+
+static inline bool
+str_decode (hpack_t *hp, const uint8_t **pos, const uint8_t *end,
+	    size_t *used, const char **str, size_t *len)
+{
+  size_t n;
+
+  if (*pos >= end)
+    return false;
+
+  bool huff = **pos & 0x80;
+  if (!int_decode (pos, end, 7, &n) || n > (size_t) (end - *pos))
+    return false;
+
+  /* raw strings are used in place */
+  if (!huff)
+    {
+      *str = (const char *) *pos;
+      *len = n;
+      *pos += n;
+      return true;
+    }
+
+  ssize_t size;
+  char *dst = hp->scratch.data + *used;
+  if ((size = huff_decode (dst, *pos, n)) < 0)
+    return false;
+
+  *str = dst;
+  *len = size;
+  *used += size;
+  *pos += n;
+  return true;
+}
+
+static inline ssize_t
+huff_decode (char *dst, const uint8_t *src, size_t len)
+{
+  char *pos = dst;
+  unsigned code = 0, first = 0, index = 0, bits = 0;
+
+  for (size_t i = 0; i < len; i++)
+    for (int b = 7; b >= 0; b--)
+      {
+	unsigned count;
+
+	code |= (src[i] >> b) & 1;
+	count = huff_counts[++bits];
+
+	if (code < first + count)
+	  {
+	    uint16_t sym = huff_syms[index + code - first];
+
+	    /* an explicit EOS is an error */
+	    if (sym == 256)
+	      return -1;
+
+	    *pos++ = sym;
+	    code = first = index = bits = 0;
+	    continue;
+	  }
+
+	if (bits == 30)
+	  return -1;
+
+	index += count;
+	first = (first + count) << 1;
+	code <<= 1;
+      }
+
+  /* padding is a short prefix of EOS, all ones */
+  if (bits > 7 || code >> 1 != (1u << bits) - 1)
+    return -1;
+
+  return pos - dst;
+}
@@ -0,0 +1,64 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HPACK_TABLE_SIZE 4096
+#define HPACK_STATIC_NUM 61
+
+/* worst case encoded size of a field */
+#define HPACK_FIELD_BOUND(nlen, vlen) ((nlen) + (vlen) + 16)
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+typedef struct hpack_t hpack_t;
+typedef struct hpack_entry_t hpack_entry_t;
+typedef struct hpack_field_t hpack_field_t;
+
+typedef bool hpack_emit_t (void *arg, const hpack_field_t *field);
+
+struct hpack_field_t
+{
+  const char *name;
+  size_t name_len;
+  const char *value;
+  size_t value_len;
+};
+
+struct hpack_t
+{
+  size_t max;
+  size_t limit;
+  size_t size;
+
+  size_t cap;
+  size_t cnt;
+  size_t head;
+  hpack_entry_t **ents;
+
+  struct
+  {
+    size_t cap;
+    char *data;
+  } scratch;
+};
+
+#define HPACK_INIT(lim)                                                       \
+  (hpack_t) { .max = (lim), .limit = (lim) }
+
+extern void hpack_free (hpack_t *hp) attr_nonnull (1);
+
+extern int hpack_decode (hpack_t *hp, const uint8_t *src, size_t len,
+			 hpack_emit_t *emit, void *arg) attr_nonnull (1, 4);
+
+extern int hpack_find (const char *name, size_t len) attr_nonnull (1);
+
+extern size_t hpack_encode_int (uint8_t *dst, size_t val, int prefix,
+				uint8_t flags) attr_nonnull (1);
+
+extern size_t hpack_encode_field (uint8_t *dst, const hpack_field_t *field)
+    attr_nonnull (1, 2);
+
+#endif
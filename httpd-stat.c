@@ -0,0 +1,187 @@
+#include "config.h"
+#include "stats.h"
+#include "util.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct
+{
+  bool once;
+  double interval;
+  const char *filter;
+} opt = {
+  .interval = 1,
+};
+
+static void show (const stats_t *st, uint64_t *prev, double secs);
+static void show_line (const stats_t *st, size_t i, const uint64_t *prev,
+		       double secs);
+static double now (void);
+static void usage (const char *prog);
+
+int
+main (int argc, char **argv)
+{
+  int c;
+  char name[NAME_MAX];
+  const char *shm = NULL;
+  unsigned port = PORT;
+
+  while ((c = getopt (argc, argv, "n:p:i:f:1h")) != -1)
+    switch (c)
+      {
+      case 'n':
+	shm = optarg;
+	break;
+      case 'p':
+	port = strtoul (optarg, NULL, 10);
+	break;
+      case 'i':
+	opt.interval = strtod (optarg, NULL);
+	break;
+      case 'f':
+	opt.filter = optarg;
+	break;
+      case '1':
+	opt.once = true;
+	break;
+      default:
+	usage (argv[0]);
+      }
+
+  if (opt.interval <= 0)
+    usage (argv[0]);
+
+  /* the server names its segment the same way */
+  if (!shm)
+    {
+      if (stats_name (name, sizeof (name), STATS, port) != 0)
+	error ("%s-%u: %s", STATS, port, strerror (errno));
+      shm = name;
+    }
+
+  for (;;)
+    {
+      int ret;
+      stats_t st;
+      uint64_t *prev;
+
+      /* a server killed hard leaves its segment behind */
+      if ((ret = stats_open (&st, shm)) == 0 && !stats_alive (&st))
+	{
+	  stats_free (&st);
+	  errno = ESRCH;
+	  ret = -1;
+	}
+
+      if (ret != 0)
+	{
+	  if (opt.once)
+	    error ("%s: %s", shm, strerror (errno));
+
+	  printf ("\033[H\033[2Jwaiting for %s: %s\n", shm, strerror (errno));
+	  fflush (stdout);
+	  usleep (opt.interval * 1e6);
+	  continue;
+	}
+
+      if (opt.once)
+	{
+	  show (&st, NULL, 0);
+	  stats_free (&st);
+	  return 0;
+	}
+
+      if (!(prev = malloc (st.head->count * sizeof (uint64_t))))
+	error ("malloc failed");
+
+      for (size_t i = 0; i < st.head->count; i++)
+	prev[i] = stats_get (&st, i);
+
+      /* until the server goes away, then wait for the next one */
+      for (double last = now (); stats_alive (&st);)
+	{
+	  usleep (opt.interval * 1e6);
+
+	  double t = now ();
+	  show (&st, prev, t - last);
+	  last = t;
+	}
+
+      free (prev);
+      stats_free (&st);
+    }
+}
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr,
+	   "usage: %s [-n shm name | -p port] [-i seconds] [-f filter] [-1]\n",
+	   prog);
+  exit (2);
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* varnishstat's columns, the change over the last interval and the average
+   since the server started */
+static void
+show (const stats_t *st, uint64_t *prev, double secs)
+{
+  long up = time (NULL) - st->head->started;
+
+  if (prev)
+    printf ("\033[H\033[2J");
+
+  printf ("%s  pid %lld  up %ld+%02ld:%02ld:%02ld\n\n", st->name,
+	  (long long) st->head->pid, up / 86400, up / 3600 % 24, up / 60 % 60,
+	  up % 60);
+  printf ("%-20s %14s %12s %12s  %s\n", "NAME", "CURRENT", "CHANGE",
+	  "AVERAGE", "DESCRIPTION");
+
+  for (size_t i = 0; i < st->head->count; i++)
+    if (!opt.filter || strstr (st->fields[i].name, opt.filter))
+      show_line (st, i, prev, secs);
+
+  if (prev)
+    for (size_t i = 0; i < st->head->count; i++)
+      prev[i] = stats_get (st, i);
+
+  fflush (stdout);
+}
+
+static void
+show_line (const stats_t *st, size_t i, const uint64_t *prev, double secs)
+{
+  char change[32] = "", average[32] = "";
+  const stats_field_t *f = &st->fields[i];
+  uint64_t v = stats_get (st, i);
+  long up = time (NULL) - st->head->started;
+
+  /* rates only mean something for counters */
+  if (f->type == STATS_COUNTER)
+    {
+      if (prev && secs > 0)
+	snprintf (change, sizeof (change), "%.2f", (v - prev[i]) / secs);
+      snprintf (average, sizeof (average), "%.2f",
+		(double) v / (up > 0 ? up : 1));
+    }
+
+  printf ("%-20.*s %14llu %12s %12s  %.*s\n", STATS_NAME, f->name,
+	  (unsigned long long) v, change, average, STATS_DESC, f->desc);
+}
@@ -1,28 +1,214 @@
 #include "config.h"
+#include "gzip.h"
+#include "h2.h"
 #include "httpd.h"
 #include "mime.h"
+#include "probe.h"
 #include "rbtree.h"
+#include "response.h"
 #include "util.h"
 
 #include <ctype.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_REQLINE_LEN 1024
-#define MAX_RESHEAD_LEN 4096
+#define MAX_EVENTS 64
+#define MAX_POLL_WAIT 1000
+#define MAX_REQHEAD_LEN 8192
+#define H2_RECV_SIZE (H2_FRAME_SIZE * 4)
+#define WS_RECV_SIZE MAX_REQHEAD_LEN
+
+#define IOV(str)                                                              \
+  {                                                                           \
+    .iov_base = (void *) (str), .iov_len = sizeof (str) - 1                   \
+  }
 
 typedef struct header_t header_t;
 typedef struct client_t client_t;
-typedef struct request_t request_t;
-typedef struct context_t context_t;
+
+enum
+{
+  RECV_OK,
+  RECV_AGAIN,
+  RECV_ERROR,
+};
+
+enum
+{
+  PAYLOAD_NONE,
+  PAYLOAD_LENGTH,
+  PAYLOAD_CHUNKED,
+};
+
+enum
+{
+  CHUNK_SIZE,
+  CHUNK_TAIL,
+  CHUNK_TRAILER,
+};
+
+/* metrics */
+
+enum
+{
+  METRIC_REQUESTS,
+  METRIC_NOT_FOUND,
+  METRIC_SERVER_ERRORS,
+  METRIC_MCACHE_HITS,
+  METRIC_MCACHE_MISSES,
+  METRIC_GZIP_HITS,
+  METRIC_GZIP_MISSES,
+  METRIC_ERRORS,
+  METRIC_COUNTERS = METRIC_ERRORS + HTTPD_ERR_NUM,
+};
+
+enum
+{
+  METRIC_FIRST_BYTE,
+  METRIC_PARSE,
+  METRIC_LOOKUP,
+  METRIC_SEND,
+  METRIC_HISTS,
+};
+
+static const char *const metric_hists[][2] = {
+  [METRIC_FIRST_BYTE]
+  = { "httpd_first_byte_seconds", "Accept to the first response byte." },
+  [METRIC_PARSE] = { "httpd_parse_seconds", "Request head parsing." },
+  [METRIC_LOOKUP]
+  = { "httpd_lookup_seconds", "Resource and micro-cache lookups." },
+  [METRIC_SEND] = { "httpd_send_seconds", "One flush of pending output." },
+};
+
+/* failures that happen while serving, the rest stop server_init */
+static const char *const metric_errors[HTTPD_ERR_NUM] = {
+  [HTTPD_ERR_REQUEST_INIT_VER] = "request_init_ver",
+  [HTTPD_ERR_REQUEST_INIT_URI] = "request_init_uri",
+  [HTTPD_ERR_REQUEST_INIT_LINE] = "request_init_line",
+  [HTTPD_ERR_REQUEST_INIT_METHOD] = "request_init_method",
+  [HTTPD_ERR_REQUEST_INIT_HEADERS] = "request_init_headers",
+};
+
+#define metric_count(serv, id) metrics_count (&(serv)->metrics, id, 1)
+#define metric_since(serv, id, start)                                         \
+  metrics_observe (&(serv)->metrics, id, metrics_now () - (start))
+
+/* shared memory stats */
+
+enum
+{
+  STAT_CONNS,
+  STAT_ACCEPTED,
+  STAT_REQUESTS,
+  STAT_QUEUE,
+  STAT_RESOURCES,
+  STAT_RESOURCE_BYTES,
+  STAT_LOG_DROPPED,
+  STAT_TIMEOUTS,
+  STAT_REFUSED,
+  STAT_LIMIT_OVERFLOW,
+  STAT_CLASSES,
+  STAT_CODES = STAT_CLASSES + 5,
+  STAT_FIELDS = STAT_CODES + 13,
+};
+
+/* the codes counted one by one, every status also counts in its class */
+static const int stat_codes[STAT_FIELDS - STAT_CODES] = {
+  101, 200, 201, 206, 304, 400, 404, 405, 413, 429, 500, 502, 504,
+};
+
+/* the status fields are named in stat_table */
+static const stats_field_t stat_fields[STAT_CLASSES] = {
+  [STAT_CONNS] = { "conns", "Open client connections.", STATS_GAUGE },
+  [STAT_ACCEPTED] = { "accepted", "Connections accepted.", STATS_COUNTER },
+  [STAT_REQUESTS] = { "requests", "Requests routed.", STATS_COUNTER },
+  [STAT_QUEUE]
+  = { "queue", "Tasks posted to the pool and not finished.", STATS_GAUGE },
+  [STAT_RESOURCES]
+  = { "resources", "Files open in the resource pool.", STATS_GAUGE },
+  [STAT_RESOURCE_BYTES]
+  = { "resource_bytes", "Size of the files in the pool.", STATS_GAUGE },
+  [STAT_LOG_DROPPED]
+  = { "log_dropped", "Access log records dropped.", STATS_COUNTER },
+  [STAT_TIMEOUTS]
+  = { "timeouts", "Connections closed by a timeout.", STATS_COUNTER },
+  [STAT_REFUSED]
+  = { "refused", "Connections over the per-address cap.", STATS_COUNTER },
+  [STAT_LIMIT_OVERFLOW]
+  = { "limit_overflow", "Addresses let through by a full limit table.",
+      STATS_COUNTER },
+};
+
+#define stat_add(serv, id, n) stats_add (&(serv)->stats, id, n)
+
+/* response templates */
+
+static const struct iovec tpl_status[] = {
+  [HTTPD_STATUS_OK] = IOV ("HTTP/1.1 200 OK\r\n"),
+  [HTTPD_STATUS_CREATED] = IOV ("HTTP/1.1 201 CREATED\r\n"),
+  [HTTPD_STATUS_BAD_REQUEST] = IOV ("HTTP/1.1 400 BAD REQUEST\r\n"),
+  [HTTPD_STATUS_NOT_FOUND] = IOV ("HTTP/1.1 404 NOT FOUND\r\n"),
+  [HTTPD_STATUS_METHOD_NOT_ALLOWED]
+  = IOV ("HTTP/1.1 405 METHOD NOT ALLOWED\r\n"),
+  [HTTPD_STATUS_PAYLOAD_TOO_LARGE]
+  = IOV ("HTTP/1.1 413 PAYLOAD TOO LARGE\r\n"),
+  [HTTPD_STATUS_TOO_MANY_REQUESTS]
+  = IOV ("HTTP/1.1 429 TOO MANY REQUESTS\r\n"),
+  [HTTPD_STATUS_INTERNAL_ERROR] = IOV ("HTTP/1.1 500 INTERNAL ERROR\r\n"),
+  [HTTPD_STATUS_NOT_IMPLEMENTED] = IOV ("HTTP/1.1 501 NOT IMPLEMENTED\r\n"),
+  [HTTPD_STATUS_BAD_GATEWAY] = IOV ("HTTP/1.1 502 BAD GATEWAY\r\n"),
+  [HTTPD_STATUS_GATEWAY_TIMEOUT] = IOV ("HTTP/1.1 504 GATEWAY TIMEOUT\r\n"),
+};
+
+static const struct iovec tpl_encoding[] = {
+  [RESOURCE_ENC_BR] = IOV ("Content-Encoding: br\r\n"),
+  [RESOURCE_ENC_ZSTD] = IOV ("Content-Encoding: zstd\r\n"),
+  [RESOURCE_ENC_GZIP] = IOV ("Content-Encoding: gzip\r\n"),
+};
+
+static const int status_codes[] = {
+  [HTTPD_STATUS_OK] = 200,
+  [HTTPD_STATUS_CREATED] = 201,
+  [HTTPD_STATUS_BAD_REQUEST] = 400,
+  [HTTPD_STATUS_NOT_FOUND] = 404,
+  [HTTPD_STATUS_METHOD_NOT_ALLOWED] = 405,
+  [HTTPD_STATUS_PAYLOAD_TOO_LARGE] = 413,
+  [HTTPD_STATUS_TOO_MANY_REQUESTS] = 429,
+  [HTTPD_STATUS_INTERNAL_ERROR] = 500,
+  [HTTPD_STATUS_NOT_IMPLEMENTED] = 501,
+  [HTTPD_STATUS_BAD_GATEWAY] = 502,
+  [HTTPD_STATUS_GATEWAY_TIMEOUT] = 504,
+};
+
+static const char *methods[] = { "GET",	  "PUT",    "HEAD",    "POST",
+				 "TRACE", "DELETE", "OPTIONS", "CONNECT" };
+
+static const char *protos[] = { "HTTP/1.1", "HTTP/1.0", "HTTP/2.0" };
+
+static const struct iovec tpl_end = IOV ("\r\n");
+static const struct iovec tpl_continue = IOV ("HTTP/1.1 100 Continue\r\n\r\n");
+static const struct iovec tpl_close = IOV ("Connection: close\r\n");
+static const struct iovec tpl_keep = IOV ("Connection: keep-alive\r\n");
+static const struct iovec tpl_server = IOV ("Server: httpd\r\n");
+static const struct iovec tpl_vary = IOV ("Vary: Accept-Encoding\r\n");
+static const struct iovec tpl_control = IOV ("Cache-Control: ");
+static const struct iovec tpl_chunked = IOV ("Transfer-Encoding: chunked\r\n");
+static const struct iovec tpl_html = IOV ("Content-Type: text/html\r\n");
+static const struct iovec tpl_plain = IOV ("Content-Type: text/plain\r\n");
 
 /* client */
 
@@ -31,34 +217,127 @@ struct client_t
   int sock;
   server_t *serv;
   sockaddr4_t addr;
+
+  char *in;
+  bool close;
+  size_t in_len;
+  response_t out;
+
+  h2_t *h2;
+
+  SSL *tls;
+  bool secure;
+  bool offload;
+
+  websocket_t *ws;
+  client_t *next;
+
+  uint64_t accepted;
+
+  /* counted against its address in the limit table */
+  bool limited;
+
+  /* armed while parked in epoll, head_by holds across partial heads */
+  bool served;
+  uint64_t head_by;
+  wheel_node_t timer;
 };
 
 static void client_free (client_t *clnt);
+static int client_recv (client_t *clnt);
+static ssize_t client_read (client_t *clnt, void *buf, size_t len);
+static int client_flush (client_t *clnt);
+static int client_wait (client_t *clnt, uint32_t events);
+static bool client_push (client_t *clnt, uint64_t by);
+static void client_cork (client_t *clnt, int on);
+static void client_consume (client_t *clnt, size_t n);
+static int client_upgrade (client_t *clnt);
+
+/* websocket */
+
+struct websocket_t
+{
+  int refs;
+  bool dead;
+  bool closing;
+  bool running;
+  client_t *clnt;
+  pthread_mutex_t lock;
 
-/* request */
+  void *arg;
+  websocket_handler_t *handler;
 
-struct request_t
-{
-  int proto;
-  int method;
-  mstr_t uri;
-  rbtree_t headers;
+  mstr_t outbox;
+  mstr_t msg;
+  int msg_op;
+
+  bool inframe;
+  size_t off;
+  size_t left;
+  ws_frame_t frame;
 };
 
+static websocket_t *websocket_new (client_t *clnt,
+				   websocket_handler_t *handler, void *arg);
+static bool websocket_claim (websocket_t *ws);
+static void websocket_wake (websocket_t *ws);
+static bool websocket_queue (websocket_t *ws, int opcode, const void *data,
+			     size_t len);
+static int websocket_collect (websocket_t *ws);
+static int websocket_park (client_t *clnt, uint32_t events);
+static bool websocket_recv (client_t *clnt);
+static void websocket_end (client_t *clnt);
+
+/* request */
+
 static void request_free (request_t *req);
+static const char *request_method_name (int method);
 static int request_init (request_t *req, context_t *ctx);
+static int request_init_h2 (request_t *req, const hpack_field_t *fields,
+			    size_t cnt);
+static bool request_copy (request_t *dst, request_t *src);
 
 /* context */
 
 struct context_t
 {
-  FILE *in;
+  char *pos;
   request_t req;
   client_t *clnt;
+  h2_stream_t *stream;
+
+  bool replied;
+  router_match_t match;
+  const char *control;
+
+  struct
+  {
+    int status;
+    ssize_t size;
+    uint64_t start;
+  } log;
+
+  struct
+  {
+    int state;
+    mstr_t key;
+  } cache;
+
+  struct
+  {
+    int type;
+    int state;
+    bool done;
+    bool expect;
+    size_t remain;
+    size_t total;
+    uint64_t by;
+  } payload;
 };
 
 static void context_free (context_t *ctx);
-static int context_init (context_t *ctx, client_t *clnt);
+static int context_init (context_t *ctx, client_t *clnt, char *pos);
+static void context_head (context_t *ctx, int status, ssize_t size);
 
 /* header */
 
@@ -71,62 +350,194 @@ struct header_t
 
 static void header_free (rbtree_node_t *n);
 static bool header_insert (rbtree_t *headers, header_t *header);
+static bool header_add (rbtree_t *headers, const char *field, size_t field_len,
+			const char *value, size_t value_len);
 static header_t *header_get (rbtree_t *headers, const char *field);
 static int header_comp (const rbtree_node_t *a, const rbtree_node_t *b);
 
 /* serve */
 
 static void serve (void *arg);
-static void serve_file (context_t *ctx);
-static void serve_not_found (context_t *ctx);
+static void serve_file (context_t *ctx, resource_t *res);
+static void serve_route (context_t *ctx);
+static int serve_match (context_t *ctx);
+static void serve_batch (client_t *clnt);
+static void serve_resume (client_t *clnt);
+static void serve_handshake (client_t *clnt);
+static void serve_status (context_t *ctx, int status);
+static void serve_abort (context_t *ctx, response_mark_t mark);
+static void serve_proxy (context_t *ctx);
+static void serve_metrics (context_t *ctx, const request_t *req);
+
+static void serve_ws (client_t *clnt);
+static void serve_h2 (client_t *clnt);
+static void serve_stream (void *arg, h2_stream_t *st,
+			  const hpack_field_t *fields, size_t cnt);
+static void serve_upgrade (context_t *ctx, header_t *settings);
+static header_t *upgrade_h2c (context_t *ctx);
+
+static bool upstream_request (context_t *ctx, mstr_t *head);
+static bool upstream_body (context_t *ctx, proxy_conn_t *up);
+
+/* cache */
+
+typedef struct refresh_t refresh_t;
+
+struct refresh_t
+{
+  server_t *serv;
+  sockaddr4_t addr;
+  request_t req;
+};
 
+static bool cache_key (context_t *ctx);
+static bool cache_vary_ok (const char *value, size_t len);
+static bool cache_serve (context_t *ctx);
+static void cache_put (context_t *ctx, resource_blob_t *blob, int max_age,
+		       int stale);
+static void cache_abandon (context_t *ctx);
+static void cache_handler (context_t *ctx, const char *type, const void *body,
+			   size_t len);
+static bool cache_upstream (context_t *ctx, proxy_conn_t *up);
+static void cache_reply (context_t *ctx, resource_blob_t *blob);
+static void cache_revalidate (context_t *ctx);
+static void cache_refresh (void *arg);
+static void cache_fetch (context_t *ctx);
+
+static void access_log (context_t *ctx);
+static bool keep_alive (context_t *ctx);
+static int accept_encoding (context_t *ctx);
 static resource_t *resource_get (context_t *ctx);
-static bool send_file (context_t *ctx, resource_t *res);
-static bool send_data (context_t *ctx, const void *data, size_t n);
 
-static int header_init (char *dst, int max, int code, const char *msg,
-			resource_t *res);
+/* gzip */
+
+typedef struct gzip_stream_t gzip_stream_t;
+
+/* the stream reads the file as it goes, its version stays open until then */
+struct gzip_stream_t
+{
+  gzip_t zip;
+  resource_t *res;
+};
+
+static void gzip_close (void *arg);
+static ssize_t gzip_pull (void *arg, void *dst, size_t max);
+static bool gzip_eligible (server_t *serv, resource_t *res);
+static resource_blob_t *gzip_blob (server_t *serv, resource_t *res);
+
+static void server_reap (server_t *serv);
+static void server_accept (server_t *serv);
+
+static int stat_init (server_t *serv, const char *name);
+static void stat_sample (server_t *serv);
+static void stat_status (server_t *serv, int status);
+
+static uint64_t timer_now (void);
+static int timer_wait (server_t *serv);
+static void timer_park (client_t *clnt, uint32_t events);
+static void timer_cancel (client_t *clnt);
+static void timer_expire (server_t *serv);
+
+static struct iovec date_field (void);
+static struct iovec length_field (size_t size);
+
+static bool header_init (context_t *ctx, int status, struct iovec type,
+			 ssize_t size, int enc, bool vary);
+static bool header_init_h2 (context_t *ctx, int status, struct iovec type,
+			    ssize_t size, int enc, bool vary);
+static bool header_frame (context_t *ctx, ssize_t size);
+static bool header_end (context_t *ctx);
+static bool header_upstream (context_t *ctx, proxy_conn_t *up);
+static bool header_upstream_h2 (context_t *ctx, proxy_conn_t *up);
+static bool header_cached (context_t *ctx, resource_blob_t *blob);
+static bool header_cached_h2 (context_t *ctx, mcache_entry_t *e,
+			      struct iovec age);
+
+static int payload_init (context_t *ctx);
+static void payload_skip (context_t *ctx);
+static bool payload_wait (context_t *ctx);
+static void payload_credit (context_t *ctx, size_t n);
+static int payload_chunk (context_t *ctx);
+static ssize_t payload_pull (context_t *ctx, void *buf, size_t len, bool wait);
+static ssize_t payload_recv (context_t *ctx, void *buf, size_t len, bool wait);
+static ssize_t payload_splice (context_t *ctx, int pipefd[2], int fd);
+
+static bool body_ref (context_t *ctx, const void *data, size_t len);
+static bool body_copy (context_t *ctx, const void *data, size_t len);
+static bool body_blob (context_t *ctx, resource_blob_t *blob, size_t off,
+		       size_t len);
+static bool body_file (context_t *ctx, resource_t *res, int fd, size_t len);
+static bool body_stream (context_t *ctx, response_read_t *read,
+			 response_close_t *close, void *arg);
 
 void
 server_free (server_t *serv)
 {
   threadpool_free (&serv->tpool);
+  server_reap (serv);
+  if (serv->flags & SERVER_LIMIT)
+    limit_free (&serv->limit);
+  if (serv->flags & SERVER_STATS)
+    stats_free (&serv->stats);
+  if (serv->log.path)
+    accesslog_free (&serv->log);
+  pthread_mutex_destroy (&serv->graveyard.lock);
+  pthread_mutex_destroy (&serv->timers.lock);
+  tls_free (&serv->tls);
+  if (serv->flags & SERVER_MICROCACHE)
+    mcache_free (&serv->mcache);
+  metrics_free (&serv->metrics);
+  if (serv->proxy.len)
+    proxy_free (&serv->proxy);
+  router_free (&serv->router);
   respool_free (&serv->rpool);
   arena_free (&serv->mpool);
   mstr_free (&serv->root);
+  mime_free (&serv->mime);
+  close (serv->epfd);
   close (serv->sock);
 }
 
 void
 server_poll (server_t *serv)
 {
-  client_t *clnt;
-  socklen_t len = sizeof (clnt->addr);
+  int n;
+  struct epoll_event evs[MAX_EVENTS];
 
-  if (!(clnt = arena_alloc (&serv->mpool, sizeof (client_t))))
-    error ("arena_alloc failed");
+  /* nothing fetched from here on can name the dead */
+  server_reap (serv);
 
-  /* init serv */
-  clnt->serv = serv;
+  if ((n = epoll_wait (serv->epfd, evs, MAX_EVENTS, timer_wait (serv)))
+      == -1)
+    return;
 
-  /* init sock and addr */
-  int server = serv->sock;
-  void *addr = &clnt->addr;
-  int flags = SOCK_NONBLOCK;
-  if ((clnt->sock = accept4 (server, addr, &len, flags)) == -1)
-    goto clean_clnt;
+  /* gauges others keep are copied out once a wakeup */
+  stat_sample (serv);
 
-  /* post task */
-  if (threadpool_post (&serv->tpool, serve, clnt) != 0)
-    goto clean_sock;
+  for (int i = 0; i < n; i++)
+    {
+      client_t *clnt;
 
-  return;
+      /* listening socket */
+      if (!(clnt = evs[i].data.ptr))
+	{
+	  server_accept (serv);
+	  continue;
+	}
 
-clean_sock:
-  close (clnt->sock);
+      /* it woke in time, the worker arms it again if it parks */
+      timer_cancel (clnt);
 
-clean_clnt:
-  free (clnt);
+      /* a websocket may be running already for a pushed message */
+      if (clnt->ws && !websocket_claim (clnt->ws))
+	continue;
+
+      /* post task */
+      if (threadpool_post (&serv->tpool, serve, clnt) != 0)
+	clnt->ws ? websocket_end (clnt) : client_free (clnt);
+    }
+
+  timer_expire (serv);
 }
 
 int
@@ -137,6 +548,18 @@ server_init (server_t *serv, const server_config_t *conf)
   int flags = conf_get (flags, FLAGS);
   uint16_t port = conf_get (port, PORT);
   const char *root = conf_get (root, ROOT);
+  const char *mime = conf_get (mime, MIME);
+  const char *cert = conf_get (cert, CERT);
+  const char *key = conf_get (key, KEY);
+  const char *upstream = conf_get (upstream, UPSTREAM);
+  const char *log = conf_get (log, ACCESSLOG);
+  const char *stats = conf_get (stats, STATS);
+  int limit_conns = conf_get (limit_conns, LIMIT_CONNS);
+  int limit_rate = conf_get (limit_rate, LIMIT_RATE);
+  int limit_burst = conf_get (limit_burst, LIMIT_BURST);
+  int connect_timeout = conf_get (connect_timeout, PROXY_CONNECT_TIMEOUT);
+  int upstream_timeout = conf_get (upstream_timeout, PROXY_TIMEOUT);
+  size_t cache = conf_get (cache, MICROCACHE_SIZE);
   int backlog = conf_get (backlog, BACKLOG);
   size_t threads = conf_get (threads, THREADS);
 
@@ -147,6 +570,9 @@ server_init (server_t *serv, const server_config_t *conf)
   /* init port */
   serv->port = port;
 
+  /* init flags */
+  serv->flags = flags;
+
   /* init mpool */
   serv->mpool = ARENA_INIT;
 
@@ -162,13 +588,67 @@ server_init (server_t *serv, const server_config_t *conf)
   if (!mstr_assign_cstr (&serv->root, root))
     return HTTPD_ERR_SERVER_INIT_ROOT;
 
+  /* init mime */
+  if (mime_init (&serv->mime, mime) != 0)
+    reto (HTTPD_ERR_SERVER_INIT_MIME, clean_root);
+
   /* init rpool */
-  if (respool_init (&serv->rpool) != 0)
-    reto (HTTPD_ERR_SERVER_INIT_RPOOL, clean_root);
+  if (respool_init (&serv->rpool, GZIP_CACHE, &serv->mime) != 0)
+    reto (HTTPD_ERR_SERVER_INIT_RPOOL, clean_mime);
+
+  /* init tls, shared by every worker */
+  serv->tls = (tls_t) {};
+  bool ktls = flags & SERVER_KTLS;
+  if (cert && key && tls_init (&serv->tls, cert, key, TLS_CACHE, ktls) != 0)
+    reto (HTTPD_ERR_SERVER_INIT_TLS, clean_rpool);
+
+  /* init metrics, one shard per thread that records */
+  if (metrics_init (&serv->metrics, METRIC_COUNTERS, METRIC_HISTS) != 0)
+    reto (HTTPD_ERR_SERVER_INIT_METRICS, clean_tls);
+
+  /* init router, filled by server_register before polling */
+  if (router_init (&serv->router) != 0)
+    reto (HTTPD_ERR_SERVER_INIT_ROUTER, clean_metrics);
+
+  if ((flags & SERVER_METRICS)
+      && router_add (&serv->router, HTTPD_METHOD_GET, METRICS_PATH,
+		     (void *) serve_metrics)
+	     != 0)
+    reto (HTTPD_ERR_SERVER_INIT_ROUTER, clean_router);
+
+  /* init proxy, misses under the root go upstream */
+  serv->proxy = (proxy_t) {};
+  if (upstream
+      && proxy_init (&serv->proxy, upstream, connect_timeout,
+		     upstream_timeout, PROXY_IDLE)
+	     != 0)
+    reto (HTTPD_ERR_SERVER_INIT_PROXY, clean_router);
+
+  /* init mcache, answers handlers and the upstream mark as shareable */
+  if ((flags & SERVER_MICROCACHE)
+      && mcache_init (&serv->mcache, cache, MICROCACHE_WAIT, MICROCACHE_PASS)
+	     != 0)
+    reto (HTTPD_ERR_SERVER_INIT_MCACHE, clean_proxy);
+
+  /* init log, workers queue records and one thread writes them */
+  serv->log = (accesslog_t) {};
+  int mode = flags & SERVER_LOG_BLOCK ? ACCESSLOG_BLOCK : ACCESSLOG_DROP;
+  if (log
+      && accesslog_init (&serv->log, log, ACCESSLOG_RING, ACCESSLOG_INTERVAL,
+			 mode)
+	     != 0)
+    reto (HTTPD_ERR_SERVER_INIT_LOG, clean_mcache);
+
+  /* init limit, per-address caps checked at accept and per request */
+  if ((flags & SERVER_LIMIT)
+      && limit_init (&serv->limit, LIMIT_SIZE, limit_conns, limit_rate,
+		     limit_burst)
+	     != 0)
+    reto (HTTPD_ERR_SERVER_INIT_LIMIT, clean_log);
 
   /* init tpool */
   if (threadpool_init (&serv->tpool, threads) != 0)
-    reto (HTTPD_ERR_SERVER_INIT_TPOOL, clean_rpool);
+    reto (HTTPD_ERR_SERVER_INIT_TPOOL, clean_limit);
 
   /* init sock */
   int sock_type = SOCK_STREAM;
@@ -179,13 +659,9 @@ server_init (server_t *serv, const server_config_t *conf)
   if ((serv->sock = socket (AF_INET, sock_type, 0)) == -1)
     reto (HTTPD_ERR_SERVER_INIT_SOCK, clean_tpool);
 
-  /* bind addr */
-  if (bind (serv->sock, (void *) &serv->addr, sizeof (serv->addr)) != 0)
-    reto (HTTPD_ERR_SERVER_INIT_BIND, clean_sock);
-
-  /* listen */
-  if (listen (serv->sock, backlog) != 0)
-    reto (HTTPD_ERR_SERVER_INIT_LISTEN, clean_sock);
+  /* init epfd */
+  if ((serv->epfd = epoll_create1 (EPOLL_CLOEXEC)) == -1)
+    reto (HTTPD_ERR_SERVER_INIT_EPOLL, clean_sock);
 
   /* open reuseaddr option */
   if (flags & SERVER_REUSEADDR)
@@ -193,257 +669,2544 @@ server_init (server_t *serv, const server_config_t *conf)
       int opt = true;
       socklen_t len = sizeof (int);
       if (setsockopt (serv->sock, SOL_SOCKET, SO_REUSEADDR, &opt, len) != 0)
-	reto (HTTPD_ERR_SERVER_INIT_REUSEADDR, clean_sock);
+	reto (HTTPD_ERR_SERVER_INIT_REUSEADDR, clean_epfd);
     }
 
+  /* bind addr */
+  if (bind (serv->sock, (void *) &serv->addr, sizeof (serv->addr)) != 0)
+    reto (HTTPD_ERR_SERVER_INIT_BIND, clean_epfd);
+
+  /* listen */
+  if (listen (serv->sock, backlog) != 0)
+    reto (HTTPD_ERR_SERVER_INIT_LISTEN, clean_epfd);
+
+  /* watch sock */
+  struct epoll_event ev = { .events = EPOLLIN };
+  if (epoll_ctl (serv->epfd, EPOLL_CTL_ADD, serv->sock, &ev) != 0)
+    reto (HTTPD_ERR_SERVER_INIT_EPOLL, clean_epfd);
+
+  /* init stats, a shm segment httpd-stat reads without asking; named after
+     the port, so only once the port is ours */
+  serv->stats = (stats_t) {};
+  if ((flags & SERVER_STATS) && stat_init (serv, stats) != 0)
+    reto (HTTPD_ERR_SERVER_INIT_STATS, clean_epfd);
+
+  /* init graveyard, closed websockets wait here for the poll loop */
+  serv->graveyard.list = NULL;
+  pthread_mutex_init (&serv->graveyard.lock, NULL);
+
+  /* init timers, connections parked in epoll have a deadline */
+  wheel_init (&serv->timers.wheel, timer_now ());
+  pthread_mutex_init (&serv->timers.lock, NULL);
+
   return 0;
 
+clean_epfd:
+  close (serv->epfd);
+
 clean_sock:
   close (serv->sock);
 
 clean_tpool:
   threadpool_free (&serv->tpool);
 
+clean_limit:
+  if (flags & SERVER_LIMIT)
+    limit_free (&serv->limit);
+
+clean_log:
+  if (log)
+    accesslog_free (&serv->log);
+
+clean_mcache:
+  if (flags & SERVER_MICROCACHE)
+    mcache_free (&serv->mcache);
+
+clean_proxy:
+  if (serv->proxy.len)
+    proxy_free (&serv->proxy);
+
+clean_router:
+  router_free (&serv->router);
+
+clean_metrics:
+  metrics_free (&serv->metrics);
+
+clean_tls:
+  tls_free (&serv->tls);
+
 clean_rpool:
   respool_free (&serv->rpool);
 
+clean_mime:
+  mime_free (&serv->mime);
+
 clean_root:
   mstr_free (&serv->root);
 
   return ret;
 }
 
-static void
-client_free (client_t *clnt)
+int
+server_register (server_t *serv, int method, const char *pattern,
+		 server_handler_t *handler)
 {
-  close (clnt->sock);
+  return router_add (&serv->router, method, pattern, (void *) handler);
 }
 
-static void
-request_free (request_t *req)
+const char *
+context_header (context_t *ctx, const char *field)
 {
-  mstr_free (&req->uri);
-  rbtree_visit (&req->headers, header_free);
+  header_t *hdr = header_get (&ctx->req.headers, field);
+  return hdr ? mstr_data (&hdr->value) : NULL;
 }
 
-static int
-request_init (request_t *req, context_t *ctx)
+const char *
+context_param (context_t *ctx, const char *name, size_t *len)
 {
-  static __thread char line[MAX_REQLINE_LEN];
-  const char *pos, *end;
-  size_t len;
-  int ret;
+  size_t name_len = strlen (name);
 
-  if (!fgets (line, MAX_REQLINE_LEN, ctx->in))
-    return HTTPD_ERR_REQUEST_INIT_LINE;
+  for (size_t i = 0; i < ctx->match.cnt; i++)
+    {
+      router_param_t *p = &ctx->match.params[i];
+      if (p->name_len == name_len && memcmp (p->name, name, name_len) == 0)
+	{
+	  *len = p->value_len;
+	  return p->value;
+	}
+    }
 
-  pos = line;
-  if (!(end = strchr (pos, ' ')))
-    return HTTPD_ERR_REQUEST_INIT_METHOD;
-  len = end - pos;
+  return NULL;
+}
 
-  /* init method */
-  req->method = HTTPD_METHOD_EXTENSION;
+ssize_t
+context_read (context_t *ctx, void *buf, size_t len)
+{
+  /* HTTP/2 DATA frames are not delivered to handlers */
+  if (ctx->stream)
+    {
+      if (ctx->stream->remote_end)
+	return 0;
 
-  static const char *methods[] = { "GET",   "PUT",    "HEAD",	 "POST",
-				   "TRACE", "DELETE", "OPTIONS", "CONNECT" };
+      errno = ENOTSUP;
+      return -1;
+    }
 
-  for (int i = 0; i < HTTPD_METHOD_EXTENSION; i++)
-    if (strncmp (pos, methods[i], len) == 0)
-      {
-	req->method = i;
-	break;
-      }
+  return payload_pull (ctx, buf, len, true);
+}
 
-  pos = end + 1;
-  if (!(end = strchr (pos, ' ')))
-    return HTTPD_ERR_REQUEST_INIT_URI;
-  len = end - pos;
+ssize_t
+context_splice (context_t *ctx, int fd)
+{
+  ssize_t n;
+  size_t total = 0;
+  char buf[16 << 10];
+  int pipefd[2] = { -1, -1 };
+  client_t *clnt = ctx->clnt;
 
-  /* init uri */
-  req->uri = MSTR_INIT;
-  if (!mstr_assign_byte (&req->uri, pos, len))
-    return HTTPD_ERR_REQUEST_INIT_URI;
+  if (ctx->stream)
+    return context_read (ctx, buf, 0);
 
-  pos = end + 1;
-  if (!(end = strchr (pos, '\r')))
-    reto (HTTPD_ERR_REQUEST_INIT_VER, clean_uri);
-  len = end - pos;
+  while (!ctx->payload.done)
+    {
+      size_t avail = clnt->in + clnt->in_len - ctx->pos;
+
+      /* raw socket bytes are the body only for plain length framing */
+      if (!avail && !clnt->tls && ctx->payload.type == PAYLOAD_LENGTH)
+	{
+	  if (pipefd[0] == -1 && pipe2 (pipefd, O_CLOEXEC) != 0)
+	    goto clean_pipe;
+
+	  if ((n = payload_splice (ctx, pipefd, fd)) == -1)
+	    goto clean_pipe;
+	}
+      else
+	{
+	  if ((n = context_read (ctx, buf, sizeof (buf))) <= 0)
+	    {
+	      if (n == 0)
+		break;
+	      goto clean_pipe;
+	    }
+
+	  for (ssize_t w, off = 0; off < n; off += w)
+	    if ((w = write (fd, buf + off, n - off)) == -1)
+	      goto clean_pipe;
+	}
+
+      total += n;
+    }
 
-  /* init ver */
-  if (strncmp (pos, "HTTP/1.1", len) == 0)
-    req->proto = 0;
-  else if (strncmp (pos, "HTTP/1.0", len) == 0)
-    req->proto = 1;
-  else
-    reto (HTTPD_ERR_REQUEST_INIT_VER, clean_uri);
+  if (pipefd[0] != -1)
+    {
+      close (pipefd[0]);
+      close (pipefd[1]);
+    }
 
-  /* init headers */
-  req->headers = RBTREE_INIT;
+  return total;
 
-  for (header_t *hdr;;)
+clean_pipe:
+  if (pipefd[0] != -1)
     {
-      if (!fgets (line, MAX_REQLINE_LEN, ctx->in))
-	reto (HTTPD_ERR_REQUEST_INIT_LINE, clean_uri);
+      close (pipefd[0]);
+      close (pipefd[1]);
+    }
 
-      size_t len = strlen (line);
-      char *pos = line, *sep, *end;
+  return -1;
+}
 
-      /* end of parsing */
-      if (len == 2 && pos[0] == '\r' && pos[1] == '\n')
-	return 0;
+bool
+context_reply (context_t *ctx, int status, const char *type, const void *body,
+	       size_t len)
+{
+  char line[256];
+  response_mark_t mark = response_mark (&ctx->clnt->out);
 
-      /* init sep and end */
-      if (!(sep = strchr (pos, ':')) || !(end = strchr (sep, '\r')))
-	reto (HTTPD_ERR_REQUEST_INIT_HEADERS, clean_hdrs);
+  int n = snprintf (line, sizeof (line), "Content-Type: %s\r\n", type);
+  if (n < 0 || (size_t) n >= sizeof (line))
+    return false;
 
-      /* init header */
-      if (!(hdr = malloc (sizeof (header_t))))
-	reto (HTTPD_ERR_REQUEST_INIT_HEADERS, clean_hdrs);
+  if (ctx->cache.state != MCACHE_MISS && status == HTTPD_STATUS_OK)
+    cache_handler (ctx, type, body, len);
 
-      ptrdiff_t field_len = sep - pos;
-      hdr->field = hdr->value = MSTR_INIT;
+  ctx->replied = true;
+  if (header_init (ctx, status, (struct iovec) { line, n }, len, -1, false)
+      && body_copy (ctx, body, len))
+    return true;
 
-      if (field_len <= 0 || !mstr_assign_byte (&hdr->field, pos, field_len))
-	reto (HTTPD_ERR_REQUEST_INIT_HEADERS, clean_hdr);
+  serve_abort (ctx, mark);
+  return false;
+}
 
-      if (!mstr_assign_byte (&hdr->value, sep + 1, end - sep - 1))
-	reto (HTTPD_ERR_REQUEST_INIT_HEADERS, clean_field);
+void
+context_cache (context_t *ctx, const char *control)
+{
+  ctx->control = control;
+}
 
-      if (!header_insert (&req->headers, hdr))
-	reto (HTTPD_ERR_REQUEST_INIT_HEADERS, clean_value);
+bool
+context_stream (context_t *ctx, int status, const char *type,
+		response_read_t *read, response_close_t *close, void *arg)
+{
+  char line[256];
+  response_mark_t mark = response_mark (&ctx->clnt->out);
 
-      mstr_trim (&hdr->value, " \t");
+  int n = snprintf (line, sizeof (line), "Content-Type: %s\r\n", type);
+  if (n < 0 || (size_t) n >= sizeof (line))
+    {
+      if (close)
+	close (arg);
+      return false;
+    }
 
-      continue;
+  /* blocks are pulled only as the socket drains */
+  ctx->replied = true;
+  bool ok = header_init (ctx, status, (struct iovec) { line, n }, -1, -1, false);
+  if (body_stream (ctx, read, close, arg) && ok)
+    return true;
 
-    clean_value:
-      mstr_free (&hdr->value);
+  serve_abort (ctx, mark);
+  return false;
+}
 
-    clean_field:
-      mstr_free (&hdr->field);
+websocket_t *
+context_websocket (context_t *ctx, websocket_handler_t *handler, void *arg)
+{
+  char line[160];
+  websocket_t *ws;
+  client_t *clnt = ctx->clnt;
+  char accept[WS_ACCEPT_LEN + 1];
+
+  const char *upgrade = context_header (ctx, "Upgrade");
+  const char *conn = context_header (ctx, "Connection");
+  const char *key = context_header (ctx, "Sec-WebSocket-Key");
+  const char *ver = context_header (ctx, "Sec-WebSocket-Version");
+
+  /* RFC 6455 handshake, HTTP/1.1 GET without a body */
+  if (ctx->stream || ctx->req.proto != 0 || clnt->close || ctx->replied
+      || ctx->req.method != HTTPD_METHOD_GET || !ctx->payload.done)
+    return NULL;
 
-    clean_hdr:
-      free (hdr);
-      break;
-    }
+  if (!upgrade || strcasecmp (upgrade, "websocket") != 0 || !conn
+      || !strcasestr (conn, "upgrade") || !ver || strcmp (ver, "13") != 0
+      || !key || !ws_accept (key, strlen (key), accept))
+    return NULL;
 
-clean_hdrs:
-  rbtree_visit (&req->headers, header_free);
+  if (!(ws = websocket_new (clnt, handler, arg)))
+    return NULL;
 
-clean_uri:
-  mstr_free (&req->uri);
+  int n = snprintf (line, sizeof (line),
+		    "HTTP/1.1 101 Switching Protocols\r\n"
+		    "Upgrade: websocket\r\n"
+		    "Connection: Upgrade\r\n"
+		    "Sec-WebSocket-Accept: %s\r\n\r\n",
+		    accept);
 
-  return ret;
+  if (!response_add_copy (&clnt->out, line, n))
+    {
+      websocket_put (ws);
+      return NULL;
+    }
+
+  ctx->replied = true;
+  context_head (ctx, 101, -1);
+  clnt->ws = ws;
+  return ws;
 }
 
-static void
-context_free (context_t *ctx)
+websocket_t *
+websocket_hold (websocket_t *ws)
 {
-  fclose (ctx->in);
-  request_free (&ctx->req);
+  __atomic_add_fetch (&ws->refs, 1, __ATOMIC_RELAXED);
+  return ws;
 }
 
-static int
-context_init (context_t *ctx, client_t *clnt)
+void
+websocket_put (websocket_t *ws)
 {
-  int ret;
-
-  /* init in */
-  if (!(ctx->in = fdopen (clnt->sock, "r")))
-    return HTTPD_ERR_CONTEXT_INIT_IN;
+  if (__atomic_sub_fetch (&ws->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
 
-  /* init req */
-  if (request_init (&ctx->req, ctx) != 0)
-    reto (HTTPD_ERR_CONTEXT_INIT_REQ, clean_in);
+  pthread_mutex_destroy (&ws->lock);
+  mstr_free (&ws->outbox);
+  mstr_free (&ws->msg);
+  free (ws);
+}
 
-  /* init clnt */
-  ctx->clnt = clnt;
+bool
+websocket_send (websocket_t *ws, int opcode, const void *data, size_t len)
+{
+  pthread_mutex_lock (&ws->lock);
 
-  return 0;
+  /* any thread may push, a parked socket is handed to a worker */
+  bool ok = websocket_queue (ws, opcode, data, len);
+  if (ok)
+    websocket_wake (ws);
 
-clean_in:
-  fclose (ctx->in);
-  return ret;
+  pthread_mutex_unlock (&ws->lock);
+  return ok;
 }
 
-static void
-header_free (rbtree_node_t *n)
+void
+websocket_close (websocket_t *ws, int code)
 {
-  header_t *h = container_of (n, header_t, node);
-  mstr_free (&h->field);
-  mstr_free (&h->value);
-  free (h);
+  uint8_t data[2] = { code >> 8, code };
+
+  pthread_mutex_lock (&ws->lock);
+
+  if (websocket_queue (ws, WS_CLOSE, data, sizeof (data)))
+    {
+      ws->closing = true;
+      websocket_wake (ws);
+    }
+
+  pthread_mutex_unlock (&ws->lock);
 }
 
-static bool
-header_insert (rbtree_t *headers, header_t *header)
+static void
+server_reap (server_t *serv)
 {
-  return rbtree_insert (headers, &header->node, header_comp);
+  client_t *list;
+
+  pthread_mutex_lock (&serv->graveyard.lock);
+  list = serv->graveyard.list;
+  serv->graveyard.list = NULL;
+  pthread_mutex_unlock (&serv->graveyard.lock);
+
+  for (client_t *next; list; list = next)
+    {
+      next = list->next;
+      client_free (list);
+    }
 }
 
-static header_t *
-header_get (rbtree_t *headers, const char *field)
+static void
+server_accept (server_t *serv)
 {
-  header_t target = { .field = MSTR_VIEW (field, strlen (field)) };
-  rbtree_node_t *node = rbtree_find (headers, &target.node, header_comp);
-  return node ? container_of (node, header_t, node) : NULL;
+  client_t *clnt;
+  socklen_t len = sizeof (clnt->addr);
+
+  if (!(clnt = malloc (sizeof (client_t))))
+    error ("malloc failed");
+
+  /* init serv */
+  *clnt = (client_t) {
+    .serv = serv,
+    .accepted = metrics_now (),
+    .timer = WHEEL_NODE_INIT,
+  };
+
+  /* init sock and addr */
+  int server = serv->sock;
+  void *addr = &clnt->addr;
+  int flags = SOCK_NONBLOCK;
+  if ((clnt->sock = accept4 (server, addr, &len, flags)) == -1)
+    goto clean_clnt;
+
+  /* refused before any work is spent on it */
+  if ((serv->flags & SERVER_LIMIT)
+      && !limit_open (&serv->limit, clnt->addr.sin_addr.s_addr,
+		      clnt->accepted, &clnt->limited))
+    {
+      stat_add (serv, STAT_REFUSED, 1);
+      goto clean_sock;
+    }
+
+  /* apply socket profile */
+  if (serv->flags & SERVER_NODELAY)
+    {
+      int opt = true;
+      setsockopt (clnt->sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof (opt));
+    }
+
+  /* handshake on the first event */
+  if (serv->tls.ctx && !(clnt->tls = tls_accept (&serv->tls, clnt->sock)))
+    goto clean_sock;
+
+  /* wait for request, the handshake counts against the head */
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT };
+  ev.data.ptr = clnt;
+
+  timer_park (clnt, EPOLLIN);
+  if (epoll_ctl (serv->epfd, EPOLL_CTL_ADD, clnt->sock, &ev) != 0)
+    {
+      timer_cancel (clnt);
+      goto clean_sock;
+    }
+
+  stat_add (serv, STAT_CONNS, 1);
+  stat_add (serv, STAT_ACCEPTED, 1);
+  probe (conn_accept, clnt->sock, clnt->addr.sin_addr.s_addr, clnt);
+  return;
+
+clean_sock:
+  if (clnt->limited)
+    limit_close (&serv->limit, clnt->addr.sin_addr.s_addr);
+  close (clnt->sock);
+
+clean_clnt:
+  free (clnt);
 }
 
 static int
-header_comp (const rbtree_node_t *a, const rbtree_node_t *b)
+stat_init (server_t *serv, const char *name)
+{
+  char path[NAME_MAX];
+  stats_field_t fields[STAT_FIELDS] = {};
+
+  memcpy (fields, stat_fields, sizeof (stat_fields));
+
+  for (int i = 0; i < STAT_CODES - STAT_CLASSES; i++)
+    {
+      stats_field_t *f = &fields[STAT_CLASSES + i];
+      snprintf (f->name, STATS_NAME, "status_%dxx", i + 1);
+      snprintf (f->desc, STATS_DESC, "Responses with a %dxx status.", i + 1);
+    }
+
+  for (int i = 0; i < STAT_FIELDS - STAT_CODES; i++)
+    {
+      stats_field_t *f = &fields[STAT_CODES + i];
+      snprintf (f->name, STATS_NAME, "status_%d", stat_codes[i]);
+      snprintf (f->desc, STATS_DESC, "Responses with status %d.",
+		stat_codes[i]);
+    }
+
+  /* one segment per port */
+  if (stats_name (path, sizeof (path), name, serv->port) != 0)
+    return -1;
+
+  return stats_init (&serv->stats, path, fields, STAT_FIELDS);
+}
+
+static void
+stat_sample (server_t *serv)
+{
+  stats_t *st = &serv->stats;
+
+  if (!st->values)
+    return;
+
+  stats_set (st, STAT_QUEUE,
+	     __atomic_load_n (&serv->tpool.remain, __ATOMIC_RELAXED));
+  stats_set (st, STAT_RESOURCES,
+	     __atomic_load_n (&serv->rpool.count, __ATOMIC_RELAXED));
+  stats_set (st, STAT_RESOURCE_BYTES,
+	     __atomic_load_n (&serv->rpool.bytes, __ATOMIC_RELAXED));
+
+  if (serv->log.path)
+    stats_set (st, STAT_LOG_DROPPED,
+	       __atomic_load_n (&serv->log.dropped, __ATOMIC_RELAXED));
+
+  if (serv->flags & SERVER_LIMIT)
+    stats_set (st, STAT_LIMIT_OVERFLOW,
+	       __atomic_load_n (&serv->limit.overflow, __ATOMIC_RELAXED));
+}
+
+static void
+stat_status (server_t *serv, int status)
+{
+  if (!serv->stats.values || status < 100 || status >= 600)
+    return;
+
+  stat_add (serv, STAT_CLASSES + status / 100 - 1, 1);
+
+  for (int i = 0; i < STAT_FIELDS - STAT_CODES; i++)
+    if (stat_codes[i] == status)
+      return stat_add (serv, STAT_CODES + i, 1);
+}
+
+static uint64_t
+timer_now (void)
+{
+  return metrics_now () / (TIMER_TICK * 1000000ull);
+}
+
+/* the poll loop sleeps until the next deadline, workers arming sooner ones
+   wait at most one more round */
+static int
+timer_wait (server_t *serv)
+{
+  uint64_t next, now = timer_now ();
+
+  pthread_mutex_lock (&serv->timers.lock);
+  next = wheel_next (&serv->timers.wheel);
+  pthread_mutex_unlock (&serv->timers.lock);
+
+  /* overdue, expire before sleeping */
+  if (next <= now)
+    return 0;
+
+  if (next == UINT64_MAX || next - now > MAX_POLL_WAIT / TIMER_TICK)
+    return MAX_POLL_WAIT;
+
+  return (next - now) * TIMER_TICK;
+}
+
+static void
+timer_park (client_t *clnt, uint32_t events)
+{
+  server_t *serv = clnt->serv;
+  uint64_t now = timer_now (), expires;
+
+  /* websockets live as long as their peers want */
+  if (clnt->ws)
+    return;
+
+  if (events & EPOLLOUT || response_pending (&clnt->out))
+    expires = now + WRITE_TIMEOUT / TIMER_TICK;
+  else if (clnt->h2 || (clnt->served && !clnt->in_len))
+    {
+      clnt->head_by = 0;
+      expires = now + IDLE_TIMEOUT / TIMER_TICK;
+    }
+  else
+    {
+      /* a head trickled in over many wakeups still has one deadline */
+      if (!clnt->head_by)
+	clnt->head_by = now + HEADER_TIMEOUT / TIMER_TICK;
+      expires = clnt->head_by;
+    }
+
+  pthread_mutex_lock (&serv->timers.lock);
+  wheel_arm (&serv->timers.wheel, &clnt->timer, expires);
+  pthread_mutex_unlock (&serv->timers.lock);
+}
+
+static void
+timer_cancel (client_t *clnt)
+{
+  server_t *serv = clnt->serv;
+
+  pthread_mutex_lock (&serv->timers.lock);
+  wheel_cancel (&serv->timers.wheel, &clnt->timer);
+  pthread_mutex_unlock (&serv->timers.lock);
+}
+
+/* the owner is still whoever gets the hangup, it frees the client */
+static void
+timer_expire (server_t *serv)
+{
+  wheel_node_t *n;
+
+  pthread_mutex_lock (&serv->timers.lock);
+  n = wheel_advance (&serv->timers.wheel, timer_now ());
+
+  for (; n; n = n->next)
+    {
+      client_t *clnt = (client_t *) ((char *) n - offsetof (client_t, timer));
+      probe (conn_timeout, clnt->sock, clnt->addr.sin_addr.s_addr, clnt);
+      shutdown (clnt->sock, SHUT_RDWR);
+      stat_add (serv, STAT_TIMEOUTS, 1);
+    }
+
+  pthread_mutex_unlock (&serv->timers.lock);
+}
+
+static void
+client_free (client_t *clnt)
+{
+  timer_cancel (clnt);
+  stat_add (clnt->serv, STAT_CONNS, -1);
+  if (clnt->limited)
+    limit_close (&clnt->serv->limit, clnt->addr.sin_addr.s_addr);
+  probe (conn_close, clnt->sock, clnt->addr.sin_addr.s_addr, clnt);
+
+  if (clnt->h2)
+    {
+      h2_free (clnt->h2);
+      free (clnt->h2);
+    }
+
+  if (clnt->tls)
+    tls_close (clnt->tls);
+
+  if (clnt->ws)
+    {
+      pthread_mutex_lock (&clnt->ws->lock);
+      clnt->ws->clnt = NULL;
+      pthread_mutex_unlock (&clnt->ws->lock);
+      websocket_put (clnt->ws);
+    }
+
+  response_free (&clnt->out);
+  close (clnt->sock);
+  free (clnt->in);
+  free (clnt);
+}
+
+static int
+client_recv (client_t *clnt)
+{
+  bool eof = false;
+
+  if (!clnt->in && !(clnt->in = malloc (MAX_REQHEAD_LEN + 1)))
+    return RECV_ERROR;
+
+  for (ssize_t n; clnt->in_len < MAX_REQHEAD_LEN; clnt->in_len += n)
+    {
+      size_t room = MAX_REQHEAD_LEN - clnt->in_len;
+      if ((n = client_read (clnt, clnt->in + clnt->in_len, room)) > 0)
+	continue;
+
+      if (n == -1 && errno != EAGAIN)
+	return RECV_ERROR;
+
+      eof = n == 0;
+      break;
+    }
+
+  clnt->in[clnt->in_len] = '\0';
+  if (strstr (clnt->in, "\r\n\r\n"))
+    return RECV_OK;
+
+  return eof || clnt->in_len == MAX_REQHEAD_LEN ? RECV_ERROR : RECV_AGAIN;
+}
+
+static ssize_t
+client_read (client_t *clnt, void *buf, size_t len)
+{
+  if (clnt->tls)
+    return tls_recv (clnt->tls, buf, len);
+
+  return recv (clnt->sock, buf, len, 0);
+}
+
+static int
+client_flush (client_t *clnt)
+{
+  int ret;
+  metrics_t *m = &clnt->serv->metrics;
+  bool busy = response_pending (&clnt->out);
+  uint64_t start = metrics_now ();
+
+  /* offloaded sessions are written like plain sockets */
+  SSL *ssl = clnt->offload ? NULL : clnt->tls;
+  ret = response_flush (&clnt->out, clnt->sock, ssl, SEND_CHUNK, SEND_QUOTA);
+
+  if (!busy)
+    return ret;
+
+  uint64_t end = metrics_now ();
+  metrics_observe (m, METRIC_SEND, end - start);
+
+  /* the first write after accept */
+  if (clnt->accepted && ret != RESPONSE_ERROR)
+    {
+      metrics_observe (m, METRIC_FIRST_BYTE, end - clnt->accepted);
+      clnt->accepted = 0;
+    }
+
+  return ret;
+}
+
+static int
+client_wait (client_t *clnt, uint32_t events)
+{
+  struct epoll_event ev = { .events = events | EPOLLONESHOT };
+  ev.data.ptr = clnt;
+
+  timer_park (clnt, events);
+  return epoll_ctl (clnt->serv->epfd, EPOLL_CTL_MOD, clnt->sock, &ev);
+}
+
+/* the worker stays with the connection until everything is out or by, in
+   metrics_now time, has passed */
+static bool
+client_push (client_t *clnt, uint64_t by)
+{
+  struct pollfd pfd = { .fd = clnt->sock, .events = POLLOUT };
+
+  for (int ret;;)
+    {
+      if ((ret = client_flush (clnt)) == RESPONSE_DONE)
+	return true;
+
+      uint64_t now = metrics_now ();
+      if (ret == RESPONSE_ERROR || now >= by
+	  || poll (&pfd, 1, (by - now) / 1000000 + 1) <= 0)
+	return false;
+    }
+}
+
+static void
+client_cork (client_t *clnt, int on)
+{
+  if (clnt->serv->flags & SERVER_CORK)
+    setsockopt (clnt->sock, IPPROTO_TCP, TCP_CORK, &on, sizeof (on));
+}
+
+static void
+client_consume (client_t *clnt, size_t n)
+{
+  clnt->in_len -= n;
+  memmove (clnt->in, clnt->in + n, clnt->in_len + 1);
+}
+
+static int
+client_upgrade (client_t *clnt)
+{
+  char *in;
+  h2_t *h2;
+
+  if (!(h2 = malloc (sizeof (h2_t))))
+    return -1;
+
+  /* frames need more room than a request head */
+  if (!(in = realloc (clnt->in, H2_RECV_SIZE + 1)))
+    goto clean_h2;
+  clnt->in = in;
+
+  if (h2_init (h2, &clnt->out, H2_STREAMS, serve_stream, clnt) != 0)
+    goto clean_h2;
+
+  clnt->h2 = h2;
+  return 0;
+
+clean_h2:
+  free (h2);
+  return -1;
+}
+
+static websocket_t *
+websocket_new (client_t *clnt, websocket_handler_t *handler, void *arg)
+{
+  websocket_t *ws;
+
+  if (!(ws = malloc (sizeof (websocket_t))))
+    return NULL;
+
+  /* the worker that upgrades it runs it first */
+  *ws = (websocket_t) {
+    .refs = 1,
+    .running = true,
+    .clnt = clnt,
+    .arg = arg,
+    .handler = handler,
+    .outbox = MSTR_INIT,
+    .msg = MSTR_INIT,
+  };
+
+  pthread_mutex_init (&ws->lock, NULL);
+  return ws;
+}
+
+static bool
+websocket_claim (websocket_t *ws)
+{
+  pthread_mutex_lock (&ws->lock);
+  bool idle = !ws->running;
+  ws->running = true;
+  pthread_mutex_unlock (&ws->lock);
+
+  return idle;
+}
+
+static void
+websocket_wake (websocket_t *ws)
+{
+  client_t *clnt = ws->clnt;
+
+  /* the lock is held, only one side wins a parked socket */
+  if (ws->running || !clnt)
+    return;
+
+  ws->running = true;
+  if (threadpool_post (&clnt->serv->tpool, serve, clnt) != 0)
+    ws->running = false;
+}
+
+static bool
+websocket_queue (websocket_t *ws, int opcode, const void *data, size_t len)
+{
+  uint8_t head[WS_HEAD_MAX];
+  size_t n = ws_head (head, opcode, true, len);
+  size_t old = mstr_len (&ws->outbox);
+
+  /* a slow reader pushes back on the sender */
+  if (ws->dead || ws->closing || old + n + len > WS_OUTBOX_MAX)
+    return false;
+
+  if (mstr_cat_byte (&ws->outbox, head, n)
+      && mstr_cat_byte (&ws->outbox, len ? data : "", len))
+    return true;
+
+  mstr_remove (&ws->outbox, old, mstr_len (&ws->outbox) - old);
+  return false;
+}
+
+static int
+websocket_collect (websocket_t *ws)
+{
+  response_t *out = &ws->clnt->out;
+
+  pthread_mutex_lock (&ws->lock);
+
+  /* the close frame is queued last, nothing follows it */
+  int ret = ws->closing;
+  size_t len = mstr_len (&ws->outbox);
+
+  if (len && !response_add_copy (out, mstr_data (&ws->outbox), len))
+    ret = -1;
+
+  mstr_free (&ws->outbox);
+  ws->outbox = MSTR_INIT;
+
+  pthread_mutex_unlock (&ws->lock);
+  return ret;
+}
+
+static int
+websocket_park (client_t *clnt, uint32_t events)
+{
+  int ret = 0;
+  websocket_t *ws = clnt->ws;
+
+  pthread_mutex_lock (&ws->lock);
+
+  /* frames pushed meanwhile go out before sleeping */
+  if (events == EPOLLIN && mstr_len (&ws->outbox))
+    ret = 1;
+  else
+    {
+      ws->running = false;
+      if (client_wait (clnt, events) != 0)
+	{
+	  ws->running = true;
+	  ret = -1;
+	}
+    }
+
+  pthread_mutex_unlock (&ws->lock);
+  return ret;
+}
+
+static bool
+websocket_recv (client_t *clnt)
+{
+  int code = 0;
+  bool stop = false;
+  websocket_t *ws = clnt->ws;
+  ws_frame_t *f = &ws->frame;
+  char *pos = clnt->in, *end = pos + clnt->in_len;
+
+  while (!stop)
+    {
+      if (!ws->inframe)
+	{
+	  ssize_t n = ws_parse (f, pos, end - pos);
+	  if (n == 0)
+	    break;
+
+	  if (n < 0)
+	    {
+	      code = WS_CLOSE_PROTOCOL;
+	      break;
+	    }
+
+	  bool control = ws_is_control (f->opcode);
+
+	  /* control payloads are handled whole */
+	  if (control && (uint64_t) (end - pos - n) < f->len)
+	    break;
+
+	  /* continuations need an open message, new messages need none */
+	  if (!control && (f->opcode == WS_CONT) != (ws->msg_op != 0))
+	    {
+	      code = WS_CLOSE_PROTOCOL;
+	      break;
+	    }
+
+	  if (!control && f->len > WS_MESSAGE_MAX - mstr_len (&ws->msg))
+	    {
+	      code = WS_CLOSE_TOO_BIG;
+	      break;
+	    }
+
+	  if (!control && f->opcode != WS_CONT)
+	    ws->msg_op = f->opcode;
+
+	  pos += n;
+	  ws->inframe = true;
+	  ws->left = f->len;
+	  ws->off = 0;
+	}
+
+      /* payloads stream through the buffer, unmasked in place */
+      size_t take = (size_t) (end - pos) < ws->left ? (size_t) (end - pos)
+						   : ws->left;
+      if (!take && ws->left)
+	break;
+
+      ws_unmask (pos, take, f->mask, ws->off);
+
+      if (!ws_is_control (f->opcode))
+	{
+	  if (!mstr_cat_byte (&ws->msg, pos, take))
+	    return false;
+	}
+      else if (f->opcode != WS_PONG)
+	{
+	  /* answer pings, echo the close code */
+	  int op = f->opcode == WS_PING ? WS_PONG : WS_CLOSE;
+	  size_t len = op == WS_PONG ? take : take < 2 ? 0 : 2;
+
+	  pthread_mutex_lock (&ws->lock);
+	  websocket_queue (ws, op, pos, len);
+	  if (op == WS_CLOSE)
+	    ws->closing = stop = true;
+	  pthread_mutex_unlock (&ws->lock);
+	}
+
+      pos += take;
+      ws->off += take;
+      if ((ws->left -= take))
+	break;
+
+      ws->inframe = false;
+
+      if (ws_is_control (f->opcode) || !f->fin)
+	continue;
+
+      ws->handler (ws, ws->msg_op, mstr_data (&ws->msg), mstr_len (&ws->msg),
+		   ws->arg);
+
+      ws->msg_op = 0;
+      mstr_free (&ws->msg);
+      ws->msg = MSTR_INIT;
+    }
+
+  client_consume (clnt, pos - clnt->in);
+
+  if (code)
+    {
+      uint8_t data[2] = { code >> 8, code };
+
+      pthread_mutex_lock (&ws->lock);
+      websocket_queue (ws, WS_CLOSE, data, sizeof (data));
+      ws->closing = true;
+      pthread_mutex_unlock (&ws->lock);
+    }
+
+  return true;
+}
+
+static void
+websocket_end (client_t *clnt)
+{
+  websocket_t *ws = clnt->ws;
+  server_t *serv = clnt->serv;
+
+  pthread_mutex_lock (&ws->lock);
+  ws->dead = true;
+  pthread_mutex_unlock (&ws->lock);
+
+  ws->handler (ws, WS_CLOSE, NULL, 0, ws->arg);
+
+  /* events already fetched may still name it, the poll loop frees it */
+  epoll_ctl (serv->epfd, EPOLL_CTL_DEL, clnt->sock, NULL);
+
+  pthread_mutex_lock (&serv->graveyard.lock);
+  clnt->next = serv->graveyard.list;
+  serv->graveyard.list = clnt;
+  pthread_mutex_unlock (&serv->graveyard.lock);
+}
+
+static void
+request_free (request_t *req)
+{
+  mstr_free (&req->uri);
+  rbtree_visit (&req->headers, header_free);
+}
+
+static int
+request_method (const char *pos, size_t len)
+{
+  for (int i = 0; i < HTTPD_METHOD_EXTENSION; i++)
+    if (strncmp (pos, methods[i], len) == 0)
+      return i;
+
+  return HTTPD_METHOD_EXTENSION;
+}
+
+/* extension methods are not kept, only that there was one */
+static const char *
+request_method_name (int method)
+{
+  return method < HTTPD_METHOD_EXTENSION ? methods[method] : "-";
+}
+
+static char *
+request_line (context_t *ctx)
+{
+  char *line = ctx->pos, *end;
+
+  if (!(end = strchr (line, '\n')))
+    return NULL;
+
+  *end = '\0';
+  ctx->pos = end + 1;
+  return line;
+}
+
+static int
+request_init (request_t *req, context_t *ctx)
+{
+  const char *line, *pos, *end;
+  size_t len;
+  int ret;
+
+  if (!(line = request_line (ctx)))
+    return HTTPD_ERR_REQUEST_INIT_LINE;
+
+  pos = line;
+  if (!(end = strchr (pos, ' ')))
+    return HTTPD_ERR_REQUEST_INIT_METHOD;
+  len = end - pos;
+
+  /* init method */
+  req->method = request_method (pos, len);
+
+  pos = end + 1;
+  if (!(end = strchr (pos, ' ')))
+    return HTTPD_ERR_REQUEST_INIT_URI;
+  len = end - pos;
+
+  /* init uri */
+  req->uri = MSTR_INIT;
+  if (!mstr_assign_byte (&req->uri, pos, len))
+    return HTTPD_ERR_REQUEST_INIT_URI;
+
+  pos = end + 1;
+  if (!(end = strchr (pos, '\r')))
+    reto (HTTPD_ERR_REQUEST_INIT_VER, clean_uri);
+  len = end - pos;
+
+  /* init ver */
+  if (strncmp (pos, "HTTP/1.1", len) == 0)
+    req->proto = 0;
+  else if (strncmp (pos, "HTTP/1.0", len) == 0)
+    req->proto = 1;
+  else
+    reto (HTTPD_ERR_REQUEST_INIT_VER, clean_uri);
+
+  /* init headers */
+  req->headers = RBTREE_INIT;
+
+  for (header_t *hdr;;)
+    {
+      char *pos, *sep, *end;
+
+      if (!(pos = request_line (ctx)))
+	reto (HTTPD_ERR_REQUEST_INIT_LINE, clean_hdrs);
+
+      /* end of parsing */
+      if (pos[0] == '\r' && pos[1] == '\0')
+	return 0;
+
+      /* init sep and end */
+      if (!(sep = strchr (pos, ':')) || !(end = strchr (sep, '\r')))
+	reto (HTTPD_ERR_REQUEST_INIT_HEADERS, clean_hdrs);
+
+      /* init header */
+      if (!(hdr = malloc (sizeof (header_t))))
+	reto (HTTPD_ERR_REQUEST_INIT_HEADERS, clean_hdrs);
+
+      ptrdiff_t field_len = sep - pos;
+      hdr->field = hdr->value = MSTR_INIT;
+
+      if (field_len <= 0 || !mstr_assign_byte (&hdr->field, pos, field_len))
+	reto (HTTPD_ERR_REQUEST_INIT_HEADERS, clean_hdr);
+
+      if (!mstr_assign_byte (&hdr->value, sep + 1, end - sep - 1))
+	reto (HTTPD_ERR_REQUEST_INIT_HEADERS, clean_field);
+
+      if (!header_insert (&req->headers, hdr))
+	reto (HTTPD_ERR_REQUEST_INIT_HEADERS, clean_value);
+
+      mstr_trim (&hdr->value, " \t");
+
+      continue;
+
+    clean_value:
+      mstr_free (&hdr->value);
+
+    clean_field:
+      mstr_free (&hdr->field);
+
+    clean_hdr:
+      free (hdr);
+      break;
+    }
+
+clean_hdrs:
+  rbtree_visit (&req->headers, header_free);
+
+clean_uri:
+  mstr_free (&req->uri);
+
+  return ret;
+}
+
+static int
+request_init_h2 (request_t *req, const hpack_field_t *fields, size_t cnt)
+{
+  int ret;
+  const hpack_field_t *method = NULL, *path = NULL;
+
+  /* init headers */
+  req->proto = 2;
+  req->headers = RBTREE_INIT;
+
+  for (size_t i = 0; i < cnt; i++)
+    {
+      const hpack_field_t *f = &fields[i];
+
+      if (f->name_len && f->name[0] != ':')
+	{
+	  if (!header_add (&req->headers, f->name, f->name_len, f->value,
+			   f->value_len))
+	    reto (HTTPD_ERR_REQUEST_INIT_HEADERS, clean_hdrs);
+	}
+      else if (f->name_len == 7 && memcmp (f->name, ":method", 7) == 0)
+	method = f;
+      else if (f->name_len == 5 && memcmp (f->name, ":path", 5) == 0)
+	path = f;
+      else if (f->name_len == 10 && memcmp (f->name, ":authority", 10) == 0
+	       && !header_add (&req->headers, "Host", 4, f->value,
+			       f->value_len))
+	reto (HTTPD_ERR_REQUEST_INIT_HEADERS, clean_hdrs);
+    }
+
+  /* init method */
+  if (!method)
+    reto (HTTPD_ERR_REQUEST_INIT_METHOD, clean_hdrs);
+  req->method = request_method (method->value, method->value_len);
+
+  /* init uri */
+  req->uri = MSTR_INIT;
+  if (!path || !mstr_assign_byte (&req->uri, path->value, path->value_len))
+    reto (HTTPD_ERR_REQUEST_INIT_URI, clean_hdrs);
+
+  return 0;
+
+clean_hdrs:
+  rbtree_visit (&req->headers, header_free);
+
+  return ret;
+}
+
+static bool
+request_copy (request_t *dst, request_t *src)
+{
+  rbtree_node_t *node = rbtree_first (&src->headers);
+
+  dst->proto = src->proto;
+  dst->method = src->method;
+  dst->uri = MSTR_INIT;
+  dst->headers = RBTREE_INIT;
+
+  if (!mstr_assign_byte (&dst->uri, mstr_data (&src->uri),
+			 mstr_len (&src->uri)))
+    return false;
+
+  for (; node; node = rbtree_next (node))
+    {
+      header_t *hdr = container_of (node, header_t, node);
+      if (!header_add (&dst->headers, mstr_data (&hdr->field),
+		       mstr_len (&hdr->field), mstr_data (&hdr->value),
+		       mstr_len (&hdr->value)))
+	{
+	  request_free (dst);
+	  return false;
+	}
+    }
+
+  return true;
+}
+
+static void
+context_free (context_t *ctx)
+{
+  mstr_free (&ctx->cache.key);
+  request_free (&ctx->req);
+}
+
+static int
+context_init (context_t *ctx, client_t *clnt, char *pos)
+{
+  /* init in */
+  if (!(ctx->pos = pos))
+    return HTTPD_ERR_CONTEXT_INIT_IN;
+
+  /* init clnt */
+  ctx->clnt = clnt;
+  ctx->stream = NULL;
+  ctx->replied = false;
+  ctx->control = NULL;
+
+  /* init log */
+  ctx->log.status = 0;
+  ctx->log.size = -1;
+  ctx->log.start = metrics_now ();
+
+  /* init cache */
+  ctx->cache.state = MCACHE_MISS;
+  ctx->cache.key = MSTR_INIT;
+
+  /* init req */
+  int ret;
+  if ((ret = request_init (&ctx->req, ctx)) != 0)
+    {
+      metric_count (clnt->serv, METRIC_ERRORS + ret);
+      return HTTPD_ERR_CONTEXT_INIT_REQ;
+    }
+
+  return 0;
+}
+
+/* every head goes out through here, the log and the probe see the same */
+static void
+context_head (context_t *ctx, int status, ssize_t size)
+{
+  ctx->log.status = status;
+  ctx->log.size = size;
+
+  /* a background refresh answers nobody, it is not counted */
+  if (ctx->clnt->sock != -1)
+    stat_status (ctx->clnt->serv, status);
+  probe (response_start, ctx->clnt->sock, status, size);
+}
+
+static void
+header_free (rbtree_node_t *n)
+{
+  header_t *h = container_of (n, header_t, node);
+  mstr_free (&h->field);
+  mstr_free (&h->value);
+  free (h);
+}
+
+static bool
+header_insert (rbtree_t *headers, header_t *header)
+{
+  return rbtree_insert (headers, &header->node, header_comp);
+}
+
+static bool
+header_add (rbtree_t *headers, const char *field, size_t field_len,
+	    const char *value, size_t value_len)
+{
+  header_t *hdr;
+
+  if (!(hdr = malloc (sizeof (header_t))))
+    return false;
+
+  hdr->field = hdr->value = MSTR_INIT;
+
+  if (!mstr_assign_byte (&hdr->field, field, field_len)
+      || !mstr_assign_byte (&hdr->value, value, value_len))
+    goto clean_hdr;
+
+  /* a repeated field keeps its first value */
+  if (!header_insert (headers, hdr))
+    header_free (&hdr->node);
+
+  return true;
+
+clean_hdr:
+  mstr_free (&hdr->field);
+  mstr_free (&hdr->value);
+  free (hdr);
+  return false;
+}
+
+static header_t *
+header_get (rbtree_t *headers, const char *field)
+{
+  header_t target = { .field = MSTR_VIEW (field, strlen (field)) };
+  rbtree_node_t *node = rbtree_find (headers, &target.node, header_comp);
+  return node ? container_of (node, header_t, node) : NULL;
+}
+
+static int
+header_comp (const rbtree_node_t *a, const rbtree_node_t *b)
+{
+  const header_t *ha = container_of (a, header_t, node);
+  const header_t *hb = container_of (b, header_t, node);
+  return mstr_icmp_mstr (&ha->field, &hb->field);
+}
+
+static void
+serve (void *arg)
+{
+  client_t *clnt = arg;
+
+  if (clnt->tls && !clnt->secure)
+    return serve_handshake (clnt);
+
+  if (clnt->ws)
+    return serve_ws (clnt);
+
+  /* upgraded connections frame their own traffic */
+  if (clnt->h2)
+    return serve_h2 (clnt);
+
+  /* resume pending response */
+  if (response_pending (&clnt->out))
+    return serve_resume (clnt);
+
+  switch (client_recv (clnt))
+    {
+    case RECV_AGAIN:
+      if (client_wait (clnt, EPOLLIN) == 0)
+	return;
+      /* fall through */
+
+    case RECV_ERROR:
+      return client_free (clnt);
+    }
+
+  serve_batch (clnt);
+  serve_resume (clnt);
+}
+
+static void
+serve_batch (client_t *clnt)
+{
+  char *pos = clnt->in;
+
+  /* HTTP/2 with prior knowledge, h2_recv checks the full preface */
+  size_t len = clnt->in_len < H2_PREFACE_LEN ? clnt->in_len : H2_PREFACE_LEN;
+  if (strncmp (pos, H2_PREFACE, len) == 0)
+    {
+      if (client_upgrade (clnt) != 0)
+	clnt->close = true;
+      return;
+    }
+
+  /* answer the complete requests already buffered, in order */
+  for (int i = 0; i < PIPELINE_MAX && !clnt->close; i++)
+    {
+      int status;
+      context_t ctx;
+      header_t *settings;
+
+      if (!strstr (pos, "\r\n\r\n"))
+	break;
+
+      uint64_t start = metrics_now ();
+      if (context_init (&ctx, clnt, pos) != 0)
+	{
+	  clnt->close = true;
+	  break;
+	}
+
+      metric_since (clnt->serv, METRIC_PARSE, start);
+      clnt->served = true;
+      clnt->head_by = 0;
+      probe (request, clnt->sock, request_method_name (ctx.req.method),
+	     mstr_data (&ctx.req.uri), mstr_len (&ctx.req.uri), ctx.pos - pos);
+
+      pos = ctx.pos;
+      clnt->close = !keep_alive (&ctx);
+
+      /* a body that cannot be framed leaves the stream unparseable */
+      if ((status = payload_init (&ctx)) != HTTPD_STATUS_OK)
+	{
+	  clnt->close = true;
+	  serve_status (&ctx, status);
+	  access_log (&ctx);
+	  context_free (&ctx);
+	  break;
+	}
+
+      /* the rest of the input belongs to the new protocol */
+      if (!clnt->close && ctx.payload.done && (settings = upgrade_h2c (&ctx)))
+	{
+	  client_consume (clnt, pos - clnt->in);
+	  serve_upgrade (&ctx, settings);
+	  context_free (&ctx);
+	  return;
+	}
+
+      serve_route (&ctx);
+      payload_skip (&ctx);
+      access_log (&ctx);
+
+      /* the handler may have read the body past the head */
+      pos = ctx.pos;
+      context_free (&ctx);
+
+      /* the rest of the input is frames */
+      if (clnt->ws)
+	{
+	  client_consume (clnt, pos - clnt->in);
+	  return;
+	}
+    }
+
+  /* drop parsed heads */
+  client_consume (clnt, pos - clnt->in);
+  client_cork (clnt, true);
+}
+
+static void
+serve_file (context_t *ctx, resource_t *res)
+{
+  server_t *serv = ctx->clnt->serv;
+  response_t *out = &ctx->clnt->out;
+
+  if (!res)
+    return serve_status (ctx, HTTPD_STATUS_NOT_FOUND);
+
+  int fd = res->fd;
+  gzip_stream_t *zip = NULL;
+  size_t size = res->size;
+  resource_blob_t *blob = NULL;
+
+  int accept = accept_encoding (ctx);
+  bool eligible = gzip_eligible (serv, res);
+
+  /* pick a precompressed variant */
+  int enc;
+  if ((enc = respool_select (res, accept)) != -1)
+    {
+      fd = res->variants[enc].fd;
+      size = res->variants[enc].size;
+    }
+
+  /* or compress on the fly */
+  else if (eligible && (accept & (1 << RESOURCE_ENC_GZIP)))
+    {
+      if (res->size <= GZIP_MAX)
+	{
+	  if ((blob = gzip_blob (serv, res)))
+	    {
+	      enc = RESOURCE_ENC_GZIP;
+	      size = blob->size;
+	    }
+	}
+      else if ((zip = malloc (sizeof (gzip_stream_t))))
+	{
+	  zip->res = res;
+	  if (gzip_init (&zip->zip, res->fd, res->size, GZIP_LEVEL) == Z_OK)
+	    enc = RESOURCE_ENC_GZIP;
+	  else
+	    zip = (free (zip), NULL);
+	}
+    }
+
+  /* queue header */
+  struct iovec type = tpl_plain;
+  if (res->mime)
+    type = (struct iovec) { (void *) res->mime->field, res->mime->field_len };
+
+  bool vary = res->encs || eligible;
+  ssize_t len = zip ? -1 : (ssize_t) size;
+  response_mark_t mark = response_mark (out);
+  bool ok = header_init (ctx, HTTPD_STATUS_OK, type, len, enc, vary);
+
+  /* queue body, its references move to the response */
+  if (zip)
+    ok = body_stream (ctx, gzip_pull, gzip_close, zip) && ok;
+  else if (blob)
+    {
+      respool_put (res);
+      ok = body_blob (ctx, blob, 0, size) && ok;
+    }
+  else
+    ok = body_file (ctx, res, fd, size) && ok;
+
+  if (!ok)
+    serve_abort (ctx, mark);
+}
+
+static void
+serve_route (context_t *ctx)
+{
+  router_match_t *m = &ctx->match;
+  server_t *serv = ctx->clnt->serv;
+
+  metric_count (serv, METRIC_REQUESTS);
+  stat_add (serv, STAT_REQUESTS, 1);
+
+  /* over its rate, answered from the template and the connection ends */
+  if ((serv->flags & SERVER_LIMIT)
+      && !limit_take (&serv->limit, ctx->clnt->addr.sin_addr.s_addr,
+		      metrics_now ()))
+    {
+      if (!ctx->stream)
+	ctx->clnt->close = true;
+      return serve_status (ctx, HTTPD_STATUS_TOO_MANY_REQUESTS);
+    }
+
+  switch (serve_match (ctx))
+    {
+    case ROUTER_FOUND:
+      if (cache_serve (ctx))
+	return;
+
+      ((server_handler_t *) m->handler) (ctx, &ctx->req);
+      cache_abandon (ctx);
+
+      /* a handler that returns silently still owes an answer */
+      if (!ctx->replied)
+	serve_status (ctx, HTTPD_STATUS_INTERNAL_ERROR);
+      return;
+
+    case ROUTER_NOT_ALLOWED:
+      return serve_status (ctx, HTTPD_STATUS_METHOD_NOT_ALLOWED);
+    }
+
+  /* misses go upstream with their body */
+  uint64_t start = metrics_now ();
+  resource_t *res = resource_get (ctx);
+  metric_since (serv, METRIC_LOOKUP, start);
+  if (!res && serv->proxy.len)
+    {
+      if (!cache_serve (ctx))
+	serve_proxy (ctx);
+      return cache_abandon (ctx);
+    }
+
+  /* files ignore bodies, drop one that already arrived */
+  if (!ctx->stream)
+    payload_skip (ctx);
+
+  serve_file (ctx, res);
+}
+
+static int
+serve_match (context_t *ctx)
+{
+  server_t *serv = ctx->clnt->serv;
+
+  /* the query takes no part in routing */
+  const char *path = mstr_data (&ctx->req.uri);
+  size_t len = mstr_len (&ctx->req.uri);
+  const char *query = memchr (path, '?', len);
+  if (query)
+    len = query - path;
+
+  return router_match (&serv->router, ctx->req.method, path, len,
+		       &ctx->match);
+}
+
+static void
+serve_resume (client_t *clnt)
+{
+  if (clnt->h2)
+    return serve_h2 (clnt);
+
+  for (int ret;;)
+    {
+      if (clnt->ws)
+	return serve_ws (clnt);
+
+      ret = client_flush (clnt);
+
+      /* park until writable */
+      if (ret == RESPONSE_AGAIN)
+	{
+	  if (client_wait (clnt, EPOLLOUT) == 0)
+	    return;
+	  break;
+	}
+
+      if (ret == RESPONSE_ERROR || clnt->close)
+	break;
+
+      /* requests held back by the pipeline cap */
+      if (strstr (clnt->in, "\r\n\r\n"))
+	{
+	  serve_batch (clnt);
+	  continue;
+	}
+
+      /* wait for the next request */
+      client_cork (clnt, false);
+
+      /* decrypted input the socket will not signal */
+      if (clnt->tls && SSL_pending (clnt->tls))
+	return serve (clnt);
+
+      if (client_wait (clnt, EPOLLIN) == 0)
+	return;
+      break;
+    }
+
+  client_cork (clnt, false);
+  client_free (clnt);
+}
+
+static void
+serve_handshake (client_t *clnt)
+{
+  switch (tls_handshake (clnt->tls))
+    {
+    case TLS_WANT_READ:
+      if (client_wait (clnt, EPOLLIN) == 0)
+	return;
+      break;
+
+    case TLS_WANT_WRITE:
+      if (client_wait (clnt, EPOLLOUT) == 0)
+	return;
+      break;
+
+    case TLS_OK:
+      clnt->secure = true;
+      clnt->offload = tls_offloaded (clnt->tls);
+
+      /* ALPN picked the protocol, no preface sniffing needed */
+      if (tls_proto (clnt->tls) == TLS_PROTO_H2 && client_upgrade (clnt) != 0)
+	break;
+
+      return serve (clnt);
+    }
+
+  client_free (clnt);
+}
+
+static void
+serve_status (context_t *ctx, int status)
+{
+  response_t *out = &ctx->clnt->out;
+  response_mark_t mark = response_mark (out);
+
+  /* a background refresh answers nobody, it is not counted */
+  bool counted = ctx->clnt->sock != -1;
+
+  if (counted && status == HTTPD_STATUS_NOT_FOUND)
+    metric_count (ctx->clnt->serv, METRIC_NOT_FOUND);
+  else if (counted && status_codes[status] >= 500)
+    metric_count (ctx->clnt->serv, METRIC_SERVER_ERRORS);
+
+  /* the body is the status line without version and CRLF */
+  const char *msg = (const char *) tpl_status[status].iov_base + 9;
+  size_t len = tpl_status[status].iov_len - 11;
+
+  if (header_init (ctx, status, tpl_html, len, -1, false)
+      && body_ref (ctx, msg, len))
+    return;
+
+  serve_abort (ctx, mark);
+}
+
+static void
+serve_abort (context_t *ctx, response_mark_t mark)
+{
+  /* never send half a response */
+  response_rewind (&ctx->clnt->out, mark);
+
+  if (ctx->stream)
+    h2_reset (ctx->clnt->h2, ctx->stream, H2_INTERNAL_ERROR);
+  else
+    ctx->clnt->close = true;
+}
+
+static void
+serve_proxy (context_t *ctx)
+{
+  int status;
+  proxy_conn_t *up;
+  mstr_t head = MSTR_INIT;
+  client_t *clnt = ctx->clnt;
+  server_t *serv = clnt->serv;
+  response_t *out = &clnt->out;
+
+  /* HTTP/2 request bodies are not delivered past the frame layer */
+  if ((ctx->stream && !ctx->stream->remote_end)
+      || ctx->req.method == HTTPD_METHOD_EXTENSION)
+    return serve_status (ctx, HTTPD_STATUS_NOT_IMPLEMENTED);
+
+  if (!upstream_request (ctx, &head))
+    {
+      mstr_free (&head);
+      return serve_status (ctx, HTTPD_STATUS_INTERNAL_ERROR);
+    }
+
+  bool is_head = ctx->req.method == HTTPD_METHOD_HEAD;
+
+  for (int i = 0;; i++)
+    {
+      if ((up = proxy_open (&serv->proxy))
+	  && proxy_send (up, mstr_data (&head), mstr_len (&head))
+	  && upstream_body (ctx, up) && proxy_head (up, is_head) == 0)
+	break;
+
+      /* a pooled connection the upstream dropped meanwhile, tried once more */
+      bool retry = up && up->reused && !up->len && !ctx->payload.total
+		   && errno != ETIMEDOUT;
+      status = errno == ETIMEDOUT ? HTTPD_STATUS_GATEWAY_TIMEOUT
+				  : HTTPD_STATUS_BAD_GATEWAY;
+      if (up)
+	proxy_release (up, false);
+
+      if (!retry || i)
+	{
+	  mstr_free (&head);
+	  return serve_status (ctx, status);
+	}
+    }
+
+  mstr_free (&head);
+
+  if (ctx->cache.state != MCACHE_MISS && cache_upstream (ctx, up))
+    return;
+
+  /* a refresh has nobody to pass an uncacheable answer to */
+  if (ctx->cache.state == MCACHE_REFRESH)
+    return proxy_close (up);
+
+  response_mark_t mark = response_mark (out);
+  bool ok = header_upstream (ctx, up);
+
+  /* the connection goes back to the pool once its body is out */
+  if (up->done)
+    {
+      proxy_close (up);
+      if (ok)
+	return;
+    }
+
+  else if (ctx->stream)
+    {
+      if (h2_send_stream (clnt->h2, ctx->stream, proxy_read, proxy_close, up)
+	  && ok)
+	return;
+    }
+
+  /* sockets the kernel writes to take the body without a copy */
+  else if (up->body == PROXY_BODY_LENGTH && (!clnt->tls || clnt->offload))
+    {
+      size_t avail = up->len - up->pos;
+      if (avail > up->remain)
+	avail = up->remain;
+
+      ok = response_add_copy (out, up->buf + up->pos, avail) && ok;
+      up->pos += avail;
+      up->remain -= avail;
+      up->done = !up->remain;
+
+      if (up->done)
+	proxy_close (up);
+      else
+	ok = response_add_splice (out, up->sock, up->remain, proxy_release, up)
+	     && ok;
+
+      if (ok)
+	return;
+    }
+
+  else
+    {
+      bool chunked = up->length == -1 && ctx->req.proto != 1;
+      if (response_add_stream (out, proxy_read, proxy_close, up, chunked)
+	  && ok)
+	return;
+    }
+
+  serve_abort (ctx, mark);
+}
+
+static void
+serve_metrics (context_t *ctx, const request_t *req)
+{
+  (void) req;
+
+  int n;
+  bool ok = true;
+  char line[256];
+  mstr_t text = MSTR_INIT;
+  metrics_hist_t hist;
+  metrics_t *m = &ctx->clnt->serv->metrics;
+
+#define emit(...)                                                             \
+  ok = ok && (n = snprintf (line, sizeof (line), __VA_ARGS__)) > 0           \
+       && (size_t) n < sizeof (line) && mstr_cat_byte (&text, line, n)
+#define counter(name, help)                                                   \
+  emit ("# HELP " name " " help "\n# TYPE " name " counter\n")
+
+  /* shards are summed as they are, the workers never wait on a scrape */
+  counter ("httpd_requests_total", "Requests routed.");
+  emit ("httpd_requests_total %lu\n", metrics_counter (m, METRIC_REQUESTS));
+
+  counter ("httpd_not_found_total", "Answers with 404.");
+  emit ("httpd_not_found_total %lu\n", metrics_counter (m, METRIC_NOT_FOUND));
+
+  counter ("httpd_server_errors_total", "Answers with a 5xx status.");
+  emit ("httpd_server_errors_total %lu\n",
+	metrics_counter (m, METRIC_SERVER_ERRORS));
+
+  counter ("httpd_cache_hits_total", "Lookups answered from a cache.");
+  emit ("httpd_cache_hits_total{cache=\"micro\"} %lu\n",
+	metrics_counter (m, METRIC_MCACHE_HITS));
+  emit ("httpd_cache_hits_total{cache=\"gzip\"} %lu\n",
+	metrics_counter (m, METRIC_GZIP_HITS));
+
+  counter ("httpd_cache_misses_total", "Lookups that had to fetch.");
+  emit ("httpd_cache_misses_total{cache=\"micro\"} %lu\n",
+	metrics_counter (m, METRIC_MCACHE_MISSES));
+  emit ("httpd_cache_misses_total{cache=\"gzip\"} %lu\n",
+	metrics_counter (m, METRIC_GZIP_MISSES));
+
+  counter ("httpd_log_dropped_total", "Access log records lost to full rings.");
+  emit ("httpd_log_dropped_total %lu\n",
+	__atomic_load_n (&ctx->clnt->serv->log.dropped, __ATOMIC_RELAXED));
+
+  counter ("httpd_errors_total", "Requests dropped by an error code.");
+  for (int i = 0; i < HTTPD_ERR_NUM; i++)
+    if (metric_errors[i])
+      emit ("httpd_errors_total{error=\"%s\"} %lu\n", metric_errors[i],
+	    metrics_counter (m, METRIC_ERRORS + i));
+
+  for (int i = 0; i < METRIC_HISTS; i++)
+    {
+      const char *name = metric_hists[i][0];
+      uint64_t total = 0;
+
+      metrics_merge (m, i, &hist);
+      emit ("# HELP %s %s\n# TYPE %s histogram\n", name, metric_hists[i][1],
+	    name);
+
+      /* every power of two from a microsecond on is a bucket edge */
+      for (size_t b = 0; b < METRICS_BUCKETS; b++)
+	{
+	  uint64_t bound = metrics_bound (b);
+	  total += hist.buckets[b];
+	  if (bound >= 1024 && !(bound & (bound - 1)))
+	    emit ("%s_bucket{le=\"%.9g\"} %lu\n", name, bound / 1e9, total);
+	}
+
+      emit ("%s_bucket{le=\"+Inf\"} %lu\n", name, total);
+      emit ("%s_sum %.9g\n", name, hist.sum / 1e9);
+      emit ("%s_count %lu\n", name, total);
+    }
+
+#undef counter
+#undef emit
+
+  if (ok)
+    context_reply (ctx, HTTPD_STATUS_OK, "text/plain; version=0.0.4",
+		   mstr_data (&text), mstr_len (&text));
+  mstr_free (&text);
+}
+
+static void
+serve_ws (client_t *clnt)
+{
+  websocket_t *ws = clnt->ws;
+
+  for (int i = 0;; i++)
+    {
+      int ret;
+      ssize_t n;
+
+      /* frames pushed from other threads join the output here */
+      int closing = websocket_collect (ws);
+      if (closing == -1 || (ret = client_flush (clnt)) == RESPONSE_ERROR)
+	break;
+
+      /* park until writable, or yield to other connections */
+      if (ret == RESPONSE_AGAIN || i == PIPELINE_MAX)
+	{
+	  if (websocket_park (clnt, EPOLLOUT) == 0)
+	    return;
+	  break;
+	}
+
+      if (closing)
+	break;
+
+      if (!clnt->in && !(clnt->in = malloc (WS_RECV_SIZE + 1)))
+	break;
+
+      size_t room = WS_RECV_SIZE - clnt->in_len;
+      if ((n = client_read (clnt, clnt->in + clnt->in_len, room)) > 0)
+	{
+	  clnt->in_len += n;
+	  if (!websocket_recv (clnt))
+	    break;
+	  continue;
+	}
+
+      if (n == 0 || errno != EAGAIN)
+	break;
+
+      /* idle sockets hold no buffers while parked */
+      if (!clnt->in_len)
+	{
+	  free (clnt->in);
+	  clnt->in = NULL;
+	}
+
+      response_free (&clnt->out);
+      clnt->out = RESPONSE_INIT;
+
+      if ((ret = websocket_park (clnt, EPOLLIN)) == 0)
+	return;
+      if (ret == -1)
+	break;
+    }
+
+  websocket_end (clnt);
+}
+
+static void
+serve_h2 (client_t *clnt)
+{
+  h2_t *h2 = clnt->h2;
+  response_t *out = &clnt->out;
+
+  for (int i = 0;; i++)
+    {
+      ssize_t n;
+      int ret = client_flush (clnt);
+
+      /* park until writable, or yield to other connections */
+      if (ret == RESPONSE_AGAIN || (ret == RESPONSE_DONE && i == PIPELINE_MAX))
+	{
+	  if (client_wait (clnt, EPOLLOUT) == 0)
+	    return;
+	  break;
+	}
+
+      if (ret == RESPONSE_ERROR || h2_done (h2))
+	break;
+
+      size_t room = H2_RECV_SIZE - clnt->in_len;
+      if ((n = client_read (clnt, clnt->in + clnt->in_len, room)) > 0)
+	clnt->in_len += n;
+      else if (n == 0 || errno != EAGAIN)
+	break;
+
+      /* whole frames only, streams answer from the handler */
+      clnt->in[clnt->in_len] = '\0';
+      client_consume (clnt, h2_recv (h2, clnt->in, clnt->in_len));
+      h2_pump (h2, SEND_QUOTA);
+
+      if (n > 0 || response_pending (out))
+	continue;
+
+      /* wait for frames, or credit for blocked streams */
+      if (client_wait (clnt, EPOLLIN) == 0)
+	return;
+      break;
+    }
+
+  client_free (clnt);
+}
+
+static void
+serve_stream (void *arg, h2_stream_t *st, const hpack_field_t *fields,
+	      size_t cnt)
+{
+  int ret;
+  client_t *clnt = arg;
+  uint64_t start = metrics_now ();
+  context_t ctx = { .clnt = clnt, .stream = st, .log = { 0, -1, start } };
+
+  if ((ret = request_init_h2 (&ctx.req, fields, cnt)) != 0)
+    {
+      metric_count (clnt->serv, METRIC_ERRORS + ret);
+      return h2_reset (clnt->h2, st, H2_PROTOCOL_ERROR);
+    }
+
+  metric_since (clnt->serv, METRIC_PARSE, start);
+  probe (request, clnt->sock, request_method_name (ctx.req.method),
+	 mstr_data (&ctx.req.uri), mstr_len (&ctx.req.uri), 0);
+
+  serve_route (&ctx);
+  access_log (&ctx);
+  context_free (&ctx);
+}
+
+static void
+serve_upgrade (context_t *ctx, header_t *settings)
+{
+  client_t *clnt = ctx->clnt;
+  response_t *out = &clnt->out;
+  response_mark_t mark = response_mark (out);
+  static const struct iovec msg = IOV ("HTTP/1.1 101 Switching Protocols\r\n"
+				       "Connection: Upgrade\r\n"
+				       "Upgrade: h2c\r\n\r\n");
+
+  /* the request itself is answered on stream 1 */
+  if (response_add_ref (out, msg.iov_base, msg.iov_len)
+      && client_upgrade (clnt) == 0)
+    {
+      const char *data = mstr_data (&settings->value);
+      if ((ctx->stream = h2_upgrade (clnt->h2, data, mstr_len (&settings->value))))
+	{
+	  ctx->req.proto = 2;
+	  serve_route (ctx);
+	  return h2_settle (clnt->h2, ctx->stream);
+	}
+
+      h2_free (clnt->h2);
+      free (clnt->h2);
+      clnt->h2 = NULL;
+    }
+
+  /* the upgrade is optional, carry on with HTTP/1.1 */
+  response_rewind (out, mark);
+  serve_route (ctx);
+}
+
+static header_t *
+upgrade_h2c (context_t *ctx)
+{
+  header_t *hdr;
+
+  if (ctx->req.proto != 0)
+    return NULL;
+
+  if (!(hdr = header_get (&ctx->req.headers, "Upgrade"))
+      || !strcasestr (mstr_data (&hdr->value), "h2c"))
+    return NULL;
+
+  return header_get (&ctx->req.headers, "HTTP2-Settings");
+}
+
+static bool
+upstream_request (context_t *ctx, mstr_t *head)
+{
+  char line[64], addr[INET_ADDRSTRLEN];
+  request_t *req = &ctx->req;
+  client_t *clnt = ctx->clnt;
+
+  /* fields that only describe this hop, or that we frame ourselves */
+  static const char *skip[]
+      = { "Connection", "Keep-Alive", "Proxy-Connection", "TE",
+	  "Trailer",    "Upgrade",    "Transfer-Encoding", "Content-Length",
+	  "Expect",     "HTTP2-Settings", "X-Forwarded-For", "X-Forwarded-Proto" };
+
+#define cat(data, len) mstr_cat_byte (head, data, len)
+#define cat_str(str) cat (str, strlen (str))
+#define cat_mstr(str) cat (mstr_data (str), mstr_len (str))
+
+  bool ok = cat_str (methods[req->method]) && cat (" ", 1)
+	    && cat_mstr (&req->uri) && cat_str (" HTTP/1.1\r\n");
+
+  rbtree_node_t *node = rbtree_first (&req->headers);
+  for (; ok && node; node = rbtree_next (node))
+    {
+      header_t *hdr = container_of (node, header_t, node);
+
+      bool hop = false;
+      for (size_t i = 0; i < sizeof (skip) / sizeof (*skip) && !hop; i++)
+	hop = mstr_icmp_cstr (&hdr->field, skip[i]) == 0;
+
+      if (!hop)
+	ok = cat_mstr (&hdr->field) && cat (": ", 2) && cat_mstr (&hdr->value)
+	     && cat ("\r\n", 2);
+    }
+
+  /* the body is re-framed for the upstream */
+  int n = 0;
+  if (ctx->stream || ctx->payload.type == PAYLOAD_NONE)
+    ;
+  else if (ctx->payload.type == PAYLOAD_LENGTH)
+    n = snprintf (line, sizeof (line), "Content-Length: %zu\r\n",
+		  ctx->payload.remain);
+  else
+    n = snprintf (line, sizeof (line), "Transfer-Encoding: chunked\r\n");
+
+  /* one hop of forwarding, earlier ones are not trusted */
+  inet_ntop (AF_INET, &clnt->addr.sin_addr, addr, sizeof (addr));
+
+  ok = ok && cat (line, n) && cat_str ("X-Forwarded-For: ") && cat_str (addr)
+       && cat_str (clnt->tls ? "\r\nX-Forwarded-Proto: https\r\n"
+			    : "\r\nX-Forwarded-Proto: http\r\n")
+       && cat ("\r\n", 2);
+
+#undef cat_mstr
+#undef cat_str
+#undef cat
+
+  return ok;
+}
+
+static bool
+upstream_body (context_t *ctx, proxy_conn_t *up)
+{
+  ssize_t n;
+  char buf[16 << 10], line[24];
+
+  if (ctx->stream || ctx->payload.done)
+    return true;
+
+  /* plain sockets move a sized body without copying it */
+  if (ctx->payload.type == PAYLOAD_LENGTH)
+    return context_splice (ctx, up->sock) != -1;
+
+  while ((n = context_read (ctx, buf, sizeof (buf))) > 0)
+    {
+      int len = snprintf (line, sizeof (line), "%zx\r\n", n);
+      if (!proxy_send (up, line, len) || !proxy_send (up, buf, n)
+	  || !proxy_send (up, "\r\n", 2))
+	return false;
+    }
+
+  return n == 0 && proxy_send (up, "0\r\n\r\n", 5);
+}
+
+static bool
+cache_key (context_t *ctx)
+{
+  header_t *hdr;
+  request_t *req = &ctx->req;
+  mstr_t *key = &ctx->cache.key;
+
+  /* only plain reads without credentials are shared */
+  if (req->method != HTTPD_METHOD_GET
+      || header_get (&req->headers, "Authorization")
+      || header_get (&req->headers, "Upgrade")
+      || !(ctx->stream ? ctx->stream->remote_end : ctx->payload.done))
+    return false;
+
+#define cat(data, len) mstr_cat_byte (key, data, len)
+#define cat_mstr(str) cat (mstr_data (str), mstr_len (str))
+
+  /* method, host and uri, then each field the cache may vary on */
+  bool ok = cat ("GET\n", 4);
+  if ((hdr = header_get (&req->headers, "Host")))
+    ok = ok && cat_mstr (&hdr->value);
+  ok = ok && cat ("\n", 1) && cat_mstr (&req->uri);
+
+  for (int i = 0; ok && i < cache_vary_size; i++)
+    {
+      ok = cat ("\n", 1);
+      if ((hdr = header_get (&req->headers, cache_vary[i])))
+	ok = ok && cat_mstr (&hdr->value);
+    }
+
+#undef cat_mstr
+#undef cat
+
+  return ok;
+}
+
+static bool
+cache_vary_ok (const char *value, size_t len)
+{
+  const char *pos = value, *end = value + len;
+
+  /* every field named must be part of the key */
+  while (pos < end)
+    {
+      const char *stop = memchr (pos, ',', end - pos) ?: end;
+      const char *tok = pos;
+      pos = stop + 1;
+
+      while (tok < stop && (*tok == ' ' || *tok == '\t'))
+	tok++;
+      while (stop > tok && (stop[-1] == ' ' || stop[-1] == '\t'))
+	stop--;
+      if (tok == stop)
+	continue;
+
+      bool known = false;
+      for (int i = 0; i < cache_vary_size && !known; i++)
+	known = strlen (cache_vary[i]) == (size_t) (stop - tok)
+		&& strncasecmp (cache_vary[i], tok, stop - tok) == 0;
+
+      if (!known)
+	return false;
+    }
+
+  return true;
+}
+
+static bool
+cache_serve (context_t *ctx)
+{
+  resource_blob_t *blob;
+  server_t *serv = ctx->clnt->serv;
+
+  /* a refresh already owns its key */
+  if (!(serv->flags & SERVER_MICROCACHE) || ctx->cache.state != MCACHE_MISS
+      || !cache_key (ctx))
+    return false;
+
+  const char *key = mstr_data (&ctx->cache.key);
+  size_t len = mstr_len (&ctx->cache.key);
+
+  uint64_t start = metrics_now ();
+  ctx->cache.state = mcache_get (&serv->mcache, key, len, &blob);
+  metric_since (serv, METRIC_LOOKUP, start);
+
+  bool hit = ctx->cache.state != MCACHE_MISS
+	     && ctx->cache.state != MCACHE_FILL;
+  metric_count (serv, hit ? METRIC_MCACHE_HITS : METRIC_MCACHE_MISSES);
+
+  switch (ctx->cache.state)
+    {
+    case MCACHE_MISS:
+    case MCACHE_FILL:
+      return false;
+
+    case MCACHE_REFRESH:
+      cache_revalidate (ctx);
+      break;
+
+    default:
+      ctx->cache.state = MCACHE_MISS;
+    }
+
+  cache_reply (ctx, blob);
+  return true;
+}
+
+static void
+cache_put (context_t *ctx, resource_blob_t *blob, int max_age, int stale)
+{
+  mcache_t *mc = &ctx->clnt->serv->mcache;
+  const char *key = mstr_data (&ctx->cache.key);
+
+  mcache_put (mc, key, mstr_len (&ctx->cache.key), blob, max_age, stale);
+  ctx->cache.state = MCACHE_MISS;
+}
+
+static void
+cache_abandon (context_t *ctx)
+{
+  /* waiters on the key are released either way */
+  if (ctx->cache.state != MCACHE_MISS)
+    cache_put (ctx, NULL, 0, 0);
+}
+
+static void
+cache_handler (context_t *ctx, const char *type, const void *body, size_t len)
+{
+  char head[512];
+  int max_age, stale, n;
+  resource_blob_t *blob;
+  const char *control = ctx->control;
+  mstr_t *key = &ctx->cache.key;
+
+  if (!control || len > MICROCACHE_ITEM_MAX
+      || !mcache_policy (control, strlen (control), &max_age, &stale))
+    return;
+
+  n = snprintf (head, sizeof (head),
+		"server: httpd\r\ncontent-type: %s\r\ncache-control: %s\r\n",
+		type, control);
+  if (n < 0 || (size_t) n >= sizeof (head))
+    return;
+
+  if (!(blob = mcache_new (mstr_data (key), mstr_len (key), n, len)))
+    return;
+
+  mcache_entry_t *e = mcache_entry (blob);
+  memcpy (mcache_head (e), head, n);
+  memcpy (mcache_body (e), body, len);
+
+  cache_put (ctx, blob, max_age, stale);
+  respool_blob_put (blob);
+}
+
+static bool
+cache_upstream (context_t *ctx, proxy_conn_t *up)
+{
+  resource_blob_t *blob;
+  size_t head_len = 0, len;
+  int max_age = 0, stale = 0;
+  bool shared = false;
+  mstr_t *key = &ctx->cache.key;
+
+  if (up->status != 200 || up->length > MICROCACHE_ITEM_MAX
+      || (up->body != PROXY_BODY_NONE && up->body != PROXY_BODY_LENGTH))
+    return false;
+
+#define is(str)                                                               \
+  (f->name_len == sizeof (str) - 1 && memcmp (f->name, str, f->name_len) == 0)
+
+  /* names arrive lowercased, the dates are ours to set on a hit */
+  for (size_t i = 0; i < up->cnt; i++)
+    {
+      proxy_field_t *f = &up->fields[i];
+
+      if (is ("set-cookie")
+	  || (is ("vary") && !cache_vary_ok (f->value, f->value_len)))
+	return false;
+
+      if (is ("cache-control"))
+	shared = mcache_policy (f->value, f->value_len, &max_age, &stale);
+
+      if (!is ("date") && !is ("age"))
+	head_len += f->name_len + f->value_len + 4;
+    }
+
+  if (!shared)
+    return false;
+
+  len = up->length == -1 ? 0 : up->length;
+  if (!(blob = mcache_new (mstr_data (key), mstr_len (key), head_len, len)))
+    return false;
+
+  mcache_entry_t *e = mcache_entry (blob);
+  char *pos = mcache_head (e), *body = mcache_body (e);
+
+  for (size_t i = 0; i < up->cnt; i++)
+    {
+      proxy_field_t *f = &up->fields[i];
+      if (is ("date") || is ("age"))
+	continue;
+
+      pos = mempcpy (pos, f->name, f->name_len);
+      pos = mempcpy (pos, ": ", 2);
+      pos = mempcpy (pos, f->value, f->value_len);
+      pos = mempcpy (pos, "\r\n", 2);
+    }
+
+#undef is
+
+  /* the body is taken whole, the connection goes back before we answer */
+  size_t off = 0;
+  for (ssize_t n; off < len; off += n)
+    if ((n = proxy_read (up, body + off, len - off)) <= 0)
+      break;
+
+  proxy_close (up);
+
+  if (off < len)
+    {
+      respool_blob_put (blob);
+      serve_status (ctx, errno == ETIMEDOUT ? HTTPD_STATUS_GATEWAY_TIMEOUT
+					     : HTTPD_STATUS_BAD_GATEWAY);
+      return true;
+    }
+
+  cache_put (ctx, blob, max_age, stale);
+  cache_reply (ctx, blob);
+  return true;
+}
+
+static void
+cache_reply (context_t *ctx, resource_blob_t *blob)
+{
+  mcache_entry_t *e = mcache_entry (blob);
+  response_mark_t mark = response_mark (&ctx->clnt->out);
+  size_t off = mcache_body (e) - blob->data;
+
+  ctx->replied = true;
+  if (!header_cached (ctx, blob))
+    {
+      respool_blob_put (blob);
+      return serve_abort (ctx, mark);
+    }
+
+  if (!e->body_len)
+    return respool_blob_put (blob);
+
+  if (!body_blob (ctx, blob, off, e->body_len))
+    serve_abort (ctx, mark);
+}
+
+static void
+cache_revalidate (context_t *ctx)
 {
-  const header_t *ha = container_of (a, header_t, node);
-  const header_t *hb = container_of (b, header_t, node);
-  return mstr_icmp_mstr (&ha->field, &hb->field);
+  refresh_t *job;
+  server_t *serv = ctx->clnt->serv;
+
+  /* the stale copy answers now, another worker fetches the next one */
+  if (!(job = malloc (sizeof (refresh_t))))
+    return cache_abandon (ctx);
+
+  job->serv = serv;
+  job->addr = ctx->clnt->addr;
+  if (!request_copy (&job->req, &ctx->req))
+    {
+      free (job);
+      return cache_abandon (ctx);
+    }
+
+  if (threadpool_post (&serv->tpool, cache_refresh, job) != 0)
+    {
+      request_free (&job->req);
+      free (job);
+      return cache_abandon (ctx);
+    }
+
+  ctx->cache.state = MCACHE_MISS;
 }
 
 static void
-serve (void *arg)
+cache_refresh (void *arg)
 {
-  context_t ctx;
-  if (context_init (&ctx, arg) != 0)
-    goto clean_arg;
+  refresh_t *job = arg;
+  client_t clnt = { .sock = -1, .serv = job->serv, .addr = job->addr };
+  context_t ctx = { .req = job->req, .clnt = &clnt };
 
-  serve_file (&ctx);
-  context_free (&ctx);
+  /* answered into a response nobody reads, only the capture counts */
+  ctx.req.proto = 0;
+  ctx.payload.done = true;
+  ctx.cache.state = MCACHE_REFRESH;
+
+  if (cache_key (&ctx))
+    cache_fetch (&ctx);
+  cache_abandon (&ctx);
 
-clean_arg:
-  client_free (arg);
+  response_free (&clnt.out);
+  context_free (&ctx);
+  free (job);
 }
 
+/* only what can fill the entry runs, a refresh is no request of its client:
+   no limits, no request counts */
 static void
-serve_file (context_t *ctx)
+cache_fetch (context_t *ctx)
 {
   resource_t *res;
+  server_t *serv = ctx->clnt->serv;
 
-  if (!(res = resource_get (ctx)))
-    return serve_not_found (ctx);
+  if (serve_match (ctx) == ROUTER_FOUND)
+    return ((server_handler_t *) ctx->match.handler) (ctx, &ctx->req);
 
-  /* init response header */
-  static __thread char header[MAX_RESHEAD_LEN];
-  int size = header_init (header, sizeof (header), 200, "OK", res);
+  /* a file that showed up meanwhile is served before the cache anyway */
+  if ((res = resource_get (ctx)))
+    return respool_put (res);
 
-  if (size <= 0)
-    return;
+  if (serv->proxy.len)
+    serve_proxy (ctx);
+}
+
+static void
+access_log (context_t *ctx)
+{
+  accesslog_record_t rec;
+  server_t *serv = ctx->clnt->serv;
+  size_t len = mstr_len (&ctx->req.uri);
 
-  /* send header */
-  if (!send_data (ctx, header, size))
+  /* start is CLOCK_MONOTONIC, what bpftrace calls nsecs */
+  probe (response_end, ctx->clnt->sock, mstr_data (&ctx->req.uri),
+	 ctx->log.status, ctx->log.size, ctx->log.start);
+
+  if (!serv->log.path)
     return;
 
-  /* send file */
-  send_file (ctx, res);
+  /* fixed size, the writer thread does the formatting */
+  clock_gettime (CLOCK_REALTIME, &rec.time);
+  rec.method = request_method_name (ctx->req.method);
+  rec.proto = protos[ctx->req.proto];
+  rec.addr = ctx->clnt->addr.sin_addr.s_addr;
+  rec.status = ctx->log.status;
+  rec.usec = (metrics_now () - ctx->log.start) / 1000;
+  rec.size = ctx->log.size;
+  rec.uri_len = len < ACCESSLOG_URI ? len : ACCESSLOG_URI;
+  memcpy (rec.uri, mstr_data (&ctx->req.uri), rec.uri_len);
+
+  accesslog_push (&serv->log, &rec);
 }
 
-static void
-serve_not_found (context_t *ctx)
+static bool
+keep_alive (context_t *ctx)
+{
+  header_t *hdr;
+
+  /* HTTP/1.1 connections persist by default */
+  bool keep = ctx->req.proto == 0;
+
+  if (!(hdr = header_get (&ctx->req.headers, "Connection")))
+    return keep;
+
+  const char *value = mstr_data (&hdr->value);
+  if (strcasestr (value, "close"))
+    return false;
+  if (strcasestr (value, "keep-alive"))
+    return true;
+
+  return keep;
+}
+
+static int
+accept_encoding (context_t *ctx)
 {
-  static const char *res = "HTTP/1.1 404 NOT FOUND\r\n"
-			   "Server: httpd\r\n"
-			   "Content-Type: text/html\r\n"
-			   "Content-Length: 13\r\n\r\n"
-			   "404 NOT FOUND";
-  send_data (ctx, res, 99);
+  header_t *hdr;
+  int accept = 0, deny = 0;
+
+  if (!(hdr = header_get (&ctx->req.headers, "Accept-Encoding")))
+    return 0;
+
+  const char *pos = mstr_data (&hdr->value);
+  const char *end = pos + mstr_len (&hdr->value);
+
+  for (const char *next; pos < end; pos = next + 1)
+    {
+      if (!(next = memchr (pos, ',', end - pos)))
+	next = end;
+
+      pos += strspn (pos, " \t");
+      size_t len = strcspn (pos, " \t;,");
+
+      /* q=0 means not acceptable */
+      bool zero = false;
+      const char *q = pos + len;
+      if ((q = memchr (q, ';', next - q)))
+	{
+	  q += strspn (q + 1, " \t") + 1;
+	  if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=')
+	    zero = strspn (q + 2, "0.") == strcspn (q + 2, " \t,");
+	}
+
+      int mask = 0;
+      if (len == 1 && pos[0] == '*')
+	mask = (1 << RESOURCE_ENC_NUM) - 1;
+      else
+	for (int i = 0; i < RESOURCE_ENC_NUM; i++)
+	  if (strncasecmp (pos, resource_encodings[i][1], len) == 0
+	      && resource_encodings[i][1][len] == '\0')
+	    mask = 1 << i;
+
+      if (zero)
+	deny |= mask;
+      else
+	accept |= mask;
+    }
+
+  return accept & ~deny;
 }
 
 static resource_t *
@@ -478,36 +3241,681 @@ resource_get (context_t *ctx)
   return respool_get (&serv->rpool, path);
 }
 
-static inline bool
-send_file (context_t *ctx, resource_t *res)
+static void
+gzip_close (void *arg)
 {
-  off_t off = 0;
-  size_t size = res->size;
-  int out = ctx->clnt->sock, in = res->fd;
-  return size ? sendfile (out, in, &off, size) != -1 : true;
+  gzip_stream_t *zip = arg;
+
+  gzip_free (&zip->zip);
+  respool_put (zip->res);
+  free (zip);
+}
+
+static ssize_t
+gzip_pull (void *arg, void *dst, size_t max)
+{
+  gzip_stream_t *zip = arg;
+  return gzip_read (&zip->zip, dst, max);
+}
+
+static bool
+gzip_eligible (server_t *serv, resource_t *res)
+{
+  if (!(serv->flags & SERVER_GZIP) || res->size < GZIP_MIN)
+    return false;
+
+  return res->mime && res->mime->compressible;
+}
+
+static resource_blob_t *
+gzip_blob (server_t *serv, resource_t *res)
+{
+  gzip_t zip;
+  ssize_t size;
+  resource_blob_t *blob;
+
+  /* compressed once per version */
+  if ((blob = respool_blob_get (&serv->rpool, res)))
+    {
+      metric_count (serv, METRIC_GZIP_HITS);
+      return blob;
+    }
+
+  metric_count (serv, METRIC_GZIP_MISSES);
+
+  size_t cap = gzip_bound (res->size);
+  if (!(blob = respool_blob_new (cap)))
+    return NULL;
+
+  if (gzip_init (&zip, res->fd, res->size, GZIP_LEVEL) != Z_OK)
+    goto clean_blob;
+
+  size = gzip_read (&zip, blob->data, cap);
+  gzip_free (&zip);
+
+  if (size < 0 || !zip.done)
+    goto clean_blob;
+
+  blob->size = size;
+  return respool_blob_set (&serv->rpool, res, blob);
+
+clean_blob:
+  respool_blob_put (blob);
+  return NULL;
+}
+
+static struct iovec
+date_field (void)
+{
+  static __thread int len;
+  static __thread time_t last;
+  static __thread char field[64];
+
+  static const char days[][4]
+      = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+  static const char months[][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+				    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+  /* reformatted at most once per second per worker */
+  time_t now = time (NULL);
+  if (now != last)
+    {
+      struct tm tm;
+      gmtime_r (&now, &tm);
+      len = snprintf (field, sizeof (field),
+		      "Date: %s, %02d %s %d %02d:%02d:%02d GMT\r\n",
+		      days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon],
+		      tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+      last = now;
+    }
+
+  return (struct iovec) { field, len };
+}
+
+static struct iovec
+length_field (size_t size)
+{
+  static const char prefix[] = "Content-Length: ";
+  static __thread char field[sizeof (prefix) + 24] = "Content-Length: ";
+
+  char digits[24], *pos = digits + sizeof (digits);
+  *--pos = '\n';
+  *--pos = '\r';
+  do
+    *--pos = '0' + size % 10;
+  while (size /= 10);
+
+  size_t len = digits + sizeof (digits) - pos;
+  memcpy (field + sizeof (prefix) - 1, pos, len);
+  return (struct iovec) { field, sizeof (prefix) - 1 + len };
+}
+
+static bool
+header_init (context_t *ctx, int status, struct iovec type, ssize_t size,
+	     int enc, bool vary)
+{
+  response_t *out = &ctx->clnt->out;
+
+  context_head (ctx, status_codes[status], size);
+
+  if (ctx->stream)
+    return header_init_h2 (ctx, status, type, size, enc, vary);
+
+#define add_ref(iov) response_add_ref (out, (iov).iov_base, (iov).iov_len)
+#define add_copy(iov) response_add_copy (out, (iov).iov_base, (iov).iov_len)
+
+  bool ok = add_ref (tpl_status[status]) && add_ref (tpl_server);
+
+  /* per-worker and handler buffers are copied, the response outlives them */
+  ok = ok && add_copy (date_field ()) && add_copy (type);
+  ok = ok && header_frame (ctx, size);
+
+  /* a handler that shares its answer says so downstream too */
+  if (ctx->control && status == HTTPD_STATUS_OK)
+    ok = ok && add_ref (tpl_control)
+	 && response_add_copy (out, ctx->control, strlen (ctx->control))
+	 && add_ref (tpl_end);
+
+  if (enc != -1)
+    ok = ok && add_ref (tpl_encoding[enc]);
+
+  if (vary)
+    ok = ok && add_ref (tpl_vary);
+
+  return ok && header_end (ctx);
+}
+
+static bool
+header_frame (context_t *ctx, ssize_t size)
+{
+  response_t *out = &ctx->clnt->out;
+
+  if (size != -1)
+    return add_copy (length_field (size));
+
+  /* HTTP/1.0 has no chunks, the body ends with the connection */
+  if (ctx->req.proto == 1)
+    {
+      ctx->clnt->close = true;
+      return true;
+    }
+
+  return add_ref (tpl_chunked);
+}
+
+static bool
+header_end (context_t *ctx)
+{
+  bool ok = true;
+  client_t *clnt = ctx->clnt;
+  response_t *out = &clnt->out;
+
+  /* input left unread cannot be told apart from the next request */
+  if (!ctx->payload.done)
+    clnt->close = true;
+
+  if (clnt->close && ctx->req.proto == 0)
+    ok = add_ref (tpl_close);
+  else if (!clnt->close && ctx->req.proto == 1)
+    ok = add_ref (tpl_keep);
+
+  return ok && add_ref (tpl_end);
+}
+
+static bool
+header_upstream (context_t *ctx, proxy_conn_t *up)
+{
+  char line[32];
+  response_t *out = &ctx->clnt->out;
+  static const struct iovec sep = IOV (": ");
+
+  context_head (ctx, up->status, up->length);
+
+  if (ctx->stream)
+    return header_upstream_h2 (ctx, up);
+
+  /* the upstream's own fields pass through, framing is ours */
+  int n = snprintf (line, sizeof (line), "HTTP/1.1 %03d ", up->status);
+  bool ok = response_add_copy (out, line, n)
+	    && response_add_copy (out, up->reason, up->reason_len)
+	    && add_ref (tpl_end);
+
+  for (size_t i = 0; ok && i < up->cnt; i++)
+    {
+      proxy_field_t *f = &up->fields[i];
+      ok = response_add_copy (out, f->name, f->name_len) && add_ref (sep)
+	   && response_add_copy (out, f->value, f->value_len)
+	   && add_ref (tpl_end);
+    }
+
+  /* bodiless answers only repeat a length they were given */
+  if (up->body != PROXY_BODY_NONE || up->length != -1)
+    ok = ok && header_frame (ctx, up->length);
+
+  return ok && header_end (ctx);
+}
+
+static bool
+header_cached (context_t *ctx, resource_blob_t *blob)
+{
+  char line[32];
+  response_t *out = &ctx->clnt->out;
+  mcache_entry_t *e = mcache_entry (blob);
+
+  time_t age = time (NULL) - e->date;
+  int n = snprintf (line, sizeof (line), "Age: %lld\r\n",
+		    (long long) (age > 0 ? age : 0));
+
+  context_head (ctx, 200, e->body_len);
+
+  if (ctx->stream)
+    return header_cached_h2 (ctx, e, (struct iovec) { line, n });
+
+  /* the stored fields go out straight from the entry */
+  size_t off = mcache_head (e) - blob->data;
+  bool ok = add_ref (tpl_status[HTTPD_STATUS_OK]) && add_copy (date_field ())
+	    && response_add_copy (out, line, n)
+	    && response_add_blob (out, respool_blob_hold (blob), off,
+				  e->head_len);
+
+  return ok && header_frame (ctx, e->body_len) && header_end (ctx);
+}
+
+#undef add_copy
+#undef add_ref
+
+static inline hpack_field_t
+field_of (const char *name, struct iovec line)
+{
+  /* the value of a serialized "Name: value\r\n" line */
+  const char *value = memchr (line.iov_base, ':', line.iov_len) + 2;
+  size_t len = (const char *) line.iov_base + line.iov_len - 2 - value;
+
+  return (hpack_field_t) { name, strlen (name), value, len };
+}
+
+static bool
+header_init_h2 (context_t *ctx, int status, struct iovec type, ssize_t size,
+		int enc, bool vary)
+{
+  size_t cnt = 0;
+  hpack_field_t fields[8];
+
+  /* HTTP/2 wants lowercase names and no connection fields */
+  fields[cnt++] = field_of ("server", tpl_server);
+  fields[cnt++] = field_of ("date", date_field ());
+  fields[cnt++] = field_of ("content-type", type);
+
+  if (size != -1)
+    fields[cnt++] = field_of ("content-length", length_field (size));
+
+  if (enc != -1)
+    fields[cnt++] = field_of ("content-encoding", tpl_encoding[enc]);
+
+  if (vary)
+    fields[cnt++] = field_of ("vary", tpl_vary);
+
+  if (ctx->control && status == HTTPD_STATUS_OK)
+    fields[cnt++] = (hpack_field_t) { "cache-control", 13, ctx->control,
+				      strlen (ctx->control) };
+
+  h2_t *h2 = ctx->clnt->h2;
+  return h2_respond (h2, ctx->stream, status_codes[status], fields, cnt, false);
+}
+
+static bool
+header_upstream_h2 (context_t *ctx, proxy_conn_t *up)
+{
+  size_t cnt = 0;
+  hpack_field_t fields[PROXY_FIELDS + 1];
+
+  /* names arrive lowercased, hop-by-hop fields already dropped */
+  for (size_t i = 0; i < up->cnt; i++)
+    {
+      proxy_field_t *f = &up->fields[i];
+      fields[cnt++] = (hpack_field_t) { f->name, f->name_len, f->value,
+					f->value_len };
+    }
+
+  if (up->length != -1)
+    fields[cnt++] = field_of ("content-length", length_field (up->length));
+
+  h2_t *h2 = ctx->clnt->h2;
+  return h2_respond (h2, ctx->stream, up->status, fields, cnt, up->done);
+}
+
+static bool
+header_cached_h2 (context_t *ctx, mcache_entry_t *e, struct iovec age)
+{
+  size_t cnt = 0;
+  hpack_field_t fields[PROXY_FIELDS + 3];
+  const char *pos = mcache_head (e), *end = pos + e->head_len;
+
+  fields[cnt++] = field_of ("date", date_field ());
+  fields[cnt++] = field_of ("age", age);
+  fields[cnt++] = field_of ("content-length", length_field (e->body_len));
+
+  /* stored as "name: value\r\n" lines with lowercase names */
+  while (pos < end && cnt < sizeof (fields) / sizeof (*fields))
+    {
+      const char *sep = memchr (pos, ':', end - pos);
+      const char *eol = memchr (sep, '\r', end - sep);
+      fields[cnt++] = (hpack_field_t) { pos, sep - pos, sep + 2,
+					eol - sep - 2 };
+      pos = eol + 2;
+    }
+
+  h2_t *h2 = ctx->clnt->h2;
+  return h2_respond (h2, ctx->stream, status_codes[HTTPD_STATUS_OK], fields,
+		     cnt, !e->body_len);
+}
+
+static bool
+body_ref (context_t *ctx, const void *data, size_t len)
+{
+  if (ctx->stream)
+    return h2_send_ref (ctx->clnt->h2, ctx->stream, data, len);
+
+  return response_add_ref (&ctx->clnt->out, data, len);
+}
+
+static bool
+body_copy (context_t *ctx, const void *data, size_t len)
+{
+  resource_blob_t *blob;
+
+  if (!ctx->stream)
+    return response_add_copy (&ctx->clnt->out, data, len);
+
+  /* frames are cut later, keep the bytes alive until then */
+  if (!len)
+    return true;
+
+  if (!(blob = respool_blob_new (len)))
+    return false;
+
+  memcpy (blob->data, data, len);
+  blob->size = len;
+  return body_blob (ctx, blob, 0, len);
+}
+
+static bool
+body_blob (context_t *ctx, resource_blob_t *blob, size_t off, size_t len)
+{
+  if (ctx->stream)
+    return h2_send_blob (ctx->clnt->h2, ctx->stream, blob, off, len);
+
+  return response_add_blob (&ctx->clnt->out, blob, off, len);
 }
 
-static inline bool
-send_data (context_t *ctx, const void *data, size_t size)
+static bool
+body_file (context_t *ctx, resource_t *res, int fd, size_t len)
+{
+  if (ctx->stream)
+    return h2_send_file (ctx->clnt->h2, ctx->stream, res, fd, 0, len);
+
+  return response_add_file (&ctx->clnt->out, res, fd, 0, len);
+}
+
+static bool
+body_stream (context_t *ctx, response_read_t *read, response_close_t *close,
+	     void *arg)
 {
-  return size ? send (ctx->clnt->sock, data, size, 0) != -1 : true;
+  if (ctx->stream)
+    return h2_send_stream (ctx->clnt->h2, ctx->stream, read, close, arg);
+
+  bool chunked = ctx->req.proto != 1;
+  return response_add_stream (&ctx->clnt->out, read, close, arg, chunked);
 }
 
 static int
-header_init (char *dst, int max, int code, const char *msg, resource_t *res)
+payload_init (context_t *ctx)
 {
-  const char *mime;
-  size_t size = res->size;
+  header_t *te, *cl, *expect;
+  rbtree_t *headers = &ctx->req.headers;
+
+  ctx->payload.type = PAYLOAD_NONE;
+  ctx->payload.state = CHUNK_SIZE;
+  ctx->payload.done = true;
+  ctx->payload.expect = false;
+  ctx->payload.remain = ctx->payload.total = 0;
+
+  te = header_get (headers, "Transfer-Encoding");
+  cl = header_get (headers, "Content-Length");
+
+  if (te)
+    {
+      if (strcasecmp (mstr_data (&te->value), "chunked") != 0)
+	return HTTPD_STATUS_NOT_IMPLEMENTED;
+
+      /* a length next to chunked framing may have been smuggled */
+      if (cl)
+	ctx->clnt->close = true;
+
+      ctx->payload.type = PAYLOAD_CHUNKED;
+    }
+  else if (cl)
+    {
+      size_t len = 0;
+      const char *pos = mstr_data (&cl->value);
 
-  if (!(mime = mime_of (mstr_data (&res->path))))
-    mime = "text/plain";
+      if (!*pos || pos[strspn (pos, "0123456789")])
+	return HTTPD_STATUS_BAD_REQUEST;
+
+      for (; *pos; pos++)
+	if ((len = len * 10 + (*pos - '0')) > BODY_MAX)
+	  return HTTPD_STATUS_PAYLOAD_TOO_LARGE;
+
+      if (!len)
+	return HTTPD_STATUS_OK;
+
+      ctx->payload.type = PAYLOAD_LENGTH;
+      ctx->payload.remain = len;
+    }
+  else
+    return HTTPD_STATUS_OK;
+
+  ctx->payload.done = false;
+  ctx->payload.by = metrics_now () + BODY_TIMEOUT * 1000000ull;
+
+  /* answered lazily, once the handler asks for bytes not yet sent */
+  expect = header_get (headers, "Expect");
+  if (expect && ctx->req.proto == 0
+      && strcasecmp (mstr_data (&expect->value), "100-continue") == 0)
+    ctx->payload.expect = true;
+
+  return HTTPD_STATUS_OK;
+}
+
+static void
+payload_skip (context_t *ctx)
+{
+  char buf[512];
+
+  /* only what already arrived, an unread body ends the connection */
+  while (!ctx->payload.done && payload_pull (ctx, buf, sizeof (buf), false) > 0)
+    ;
+
+  if (!ctx->payload.done)
+    ctx->clnt->close = true;
+}
+
+/* the whole body shares one deadline, only bytes move it on */
+static bool
+payload_wait (context_t *ctx)
+{
+  int ret = 0;
+  uint64_t now;
+  client_t *clnt = ctx->clnt;
+  struct pollfd pfd = { .fd = clnt->sock, .events = POLLIN };
+
+  /* the client holds the body back until told to go on */
+  if (ctx->payload.expect)
+    {
+      ctx->payload.expect = false;
+      if (!ctx->replied
+	  && (!response_add_ref (&clnt->out, tpl_continue.iov_base,
+				 tpl_continue.iov_len)
+	      || !client_push (clnt, ctx->payload.by)))
+	return false;
+    }
+
+  if ((now = metrics_now ()) < ctx->payload.by)
+    ret = poll (&pfd, 1, (ctx->payload.by - now) / 1000000 + 1);
+
+  if (ret == 0)
+    errno = ETIMEDOUT;
+
+  return ret > 0;
+}
+
+/* BODY_MIN_RATE buys time byte by byte, never more than BODY_TIMEOUT ahead,
+   so a trickle runs out however long the body is */
+static void
+payload_credit (context_t *ctx, size_t n)
+{
+  uint64_t now = metrics_now ();
+  uint64_t max = now + BODY_TIMEOUT * 1000000ull;
+  uint64_t by = ctx->payload.by + n * (1000000000ull / BODY_MIN_RATE);
+
+  ctx->payload.by = by < max ? by : max;
+}
+
+static int
+payload_chunk (context_t *ctx)
+{
+  char *line, *eol, *pos;
+  client_t *clnt = ctx->clnt;
+  size_t size = 0;
+
+  /* framing lines are handled whole, 0 asks for more input */
+  line = ctx->pos;
+  if (!(eol = memchr (line, '\n', clnt->in + clnt->in_len - line)))
+    return 0;
+
+  ctx->pos = eol + 1;
+  if (eol > line && eol[-1] == '\r')
+    eol--;
+
+  switch (ctx->payload.state)
+    {
+    case CHUNK_TAIL:
+      ctx->payload.state = CHUNK_SIZE;
+      if (eol == line)
+	return 1;
+      break;
+
+    case CHUNK_SIZE:
+      for (pos = line; isxdigit ((unsigned char) *pos); pos++)
+	{
+	  if (size > (BODY_MAX - ctx->payload.total) >> 4)
+	    {
+	      errno = EFBIG;
+	      return -1;
+	    }
+	  int digit = *pos <= '9' ? *pos - '0' : (*pos | 32) - 'a' + 10;
+	  size = size << 4 | digit;
+	}
+
+      /* extensions after ';' are ignored */
+      if (pos == line || (pos < eol && !strchr ("; \t", *pos)))
+	break;
+
+      if (size > BODY_MAX - ctx->payload.total)
+	{
+	  errno = EFBIG;
+	  return -1;
+	}
+
+      ctx->payload.remain = size;
+      ctx->payload.state = size ? CHUNK_TAIL : CHUNK_TRAILER;
+      return 1;
+
+    case CHUNK_TRAILER:
+      /* trailer fields are dropped */
+      if (eol == line)
+	ctx->payload.done = true;
+      return 1;
+    }
+
+  errno = EPROTO;
+  return -1;
+}
+
+static ssize_t
+payload_pull (context_t *ctx, void *buf, size_t len, bool wait)
+{
+  ssize_t n;
+  client_t *clnt = ctx->clnt;
+
+  while (!ctx->payload.done)
+    {
+      size_t avail = clnt->in + clnt->in_len - ctx->pos;
+      size_t remain = ctx->payload.remain;
+
+      if (ctx->payload.type == PAYLOAD_CHUNKED && !remain)
+	{
+	  if ((n = payload_chunk (ctx)) == -1)
+	    return -1;
+	  if (n)
+	    continue;
+
+	  /* make room behind the unread part and read more */
+	  client_consume (clnt, ctx->pos - clnt->in);
+	  ctx->pos = clnt->in;
+
+	  size_t room = MAX_REQHEAD_LEN - clnt->in_len;
+	  if (!room)
+	    {
+	      errno = EPROTO;
+	      return -1;
+	    }
+
+	  if ((n = payload_recv (ctx, clnt->in + clnt->in_len, room, wait))
+	      == -1)
+	    return -1;
+
+	  clnt->in_len += n;
+	  clnt->in[clnt->in_len] = '\0';
+	  continue;
+	}
+
+      if (len > remain)
+	len = remain;
+
+      /* buffered bytes first, then straight from the socket */
+      if (avail)
+	{
+	  n = avail < len ? avail : len;
+	  memcpy (buf, ctx->pos, n);
+	  ctx->pos += n;
+	}
+      else if ((n = payload_recv (ctx, buf, len, wait)) == -1)
+	return -1;
+
+      ctx->payload.remain -= n;
+      ctx->payload.total += n;
+
+      if (ctx->payload.type == PAYLOAD_LENGTH && !ctx->payload.remain)
+	ctx->payload.done = true;
+
+      return n;
+    }
+
+  return 0;
+}
+
+static ssize_t
+payload_recv (context_t *ctx, void *buf, size_t len, bool wait)
+{
+  for (ssize_t n;;)
+    {
+      if ((n = client_read (ctx->clnt, buf, len)) > 0)
+	{
+	  payload_credit (ctx, n);
+	  return n;
+	}
+
+      if (n == 0)
+	{
+	  errno = ECONNRESET;
+	  return -1;
+	}
+
+      if (errno != EAGAIN || !wait || !payload_wait (ctx))
+	return -1;
+    }
+}
+
+static ssize_t
+payload_splice (context_t *ctx, int pipefd[2], int fd)
+{
+  ssize_t n;
+  size_t len = ctx->payload.remain;
+  int sock = ctx->clnt->sock;
+
+  if (len > SEND_CHUNK)
+    len = SEND_CHUNK;
+
+  /* socket to pipe to file, the bytes never enter userspace */
+  while ((n = splice (sock, NULL, pipefd[1], NULL, len,
+		      SPLICE_F_MOVE | SPLICE_F_NONBLOCK))
+	 <= 0)
+    {
+      if (n == 0)
+	errno = ECONNRESET;
+
+      if (n == 0 || errno != EAGAIN || !payload_wait (ctx))
+	return -1;
+    }
 
-  static const char *format = "HTTP/1.1 %d %s"
-			      "\r\n"
-			      "Server: httpd\r\n"
-			      "Content-Type: %s\r\n"
-			      "Content-Length: %lu\r\n"
-			      "\r\n";
+  payload_credit (ctx, n);
+  for (ssize_t w, left = n; left; left -= w)
+    if ((w = splice (pipefd[0], NULL, fd, NULL, left, SPLICE_F_MOVE)) <= 0)
+      return -1;
 
-  return snprintf (dst, max, format, code, msg, mime, size);
+  ctx->payload.remain -= n;
+  ctx->payload.total += n;
+  ctx->payload.done = !ctx->payload.remain;
+  return n;
 }
@@ -1,25 +1,56 @@
 #ifndef HTTPD_H
 #define HTTPD_H
 
+#include "accesslog.h"
 #include "arena.h"
+#include "limit.h"
+#include "mcache.h"
+#include "metrics.h"
 #include "mstr.h"
+#include "proxy.h"
+#include "rbtree.h"
 #include "respool.h"
+#include "response.h"
+#include "router.h"
+#include "stats.h"
 #include "threadpool.h"
+#include "tls.h"
+#include "wheel.h"
+#include "ws.h"
 
 #include <netinet/in.h>
 #include <sys/socket.h>
 
 #define SERVER_REUSEADDR 1
 #define SERVER_NONBLOCK 2
+#define SERVER_GZIP 4
+#define SERVER_CORK 8
+#define SERVER_NODELAY 16
+#define SERVER_KTLS 32
+#define SERVER_MICROCACHE 64
+#define SERVER_METRICS 128
+#define SERVER_LOG_BLOCK 256
+#define SERVER_STATS 512
+#define SERVER_LIMIT 1024
 
 enum
 {
   HTTPD_OK,
 
   HTTPD_ERR_SERVER_INIT_ROOT,
+  HTTPD_ERR_SERVER_INIT_MIME,
   HTTPD_ERR_SERVER_INIT_SOCK,
+  HTTPD_ERR_SERVER_INIT_TLS,
   HTTPD_ERR_SERVER_INIT_BIND,
+  HTTPD_ERR_SERVER_INIT_EPOLL,
   HTTPD_ERR_SERVER_INIT_RPOOL,
+  HTTPD_ERR_SERVER_INIT_ROUTER,
+  HTTPD_ERR_SERVER_INIT_PROXY,
+  HTTPD_ERR_SERVER_INIT_MCACHE,
+  HTTPD_ERR_SERVER_INIT_METRICS,
+  HTTPD_ERR_SERVER_INIT_LOG,
+  HTTPD_ERR_SERVER_INIT_STATS,
+  HTTPD_ERR_SERVER_INIT_LIMIT,
   HTTPD_ERR_SERVER_INIT_TPOOL,
   HTTPD_ERR_SERVER_INIT_LISTEN,
   HTTPD_ERR_SERVER_INIT_REUSEADDR,
@@ -38,6 +69,8 @@ enum
   HTTPD_ERR_RESOURCE_IHIT_404,
   HTTPD_ERR_RESOURCE_IHIT_PATH,
   HTTPD_ERR_RESOURCE_IHIT_DATA,
+
+  HTTPD_ERR_NUM,
 };
 
 enum
@@ -53,22 +86,78 @@ enum
   HTTPD_METHOD_EXTENSION,
 };
 
+enum
+{
+  HTTPD_STATUS_OK,
+  HTTPD_STATUS_CREATED,
+  HTTPD_STATUS_BAD_REQUEST,
+  HTTPD_STATUS_NOT_FOUND,
+  HTTPD_STATUS_METHOD_NOT_ALLOWED,
+  HTTPD_STATUS_PAYLOAD_TOO_LARGE,
+  HTTPD_STATUS_TOO_MANY_REQUESTS,
+  HTTPD_STATUS_INTERNAL_ERROR,
+  HTTPD_STATUS_NOT_IMPLEMENTED,
+  HTTPD_STATUS_BAD_GATEWAY,
+  HTTPD_STATUS_GATEWAY_TIMEOUT,
+};
+
 typedef struct sockaddr sockaddr_t;
 typedef struct sockaddr_in sockaddr4_t;
 typedef struct sockaddr_in6 sockaddr6_t;
 
 typedef struct server_t server_t;
+typedef struct request_t request_t;
+typedef struct context_t context_t;
+typedef struct websocket_t websocket_t;
 typedef struct server_config_t server_config_t;
 
+/* runs on a worker, answers through the context before returning */
+typedef void server_handler_t (context_t *ctx, const request_t *req);
+
+/* once per complete message, then WS_CLOSE without data when it ends */
+typedef void websocket_handler_t (websocket_t *ws, int opcode,
+				  const void *data, size_t len, void *arg);
+
 struct server_t
 {
   int sock;
+  int epfd;
+  int flags;
   mstr_t root;
   uint16_t port;
   arena_t mpool;
+  mime_registry_t mime;
   respool_t rpool;
   sockaddr4_t addr;
   threadpool_t tpool;
+  tls_t tls;
+  router_t router;
+  proxy_t proxy;
+  mcache_t mcache;
+  metrics_t metrics;
+  accesslog_t log;
+  stats_t stats;
+  limit_t limit;
+
+  struct
+  {
+    void *list;
+    pthread_mutex_t lock;
+  } graveyard;
+
+  struct
+  {
+    wheel_t wheel;
+    pthread_mutex_t lock;
+  } timers;
+};
+
+struct request_t
+{
+  int proto;
+  int method;
+  mstr_t uri;
+  rbtree_t headers;
 };
 
 struct server_config_t
@@ -78,6 +167,18 @@ struct server_config_t
   uint16_t port;
   size_t threads;
   const char *root;
+  const char *mime;
+  const char *cert;
+  const char *key;
+  const char *upstream;
+  const char *log;
+  const char *stats;
+  int limit_conns;
+  int limit_rate;
+  int limit_burst;
+  int connect_timeout;
+  int upstream_timeout;
+  size_t cache;
 };
 
 extern void server_free (server_t *serv);
@@ -86,4 +187,37 @@ extern void server_poll (server_t *serv);
 
 extern int server_init (server_t *serv, const server_config_t *conf);
 
+extern int server_register (server_t *serv, int method, const char *pattern,
+			    server_handler_t *handler);
+
+extern const char *context_header (context_t *ctx, const char *field);
+
+extern const char *context_param (context_t *ctx, const char *name,
+				  size_t *len);
+
+extern ssize_t context_read (context_t *ctx, void *buf, size_t len);
+
+extern ssize_t context_splice (context_t *ctx, int fd);
+
+extern bool context_reply (context_t *ctx, int status, const char *type,
+			   const void *body, size_t len);
+
+extern void context_cache (context_t *ctx, const char *control);
+
+extern bool context_stream (context_t *ctx, int status, const char *type,
+			    response_read_t *read, response_close_t *close,
+			    void *arg);
+
+extern websocket_t *context_websocket (context_t *ctx,
+				       websocket_handler_t *handler, void *arg);
+
+extern websocket_t *websocket_hold (websocket_t *ws);
+
+extern void websocket_put (websocket_t *ws);
+
+extern bool websocket_send (websocket_t *ws, int opcode, const void *data,
+			    size_t len);
+
+extern void websocket_close (websocket_t *ws, int code);
+
 #endif
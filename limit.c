@@ -0,0 +1,141 @@
+#include "limit.h"
+
+#include <stdlib.h>
+
+static limit_entry_t *find (limit_t *l, limit_shard_t **shard, uint32_t addr,
+			    uint64_t now);
+
+int
+limit_init (limit_t *l, size_t size, unsigned conns, unsigned rate,
+	    unsigned burst)
+{
+  int i;
+
+  *l = (limit_t) {
+    .conns = conns,
+    .interval = rate ? 1000000000 / rate : 0,
+  };
+
+  l->burst = l->interval * (burst ?: 1);
+  if (!(l->sets = size / (LIMIT_SHARDS * LIMIT_WAYS)))
+    l->sets = 1;
+
+  for (i = 0; i < LIMIT_SHARDS; i++)
+    {
+      limit_shard_t *s = &l->shards[i];
+      if (!(s->entries = calloc (l->sets * LIMIT_WAYS, sizeof (limit_entry_t))))
+	goto clean;
+      pthread_mutex_init (&s->lock, NULL);
+    }
+
+  return 0;
+
+clean:
+  while (i--)
+    {
+      free (l->shards[i].entries);
+      pthread_mutex_destroy (&l->shards[i].lock);
+    }
+  return -1;
+}
+
+void
+limit_free (limit_t *l)
+{
+  for (int i = 0; i < LIMIT_SHARDS; i++)
+    {
+      free (l->shards[i].entries);
+      pthread_mutex_destroy (&l->shards[i].lock);
+    }
+}
+
+bool
+limit_open (limit_t *l, uint32_t addr, uint64_t now, bool *held)
+{
+  bool ok = true;
+  limit_shard_t *s;
+  limit_entry_t *e;
+
+  *held = false;
+  if (!l->conns)
+    return true;
+
+  if ((e = find (l, &s, addr, now)))
+    {
+      if ((ok = e->conns < l->conns))
+	{
+	  e->conns++;
+	  *held = true;
+	}
+    }
+
+  pthread_mutex_unlock (&s->lock);
+  return ok;
+}
+
+void
+limit_close (limit_t *l, uint32_t addr)
+{
+  limit_shard_t *s;
+  limit_entry_t *e;
+
+  /* held entries are never reused, now does not matter */
+  if ((e = find (l, &s, addr, 0)) && e->conns)
+    e->conns--;
+
+  pthread_mutex_unlock (&s->lock);
+}
+
+bool
+limit_take (limit_t *l, uint32_t addr, uint64_t now)
+{
+  bool ok = true;
+  limit_shard_t *s;
+  limit_entry_t *e;
+
+  if (!l->interval)
+    return true;
+
+  /* the bucket holds burst tokens, one comes back every interval */
+  if ((e = find (l, &s, addr, now)))
+    {
+      uint64_t full = (e->full > now ? e->full : now) + l->interval;
+      if ((ok = full - now <= l->burst))
+	e->full = full;
+    }
+
+  pthread_mutex_unlock (&s->lock);
+  return ok;
+}
+
+/* returns with the shard locked, NULL when the set is taken by others */
+static limit_entry_t *
+find (limit_t *l, limit_shard_t **shard, uint32_t addr, uint64_t now)
+{
+  limit_entry_t *e, *spare = NULL;
+  uint64_t hash = addr * 0x9e3779b97f4a7c15ull;
+
+  limit_shard_t *s = *shard = &l->shards[hash >> 60];
+  e = &s->entries[(hash >> 16) % l->sets * LIMIT_WAYS];
+
+  pthread_mutex_lock (&s->lock);
+
+  for (int i = 0; i < LIMIT_WAYS; i++, e++)
+    {
+      if (e->addr == addr)
+	return e;
+
+      /* an idle one with a full bucket is as good as new */
+      if (!spare && !e->conns && e->full <= now)
+	spare = e;
+    }
+
+  if (!spare)
+    {
+      __atomic_fetch_add (&l->overflow, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+
+  *spare = (limit_entry_t) { .addr = addr };
+  return spare;
+}
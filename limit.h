@@ -0,0 +1,63 @@
+#ifndef LIMIT_H
+#define LIMIT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* an address hashes to one set of LIMIT_WAYS entries in one shard */
+#define LIMIT_SHARDS 16
+#define LIMIT_WAYS 8
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+typedef struct limit_t limit_t;
+typedef struct limit_shard_t limit_shard_t;
+typedef struct limit_entry_t limit_entry_t;
+
+/* the bucket is kept as the time it is full again (GCRA), an entry with no
+   connections and a full bucket holds nothing worth keeping */
+struct limit_entry_t
+{
+  uint32_t addr;
+  uint32_t conns;
+  uint64_t full;
+};
+
+struct limit_shard_t
+{
+  pthread_mutex_t lock;
+  limit_entry_t *entries;
+} __attribute__ ((aligned (64)));
+
+struct limit_t
+{
+  size_t sets;
+  uint32_t conns;
+  uint64_t interval;
+  uint64_t burst;
+  limit_shard_t shards[LIMIT_SHARDS];
+
+  /* addresses let through because their set was full */
+  size_t overflow;
+};
+
+/* size entries at most, conns per address, rate requests a second with
+   bursts of burst; zero turns a limit off */
+extern int limit_init (limit_t *l, size_t size, unsigned conns,
+		       unsigned rate, unsigned burst) attr_nonnull (1);
+
+extern void limit_free (limit_t *l) attr_nonnull (1);
+
+/* false when addr is at its cap, a true one is paired with limit_close */
+extern bool limit_open (limit_t *l, uint32_t addr, uint64_t now, bool *held)
+    attr_nonnull (1, 4);
+
+extern void limit_close (limit_t *l, uint32_t addr) attr_nonnull (1);
+
+/* takes a token, now is in nanoseconds */
+extern bool limit_take (limit_t *l, uint32_t addr, uint64_t now)
+    attr_nonnull (1);
+
+#endif
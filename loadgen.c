@@ -0,0 +1,933 @@
+#include "httpd.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#define PIPELINE_MAX 64
+#define BACKLOG_MAX (1 << 16)
+#define URLS_MAX 32
+#define IN_SIZE (64 << 10)
+#define OUT_SIZE (16 << 10)
+#define MAX_EVENTS 64
+
+/* log-linear like the server's, but 128 buckets per power of two */
+#define HIST_SUB_BITS 7
+#define HIST_BUCKETS (40 << HIST_SUB_BITS)
+
+enum
+{
+  PHASE_WARMUP,
+  PHASE_MEASURE,
+  PHASE_STOP,
+};
+
+typedef struct url_t url_t;
+typedef struct hist_t hist_t;
+typedef struct conn_t conn_t;
+typedef struct worker_t worker_t;
+
+struct url_t
+{
+  const char *path;
+  unsigned weight;
+  size_t len;
+  char req[512];
+};
+
+struct hist_t
+{
+  uint64_t count;
+  uint64_t max;
+  uint64_t buckets[HIST_BUCKETS];
+};
+
+struct conn_t
+{
+  int fd;
+  bool closing;
+  worker_t *w;
+
+  /* intended send times of the requests in flight, oldest first */
+  size_t head;
+  size_t inflight;
+  uint64_t sent[PIPELINE_MAX];
+
+  size_t skip;
+  size_t in_len;
+  char in[IN_SIZE];
+
+  size_t out_off;
+  size_t out_len;
+  char out[OUT_SIZE];
+};
+
+struct worker_t
+{
+  pthread_t tid;
+  int epfd;
+  int tfd;
+  uint64_t rng;
+
+  size_t cnt;
+  size_t next;
+  conn_t *conns;
+
+  /* open loop, requests fall due every interval whatever the server does */
+  uint64_t interval;
+  uint64_t due;
+  size_t queued;
+  size_t queue_head;
+  uint64_t *queue;
+
+  /* closed loop, the warmup mean stands in for the intended interval */
+  uint64_t expect;
+  uint64_t warm_sum;
+  uint64_t warm_cnt;
+
+  uint64_t done;
+  uint64_t errors;
+  uint64_t non2xx;
+  uint64_t bytes;
+  hist_t hist;
+};
+
+static struct
+{
+  size_t conns;
+  size_t threads;
+  size_t server_threads;
+  double duration;
+  double warmup;
+  double rate;
+  size_t pipeline;
+  bool close;
+  bool json;
+  const char *name;
+  uint16_t port;
+  sockaddr4_t addr;
+
+  size_t urls_cnt;
+  unsigned weights;
+  url_t urls[URLS_MAX];
+} opt = {
+  .conns = 64,
+  .threads = 2,
+  .duration = 10,
+  .warmup = 2,
+  .pipeline = 1,
+  .name = "loopback",
+  .port = 18080,
+};
+
+static int phase;
+static uint64_t measure_from;
+
+static const char *mix_default = "/index.html:8,/app.js:3,/image.bin:1";
+
+static void hist_add (hist_t *h, uint64_t v);
+static void hist_record (hist_t *h, uint64_t v, uint64_t expect);
+static void hist_merge (hist_t *dst, const hist_t *src);
+static uint64_t hist_quantile (const hist_t *h, double q);
+
+static int conn_open (conn_t *c);
+static void conn_reopen (conn_t *c);
+static void conn_send (conn_t *c, uint64_t intended);
+static void conn_next (conn_t *c);
+static int conn_flush (conn_t *c);
+static int conn_recv (conn_t *c);
+static int conn_parse (conn_t *c);
+static void conn_done (conn_t *c, int status);
+
+static void *worker_run (void *arg);
+static void worker_tick (worker_t *w);
+static conn_t *worker_idle (worker_t *w);
+
+static int mix_parse (const char *mix);
+static char *docroot_make (void);
+static void docroot_free (char *dir);
+static void *server_run (void *arg);
+
+static void usage (const char *prog);
+static void report (worker_t *ws, double secs);
+
+int
+main (int argc, char **argv)
+{
+  int c;
+  char *dir = NULL;
+  const char *mix = mix_default, *target = NULL;
+
+  while ((c = getopt (argc, argv, "c:t:s:d:w:r:p:u:a:P:n:kjh")) != -1)
+    switch (c)
+      {
+      case 'c':
+	opt.conns = strtoul (optarg, NULL, 10);
+	break;
+      case 't':
+	opt.threads = strtoul (optarg, NULL, 10);
+	break;
+      case 's':
+	opt.server_threads = strtoul (optarg, NULL, 10);
+	break;
+      case 'd':
+	opt.duration = strtod (optarg, NULL);
+	break;
+      case 'w':
+	opt.warmup = strtod (optarg, NULL);
+	break;
+      case 'r':
+	opt.rate = strtod (optarg, NULL);
+	break;
+      case 'p':
+	opt.pipeline = strtoul (optarg, NULL, 10);
+	break;
+      case 'u':
+	mix = optarg;
+	break;
+      case 'a':
+	target = optarg;
+	break;
+      case 'P':
+	opt.port = strtoul (optarg, NULL, 10);
+	break;
+      case 'n':
+	opt.name = optarg;
+	break;
+      case 'k':
+	opt.close = true;
+	break;
+      case 'j':
+	opt.json = true;
+	break;
+      default:
+	usage (argv[0]);
+      }
+
+  if (!opt.conns || !opt.threads || opt.duration <= 0 || !opt.pipeline
+      || opt.pipeline > PIPELINE_MAX)
+    usage (argv[0]);
+
+  /* a fresh connection per request carries one at a time */
+  if (opt.close)
+    opt.pipeline = 1;
+
+  if (opt.threads > opt.conns)
+    opt.threads = opt.conns;
+
+  if (mix_parse (mix) != 0)
+    error ("bad url mix: %s", mix);
+
+  struct sigaction act = { .sa_handler = SIG_IGN };
+  if (sigaction (SIGPIPE, &act, NULL) != 0)
+    abort ();
+
+  opt.addr = (sockaddr4_t) { .sin_family = AF_INET };
+
+  /* the server under test, run in process on a generated docroot */
+  if (!target)
+    {
+      pthread_t tid;
+      static server_t serv;
+
+      if (!(dir = docroot_make ()))
+	error ("cannot generate docroot");
+
+      server_config_t conf = {
+	.port = opt.port,
+	.root = dir,
+	.threads = opt.server_threads,
+      };
+
+      int ret;
+      if ((ret = server_init (&serv, &conf)) != 0)
+	error ("server_init failed: %d", ret);
+
+      if (pthread_create (&tid, NULL, server_run, &serv) != 0)
+	error ("cannot start server");
+
+      opt.addr.sin_port = htons (opt.port);
+      opt.addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    }
+  else
+    {
+      char host[64];
+      const char *colon = strrchr (target, ':');
+      size_t len = colon ? (size_t) (colon - target) : strlen (target);
+
+      if (len >= sizeof (host))
+	error ("bad address: %s", target);
+      memcpy (host, target, len);
+      host[len] = '\0';
+
+      opt.addr.sin_port = htons (colon ? atoi (colon + 1) : 80);
+      if (inet_pton (AF_INET, host, &opt.addr.sin_addr) != 1)
+	error ("bad address: %s", target);
+    }
+
+  worker_t *ws = calloc (opt.threads, sizeof (worker_t));
+  if (!ws)
+    error ("out of memory");
+
+  for (size_t i = 0; i < opt.threads; i++)
+    {
+      worker_t *w = &ws[i];
+      w->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+      w->cnt = opt.conns / opt.threads + (i < opt.conns % opt.threads);
+
+      if (opt.rate > 0)
+	{
+	  w->interval = 1e9 * opt.threads / opt.rate;
+	  if (!(w->queue = malloc (BACKLOG_MAX * sizeof (uint64_t))))
+	    error ("out of memory");
+	}
+
+      if (!(w->conns = calloc (w->cnt, sizeof (conn_t))))
+	error ("out of memory");
+
+      if ((w->epfd = epoll_create1 (EPOLL_CLOEXEC)) == -1)
+	error ("epoll_create1: %s", strerror (errno));
+
+      for (size_t j = 0; j < w->cnt; j++)
+	{
+	  w->conns[j].w = w;
+	  if (conn_open (&w->conns[j]) != 0)
+	    error ("connect: %s", strerror (errno));
+	}
+    }
+
+  for (size_t i = 0; i < opt.threads; i++)
+    if (pthread_create (&ws[i].tid, NULL, worker_run, &ws[i]) != 0)
+      error ("cannot start worker");
+
+  struct timespec ts;
+  ts.tv_sec = opt.warmup;
+  ts.tv_nsec = (opt.warmup - ts.tv_sec) * 1e9;
+  nanosleep (&ts, NULL);
+
+  /* only requests meant to start from here on are counted */
+  __atomic_store_n (&measure_from, metrics_now (), __ATOMIC_RELAXED);
+  __atomic_store_n (&phase, PHASE_MEASURE, __ATOMIC_RELEASE);
+
+  ts.tv_sec = opt.duration;
+  ts.tv_nsec = (opt.duration - ts.tv_sec) * 1e9;
+  nanosleep (&ts, NULL);
+
+  uint64_t end = metrics_now ();
+  __atomic_store_n (&phase, PHASE_STOP, __ATOMIC_RELEASE);
+
+  for (size_t i = 0; i < opt.threads; i++)
+    pthread_join (ws[i].tid, NULL);
+
+  report (ws, (end - measure_from) / 1e9);
+
+  /* the server never returns from polling, the process ends under it */
+  if (dir)
+    docroot_free (dir);
+
+  return 0;
+}
+
+static void
+usage (const char *prog)
+{
+  error ("Usage: %s [-c conns] [-t threads] [-s server threads] "
+	 "[-d secs] [-w warmup secs] [-r rate] [-p pipeline] [-k] "
+	 "[-u path[:weight],...] [-a host:port] [-P port] [-n name] [-j]",
+	 prog);
+}
+
+static inline void
+hist_add (hist_t *h, uint64_t v)
+{
+  size_t b = v;
+
+  if (v >= 2 << HIST_SUB_BITS)
+    {
+      int shift = 63 - __builtin_clzll (v) - HIST_SUB_BITS;
+      b = ((size_t) shift << HIST_SUB_BITS) + (v >> shift);
+    }
+
+  h->buckets[b < HIST_BUCKETS ? b : HIST_BUCKETS - 1]++;
+  h->count++;
+  if (v > h->max)
+    h->max = v;
+}
+
+static void
+hist_record (hist_t *h, uint64_t v, uint64_t expect)
+{
+  hist_add (h, v);
+
+  /* a stalled sender missed the requests it would have made meanwhile */
+  if (expect)
+    for (uint64_t miss = v - expect; v > expect && miss >= expect;
+	 miss -= expect)
+      hist_add (h, miss);
+}
+
+static void
+hist_merge (hist_t *dst, const hist_t *src)
+{
+  for (size_t i = 0; i < HIST_BUCKETS; i++)
+    dst->buckets[i] += src->buckets[i];
+
+  dst->count += src->count;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+static uint64_t
+hist_quantile (const hist_t *h, double q)
+{
+  uint64_t seen = 0, rank = q * h->count;
+
+  if (rank >= h->count)
+    return h->max;
+
+  for (size_t b = 0; b < HIST_BUCKETS; b++)
+    if ((seen += h->buckets[b]) > rank)
+      {
+	if (b < 2 << HIST_SUB_BITS)
+	  return b;
+
+	/* the top of the bucket, never above what was seen */
+	int shift = (b >> HIST_SUB_BITS) - 1;
+	uint64_t sub = b - ((size_t) shift << HIST_SUB_BITS);
+	uint64_t top = ((sub + 1) << shift) - 1;
+	return top < h->max ? top : h->max;
+      }
+
+  return h->max;
+}
+
+static int
+conn_open (conn_t *c)
+{
+  int one = 1;
+  int fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (fd == -1)
+    return -1;
+
+  /* loopback connects at once, only the traffic is nonblocking */
+  if (connect (fd, (void *) &opt.addr, sizeof (opt.addr)) != 0
+      || setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one)) != 0
+      || fcntl (fd, F_SETFL, O_NONBLOCK) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+  if (epoll_ctl (c->w->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  c->fd = fd;
+  c->head = c->inflight = c->skip = 0;
+  c->in_len = c->out_off = c->out_len = 0;
+  c->closing = false;
+  return 0;
+}
+
+static void
+conn_reopen (conn_t *c)
+{
+  worker_t *w = c->w;
+
+  /* whatever was in flight is lost with the connection */
+  w->errors += c->inflight;
+  close (c->fd);
+
+  if (conn_open (c) != 0)
+    {
+      c->fd = -1;
+      return;
+    }
+
+  while (!c->closing && c->inflight < opt.pipeline
+	 && (!w->interval || w->queued))
+    conn_next (c);
+}
+
+static void
+conn_send (conn_t *c, uint64_t intended)
+{
+  worker_t *w = c->w;
+  url_t *u = opt.urls;
+
+  /* weighted pick, xorshift is plenty for a url mix */
+  w->rng ^= w->rng << 13;
+  w->rng ^= w->rng >> 7;
+  w->rng ^= w->rng << 17;
+  for (unsigned r = w->rng % opt.weights; r >= u->weight; u++)
+    r -= u->weight;
+
+  if (c->out_len + u->len > OUT_SIZE)
+    {
+      w->errors++;
+      return;
+    }
+
+  memcpy (c->out + c->out_len, u->req, u->len);
+  c->out_len += u->len;
+  c->sent[(c->head + c->inflight++) % PIPELINE_MAX] = intended;
+
+  /* replaced by the caller, never while its input is being parsed */
+  if (conn_flush (c) != 0)
+    c->closing = true;
+}
+
+static void
+conn_next (conn_t *c)
+{
+  worker_t *w = c->w;
+
+  if (!w->interval)
+    return conn_send (c, metrics_now ());
+
+  /* open loop sends what fell due while we were busy first */
+  if (w->queued)
+    {
+      uint64_t due = w->queue[w->queue_head];
+      w->queue_head = (w->queue_head + 1) % BACKLOG_MAX;
+      w->queued--;
+      conn_send (c, due);
+    }
+}
+
+static int
+conn_flush (conn_t *c)
+{
+  while (c->out_off < c->out_len)
+    {
+      ssize_t n = write (c->fd, c->out + c->out_off, c->out_len - c->out_off);
+
+      if (n > 0)
+	{
+	  c->out_off += n;
+	  continue;
+	}
+
+      if (n == -1 && errno == EINTR)
+	continue;
+
+      if (n == -1 && errno == EAGAIN)
+	{
+	  struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT,
+				    .data.ptr = c };
+	  return epoll_ctl (c->w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	}
+
+      return -1;
+    }
+
+  /* drained, stop asking for writability */
+  bool waiting = c->out_len && c->out_off == c->out_len;
+  c->out_off = c->out_len = 0;
+
+  if (waiting)
+    {
+      struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+      return epoll_ctl (c->w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+
+  return 0;
+}
+
+static int
+conn_recv (conn_t *c)
+{
+  for (;;)
+    {
+      ssize_t n = read (c->fd, c->in + c->in_len, IN_SIZE - c->in_len);
+
+      if (n == -1 && errno == EINTR)
+	continue;
+
+      if (n == -1 && errno == EAGAIN)
+	return 0;
+
+      if (n <= 0)
+	return -1;
+
+      c->w->bytes += n;
+      c->in_len += n;
+
+      if (conn_parse (c) != 0)
+	return -1;
+
+      /* the answer asked for the connection to go */
+      if (c->closing)
+	return -1;
+    }
+}
+
+static int
+conn_parse (conn_t *c)
+{
+  size_t pos = 0;
+
+  while (pos < c->in_len)
+    {
+      /* bodies are counted, never kept */
+      if (c->skip)
+	{
+	  size_t n = c->in_len - pos < c->skip ? c->in_len - pos : c->skip;
+	  pos += n;
+	  if ((c->skip -= n))
+	    break;
+	  continue;
+	}
+
+      char *head = c->in + pos;
+      char *end = memmem (head, c->in_len - pos, "\r\n\r\n", 4);
+      if (!end)
+	{
+	  if (pos == 0 && c->in_len == IN_SIZE)
+	    return -1;
+	  break;
+	}
+
+      if (c->in_len - pos < 12 || strncmp (head, "HTTP/1.", 7) != 0)
+	return -1;
+
+      int status = atoi (head + 9);
+      long length = -1;
+
+      /* only the fields framing needs */
+      for (char *line = memchr (head, '\n', end - head) + 1; line < end;)
+	{
+	  char *eol = memchr (line, '\r', end + 2 - line);
+	  size_t len = eol - line;
+
+	  if (len > 15 && strncasecmp (line, "Content-Length:", 15) == 0)
+	    length = strtol (line + 15, NULL, 10);
+	  else if (len > 11 && strncasecmp (line, "Connection:", 11) == 0
+		   && strncasecmp (line + 12, "close", 5) == 0)
+	    c->closing = true;
+
+	  line = eol + 2;
+	}
+
+      /* chunked and close-delimited bodies are outside what we drive */
+      if (length < 0)
+	return -1;
+
+      pos = end + 4 - c->in;
+      c->skip = length;
+      conn_done (c, status);
+    }
+
+  /* a partial head waits at the front for the rest */
+  memmove (c->in, c->in + pos, c->in_len - pos);
+  c->in_len -= pos;
+  return 0;
+}
+
+static void
+conn_done (conn_t *c, int status)
+{
+  worker_t *w = c->w;
+  uint64_t now = metrics_now ();
+  uint64_t intended = c->sent[c->head];
+  int ph = __atomic_load_n (&phase, __ATOMIC_ACQUIRE);
+
+  c->head = (c->head + 1) % PIPELINE_MAX;
+  c->inflight--;
+
+  if (ph == PHASE_WARMUP)
+    {
+      w->warm_sum += now - intended;
+      w->warm_cnt++;
+    }
+
+  else if (ph == PHASE_MEASURE
+	   && intended >= __atomic_load_n (&measure_from, __ATOMIC_RELAXED))
+    {
+      if (!w->expect && !w->interval && w->warm_cnt)
+	w->expect = w->warm_sum / w->warm_cnt;
+
+      hist_record (&w->hist, now - intended, w->expect);
+      w->done++;
+      if (status < 200 || status > 299)
+	w->non2xx++;
+    }
+
+  if (ph != PHASE_STOP && !c->closing)
+    conn_next (c);
+}
+
+static void *
+worker_run (void *arg)
+{
+  worker_t *w = arg;
+  struct epoll_event evs[MAX_EVENTS];
+
+  if (w->interval)
+    {
+      /* an absolute timer, so the schedule does not drift with the load */
+      if ((w->tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1)
+	error ("timerfd_create: %s", strerror (errno));
+
+      struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+      if (epoll_ctl (w->epfd, EPOLL_CTL_ADD, w->tfd, &ev) != 0)
+	error ("epoll_ctl: %s", strerror (errno));
+
+      w->due = metrics_now ();
+      worker_tick (w);
+    }
+  else
+    for (size_t i = 0; i < w->cnt; i++)
+      {
+	conn_t *c = &w->conns[i];
+	while (!c->closing && c->inflight < opt.pipeline)
+	  conn_next (c);
+	if (c->closing)
+	  conn_reopen (c);
+      }
+
+  while (__atomic_load_n (&phase, __ATOMIC_ACQUIRE) != PHASE_STOP)
+    {
+      int n = epoll_wait (w->epfd, evs, MAX_EVENTS, 100);
+
+      for (int i = 0; i < n; i++)
+	{
+	  conn_t *c = evs[i].data.ptr;
+
+	  if (!c)
+	    {
+	      worker_tick (w);
+	      continue;
+	    }
+
+	  if (c->fd == -1)
+	    continue;
+
+	  if (((evs[i].events & EPOLLOUT) && conn_flush (c) != 0)
+	      || ((evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		  && conn_recv (c) != 0))
+	    conn_reopen (c);
+	}
+    }
+
+  for (size_t i = 0; i < w->cnt; i++)
+    if (w->conns[i].fd != -1)
+      close (w->conns[i].fd);
+
+  if (w->interval)
+    close (w->tfd);
+  close (w->epfd);
+  return NULL;
+}
+
+static void
+worker_tick (worker_t *w)
+{
+  uint64_t expired;
+  uint64_t now = metrics_now ();
+
+  if (read (w->tfd, &expired, sizeof (expired)) == -1 && errno != EAGAIN)
+    w->errors++;
+
+  /* every request that fell due goes out or waits, late is still late */
+  for (; w->due <= now; w->due += w->interval)
+    {
+      conn_t *c = worker_idle (w);
+
+      if (c)
+	{
+	  conn_send (c, w->due);
+	  if (c->closing)
+	    conn_reopen (c);
+	}
+      else if (w->queued < BACKLOG_MAX)
+	w->queue[(w->queue_head + w->queued++) % BACKLOG_MAX] = w->due;
+      else
+	w->errors++;
+    }
+
+  struct itimerspec its = {
+    .it_value = { w->due / 1000000000, w->due % 1000000000 },
+  };
+  timerfd_settime (w->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static conn_t *
+worker_idle (worker_t *w)
+{
+  for (size_t i = 0; i < w->cnt; i++)
+    {
+      conn_t *c = &w->conns[w->next];
+      w->next = (w->next + 1) % w->cnt;
+
+      if (c->fd != -1 && !c->closing && c->inflight < opt.pipeline)
+	return c;
+    }
+
+  return NULL;
+}
+
+static int
+mix_parse (const char *mix)
+{
+  char *copy, *tok, *save;
+
+  if (!(copy = strdup (mix)))
+    return -1;
+
+  for (tok = strtok_r (copy, ",", &save); tok;
+       tok = strtok_r (NULL, ",", &save))
+    {
+      if (opt.urls_cnt == URLS_MAX || *tok != '/')
+	return -1;
+
+      url_t *u = &opt.urls[opt.urls_cnt++];
+      char *colon = strchr (tok, ':');
+
+      u->weight = colon ? strtoul (colon + 1, NULL, 10) : 1;
+      if (colon)
+	*colon = '\0';
+
+      int n = snprintf (u->req, sizeof (u->req),
+			"GET %s HTTP/1.1\r\nHost: loadgen\r\n%s\r\n", tok,
+			opt.close ? "Connection: close\r\n" : "");
+      if (n < 0 || (size_t) n >= sizeof (u->req))
+	return -1;
+
+      u->len = n;
+      u->path = tok;
+      opt.weights += u->weight;
+    }
+
+  /* the paths stay in copy for the report */
+  return opt.weights ? 0 : -1;
+}
+
+static char *
+docroot_make (void)
+{
+  static const struct
+  {
+    const char *name;
+    size_t size;
+  } files[] = {
+    { "index.html", 1 << 10 },
+    { "app.js", 16 << 10 },
+    { "image.bin", 256 << 10 },
+  };
+
+  static char dir[] = "/tmp/httpd-bench.XXXXXX";
+  if (!mkdtemp (dir))
+    return NULL;
+
+  /* the same bytes every run, so runs compare */
+  for (size_t i = 0; i < sizeof (files) / sizeof (*files); i++)
+    {
+      char path[64];
+      snprintf (path, sizeof (path), "%s/%s", dir, files[i].name);
+
+      FILE *fp = fopen (path, "w");
+      if (!fp)
+	return NULL;
+
+      for (size_t j = 0; j < files[i].size; j++)
+	fputc ('a' + (j * 7 + j / 64) % 26, fp);
+
+      if (fclose (fp) != 0)
+	return NULL;
+    }
+
+  return dir;
+}
+
+static void
+docroot_free (char *dir)
+{
+  static const char *names[] = { "index.html", "app.js", "image.bin" };
+
+  for (size_t i = 0; i < sizeof (names) / sizeof (*names); i++)
+    {
+      char path[64];
+      snprintf (path, sizeof (path), "%s/%s", dir, names[i]);
+      unlink (path);
+    }
+
+  rmdir (dir);
+}
+
+static void *
+server_run (void *arg)
+{
+  for (;;)
+    server_poll (arg);
+
+  return NULL;
+}
+
+static void
+report (worker_t *ws, double secs)
+{
+  static hist_t all;
+  uint64_t done = 0, errors = 0, non2xx = 0, bytes = 0;
+
+  for (size_t i = 0; i < opt.threads; i++)
+    {
+      hist_merge (&all, &ws[i].hist);
+      done += ws[i].done;
+      errors += ws[i].errors;
+      non2xx += ws[i].non2xx;
+      bytes += ws[i].bytes;
+    }
+
+  double us[] = {
+    hist_quantile (&all, 0.50) / 1e3,  hist_quantile (&all, 0.90) / 1e3,
+    hist_quantile (&all, 0.99) / 1e3,  hist_quantile (&all, 0.999) / 1e3,
+    all.max / 1e3,
+  };
+
+  if (opt.json)
+    {
+      printf ("{\"name\":\"%s\",\"mode\":\"%s\",\"conns\":%zu,"
+	      "\"pipeline\":%zu,\"keepalive\":%s,\"rate\":%.0f,"
+	      "\"seconds\":%.3f,\"requests\":%lu,\"errors\":%lu,"
+	      "\"non2xx\":%lu,\"rps\":%.1f,\"mbps\":%.2f,"
+	      "\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+	      "\"p999\":%.1f,\"max\":%.1f}}\n",
+	      opt.name, opt.rate > 0 ? "open" : "closed", opt.conns,
+	      opt.pipeline, opt.close ? "false" : "true", opt.rate, secs, done,
+	      errors, non2xx, done / secs, bytes / secs / (1 << 20), us[0],
+	      us[1], us[2], us[3], us[4]);
+      return;
+    }
+
+  printf ("%s: %s loop, %zu conns on %zu threads, pipeline %zu%s\n",
+	  opt.name, opt.rate > 0 ? "open" : "closed", opt.conns, opt.threads,
+	  opt.pipeline, opt.close ? ", no keep-alive" : "");
+  printf ("  %lu requests in %.2fs, %.1f req/s, %.2f MiB/s read\n", done,
+	  secs, done / secs, bytes / secs / (1 << 20));
+  printf ("  %lu errors, %lu non-2xx\n", errors, non2xx);
+  printf ("  latency (us, corrected): p50 %.1f  p90 %.1f  p99 %.1f  "
+	  "p99.9 %.1f  max %.1f\n",
+	  us[0], us[1], us[2], us[3], us[4]);
+}
@@ -0,0 +1,443 @@
+#include "mcache.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+struct mcache_flight_t
+{
+  int refs;
+  bool done;
+  uint64_t hash;
+  pthread_cond_t cond;
+  mcache_flight_t *next;
+  size_t len;
+  char key[];
+};
+
+static uint64_t key_hash (const char *key, size_t len);
+
+static void entry_drop (resource_blob_t *blob);
+static resource_blob_t *entry_find (mcache_t *mc, uint64_t hash,
+				    const char *key, size_t len);
+static resource_blob_t *entry_link (mcache_t *mc, resource_blob_t *blob,
+				    resource_blob_t *old);
+
+static mcache_flight_t *flight_find (mcache_t *mc, uint64_t hash,
+				     const char *key, size_t len);
+static mcache_flight_t *flight_new (mcache_t *mc, uint64_t hash,
+				    const char *key, size_t len);
+static void flight_end (mcache_t *mc, mcache_flight_t *fl);
+static void flight_put (mcache_flight_t *fl);
+
+int
+mcache_init (mcache_t *mc, size_t max, int wait, int pass)
+{
+  mc->wait = wait;
+  mc->pass = pass;
+  mc->flights = NULL;
+  mc->clock = (respool_cache_t) { .max = max, .drop = entry_drop };
+
+  if (!(mc->buckets = calloc (MCACHE_BUCKETS, sizeof (resource_blob_t *))))
+    return -1;
+
+  if (pthread_mutex_init (&mc->lock, NULL) != 0)
+    {
+      free (mc->buckets);
+      return -1;
+    }
+
+  return 0;
+}
+
+void
+mcache_free (mcache_t *mc)
+{
+  for (size_t i = 0; i < MCACHE_BUCKETS; i++)
+    for (resource_blob_t *blob = mc->buckets[i], *next; blob; blob = next)
+      {
+	next = mcache_entry (blob)->chain;
+	respool_blob_put (blob);
+      }
+
+  /* every leader has stored or given up by now */
+  for (mcache_flight_t *fl = mc->flights, *next; fl; fl = next)
+    {
+      next = fl->next;
+      pthread_cond_destroy (&fl->cond);
+      free (fl);
+    }
+
+  free (mc->buckets);
+  pthread_mutex_destroy (&mc->lock);
+}
+
+resource_blob_t *
+mcache_new (const char *key, size_t key_len, size_t head_len, size_t body_len)
+{
+  resource_blob_t *blob;
+  mcache_entry_t *e;
+  size_t size = sizeof (mcache_entry_t) + key_len + head_len + body_len;
+
+  if (!(blob = respool_blob_new (size)))
+    return NULL;
+
+  e = mcache_entry (blob);
+  *e = (mcache_entry_t) {
+    .hash = key_hash (key, key_len),
+    .key_len = key_len,
+    .head_len = head_len,
+    .body_len = body_len,
+  };
+
+  memcpy (e->data, key, key_len);
+  blob->size = size;
+  return blob;
+}
+
+int
+mcache_get (mcache_t *mc, const char *key, size_t len, resource_blob_t **out)
+{
+  int ret;
+  struct timespec until;
+  resource_blob_t *blob, *victims = NULL;
+  uint64_t hash = key_hash (key, len);
+
+  clock_gettime (CLOCK_REALTIME, &until);
+  until.tv_sec += mc->wait / 1000;
+  until.tv_nsec += mc->wait % 1000 * 1000000L;
+  if (until.tv_nsec >= 1000000000L)
+    {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+
+  pthread_mutex_lock (&mc->lock);
+
+  for (mcache_flight_t *fl;;)
+    {
+      time_t now = time (NULL);
+
+      if ((blob = entry_find (mc, hash, key, len)))
+	{
+	  mcache_entry_t *e = mcache_entry (blob);
+
+	  /* known to be uncacheable, nothing to coalesce on */
+	  if (e->pass && now < e->expires)
+	    {
+	      ret = MCACHE_MISS;
+	      break;
+	    }
+
+	  if (now < e->expires)
+	    {
+	      ret = MCACHE_FRESH;
+	      goto hit;
+	    }
+
+	  /* the first to see it stale revalidates, the rest keep serving it */
+	  if (!e->pass && now < e->stale)
+	    {
+	      ret = e->refresh ? MCACHE_STALE : MCACHE_REFRESH;
+	      e->refresh = true;
+	      goto hit;
+	    }
+
+	  respool_cache_unlink (&mc->clock, blob);
+	  blob->next = victims;
+	  victims = blob;
+	}
+
+      if (!(fl = flight_find (mc, hash, key, len)))
+	{
+	  ret = flight_new (mc, hash, key, len) ? MCACHE_FILL : MCACHE_MISS;
+	  break;
+	}
+
+      /* someone is fetching this already, wait for its answer */
+      int err = 0;
+      fl->refs++;
+      while (!fl->done && err != ETIMEDOUT)
+	err = pthread_cond_timedwait (&fl->cond, &mc->lock, &until);
+
+      bool done = fl->done;
+      flight_put (fl);
+
+      /* a leader that takes too long is bypassed, not waited out */
+      if (!done)
+	{
+	  ret = MCACHE_MISS;
+	  break;
+	}
+    }
+
+  pthread_mutex_unlock (&mc->lock);
+  goto out;
+
+hit:
+  __atomic_fetch_add (&blob->refs, 1, __ATOMIC_RELAXED);
+  __atomic_store_n (&blob->used, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&mc->lock);
+  *out = blob;
+
+out:
+  for (resource_blob_t *next; victims; victims = next)
+    {
+      next = victims->next;
+      respool_blob_put (victims);
+    }
+
+  return ret;
+}
+
+void
+mcache_put (mcache_t *mc, const char *key, size_t len, resource_blob_t *blob,
+	    int max_age, int stale)
+{
+  resource_blob_t *old, *victims = NULL, *marker = NULL;
+  uint64_t hash = key_hash (key, len);
+  time_t now = time (NULL);
+
+  if (blob && (max_age <= 0 || blob->size > mc->clock.max))
+    blob = NULL;
+
+  /* an uncacheable answer is remembered, so the key stops coalescing */
+  if (!blob && (marker = mcache_new (key, len, 0, 0)))
+    {
+      mcache_entry (marker)->pass = true;
+      mcache_entry (marker)->expires = now + mc->pass;
+    }
+
+  pthread_mutex_lock (&mc->lock);
+  old = entry_find (mc, hash, key, len);
+
+  if (blob)
+    {
+      mcache_entry_t *e = mcache_entry (blob);
+      e->date = now;
+      e->expires = now + max_age;
+      e->stale = e->expires + (stale > 0 ? stale : 0);
+      e->refresh = false;
+      victims = entry_link (mc, blob, old);
+    }
+
+  /* a failed revalidation keeps serving what we have */
+  else if (old && !mcache_entry (old)->pass
+	   && now < mcache_entry (old)->stale)
+    mcache_entry (old)->refresh = false;
+
+  else if (marker)
+    victims = entry_link (mc, marker, old);
+
+  mcache_flight_t *fl;
+  if ((fl = flight_find (mc, hash, key, len)))
+    flight_end (mc, fl);
+
+  pthread_mutex_unlock (&mc->lock);
+
+  for (resource_blob_t *next; victims; victims = next)
+    {
+      next = victims->next;
+      respool_blob_put (victims);
+    }
+
+  if (marker)
+    respool_blob_put (marker);
+}
+
+bool
+mcache_policy (const char *control, size_t len, int *max_age, int *stale)
+{
+  int shared = -1;
+  const char *pos = control, *end = control + len;
+
+  *max_age = -1;
+  *stale = 0;
+
+  while (pos < end)
+    {
+      const char *tok, *stop;
+      size_t n;
+
+      while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == ','))
+	pos++;
+      if (pos == end)
+	break;
+
+      tok = pos;
+      stop = memchr (pos, ',', end - pos) ?: end;
+      pos = stop;
+
+      while (stop > tok && (stop[-1] == ' ' || stop[-1] == '\t'))
+	stop--;
+      if (tok == stop)
+	continue;
+
+      /* directives that forbid a shared cache from keeping the answer */
+      n = stop - tok;
+      if ((n == 8 && strncasecmp (tok, "no-store", 8) == 0)
+	  || (n == 8 && strncasecmp (tok, "no-cache", 8) == 0)
+	  || (n == 7 && strncasecmp (tok, "private", 7) == 0))
+	return false;
+
+      const char *eq = memchr (tok, '=', n);
+      if (!eq)
+	continue;
+
+      long val = 0;
+      const char *dig = eq + 1;
+      if (dig < stop && *dig == '"')
+	dig++;
+      for (; dig < stop && *dig >= '0' && *dig <= '9'; dig++)
+	if ((val = val * 10 + (*dig - '0')) > INT32_MAX)
+	  val = INT32_MAX;
+
+      n = eq - tok;
+      if (n == 7 && strncasecmp (tok, "max-age", 7) == 0)
+	*max_age = val;
+      else if (n == 8 && strncasecmp (tok, "s-maxage", 8) == 0)
+	shared = val;
+      else if (n == 22 && strncasecmp (tok, "stale-while-revalidate", 22) == 0)
+	*stale = val;
+    }
+
+  /* s-maxage is meant for caches like this one */
+  if (shared != -1)
+    *max_age = shared;
+
+  return *max_age > 0;
+}
+
+static inline uint64_t
+key_hash (const char *key, size_t len)
+{
+  /* FNV-1a */
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < len; i++)
+    {
+      hash ^= (unsigned char) key[i];
+      hash *= 0x100000001b3ULL;
+    }
+
+  return hash;
+}
+
+/* the functions below are called with the lock held */
+
+static void
+entry_drop (resource_blob_t *blob)
+{
+  mcache_t *mc = blob->owner;
+  mcache_entry_t *e = mcache_entry (blob);
+  resource_blob_t **slot = &mc->buckets[e->hash % MCACHE_BUCKETS];
+
+  while (*slot != blob)
+    slot = &mcache_entry (*slot)->chain;
+
+  *slot = e->chain;
+  e->chain = NULL;
+}
+
+static inline resource_blob_t *
+entry_find (mcache_t *mc, uint64_t hash, const char *key, size_t len)
+{
+  resource_blob_t *blob = mc->buckets[hash % MCACHE_BUCKETS];
+
+  for (; blob; blob = mcache_entry (blob)->chain)
+    {
+      mcache_entry_t *e = mcache_entry (blob);
+      if (e->hash == hash && e->key_len == len
+	  && memcmp (e->data, key, len) == 0)
+	return blob;
+    }
+
+  return NULL;
+}
+
+static inline resource_blob_t *
+entry_link (mcache_t *mc, resource_blob_t *blob, resource_blob_t *old)
+{
+  resource_blob_t *victims = NULL;
+  mcache_entry_t *e = mcache_entry (blob);
+  resource_blob_t **slot = &mc->buckets[e->hash % MCACHE_BUCKETS];
+
+  if (old)
+    {
+      respool_cache_unlink (&mc->clock, old);
+      old->next = NULL;
+      victims = old;
+    }
+
+  /* room is made with the same clock the gzip cache runs */
+  resource_blob_t *tail = respool_cache_evict (&mc->clock, blob->size);
+  if (victims)
+    victims->next = tail;
+  else
+    victims = tail;
+
+  blob->owner = mc;
+  blob->refs++;
+  e->chain = *slot;
+  *slot = blob;
+  respool_cache_link (&mc->clock, blob);
+
+  return victims;
+}
+
+static inline mcache_flight_t *
+flight_find (mcache_t *mc, uint64_t hash, const char *key, size_t len)
+{
+  for (mcache_flight_t *fl = mc->flights; fl; fl = fl->next)
+    if (fl->hash == hash && fl->len == len && memcmp (fl->key, key, len) == 0)
+      return fl;
+
+  return NULL;
+}
+
+static inline mcache_flight_t *
+flight_new (mcache_t *mc, uint64_t hash, const char *key, size_t len)
+{
+  mcache_flight_t *fl;
+
+  if (!(fl = malloc (sizeof (mcache_flight_t) + len)))
+    return NULL;
+
+  /* the leader holds the first reference until it stores */
+  *fl = (mcache_flight_t) { .refs = 1, .hash = hash, .len = len };
+  if (pthread_cond_init (&fl->cond, NULL) != 0)
+    {
+      free (fl);
+      return NULL;
+    }
+
+  memcpy (fl->key, key, len);
+  fl->next = mc->flights;
+  mc->flights = fl;
+  return fl;
+}
+
+static inline void
+flight_end (mcache_t *mc, mcache_flight_t *fl)
+{
+  mcache_flight_t **slot = &mc->flights;
+
+  while (*slot != fl)
+    slot = &(*slot)->next;
+
+  *slot = fl->next;
+  fl->done = true;
+  pthread_cond_broadcast (&fl->cond);
+  flight_put (fl);
+}
+
+static inline void
+flight_put (mcache_flight_t *fl)
+{
+  if (--fl->refs)
+    return;
+
+  pthread_cond_destroy (&fl->cond);
+  free (fl);
+}
@@ -0,0 +1,77 @@
+#ifndef MCACHE_H
+#define MCACHE_H
+
+#include "respool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define MCACHE_BUCKETS 4096
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+enum
+{
+  MCACHE_MISS,
+  MCACHE_FILL,
+  MCACHE_FRESH,
+  MCACHE_STALE,
+  MCACHE_REFRESH,
+};
+
+typedef struct mcache_t mcache_t;
+typedef struct mcache_entry_t mcache_entry_t;
+typedef struct mcache_flight_t mcache_flight_t;
+
+struct mcache_t
+{
+  int wait;
+  int pass;
+  pthread_mutex_t lock;
+  respool_cache_t clock;
+  resource_blob_t **buckets;
+  mcache_flight_t *flights;
+};
+
+/* lives at the front of its blob, the stored response follows the key */
+struct mcache_entry_t
+{
+  resource_blob_t *chain;
+  uint64_t hash;
+  bool pass;
+  bool refresh;
+  time_t date;
+  time_t expires;
+  time_t stale;
+  size_t key_len;
+  size_t head_len;
+  size_t body_len;
+  char data[];
+};
+
+#define mcache_entry(blob) ((mcache_entry_t *) (blob)->data)
+#define mcache_head(e) ((e)->data + (e)->key_len)
+#define mcache_body(e) (mcache_head (e) + (e)->head_len)
+
+extern int mcache_init (mcache_t *mc, size_t max, int wait, int pass)
+    attr_nonnull (1);
+
+extern void mcache_free (mcache_t *mc) attr_nonnull (1);
+
+extern resource_blob_t *mcache_new (const char *key, size_t key_len,
+				    size_t head_len, size_t body_len)
+    attr_nonnull (1);
+
+extern int mcache_get (mcache_t *mc, const char *key, size_t len,
+		       resource_blob_t **blob) attr_nonnull (1, 2, 4);
+
+extern void mcache_put (mcache_t *mc, const char *key, size_t len,
+			resource_blob_t *blob, int max_age, int stale)
+    attr_nonnull (1, 2);
+
+extern bool mcache_policy (const char *control, size_t len, int *max_age,
+			   int *stale) attr_nonnull (1, 3, 4);
+
+#endif
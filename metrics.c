@@ -0,0 +1,98 @@
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int
+metrics_init (metrics_t *m, size_t counters, size_t hists)
+{
+  m->counters = counters;
+  m->hists = hists;
+  m->shards = NULL;
+
+  /* shards outlive their threads, a scrape may still be reading them */
+  return pthread_key_create (&m->key, NULL) == 0 ? 0 : -1;
+}
+
+void
+metrics_free (metrics_t *m)
+{
+  for (metrics_shard_t *s = m->shards, *next; s; s = next)
+    {
+      next = s->next;
+      free (s);
+    }
+
+  pthread_key_delete (m->key);
+}
+
+metrics_shard_t *
+metrics_shard (metrics_t *m)
+{
+  metrics_shard_t *s;
+  size_t size = sizeof (metrics_shard_t) + m->hists * sizeof (metrics_hist_t)
+		+ m->counters * sizeof (uint64_t);
+
+  if (!(s = calloc (1, size)))
+    return NULL;
+
+  s->hists = (metrics_hist_t *) (s + 1);
+  s->counters = (uint64_t *) (s->hists + m->hists);
+
+  if (pthread_setspecific (m->key, s) != 0)
+    {
+      free (s);
+      return NULL;
+    }
+
+  /* pushed once per thread, readers only ever walk forward */
+  s->next = __atomic_load_n (&m->shards, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n (&m->shards, &s->next, s, 1,
+				       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+
+  return s;
+}
+
+uint64_t
+metrics_counter (metrics_t *m, size_t id)
+{
+  uint64_t sum = 0;
+  metrics_shard_t *s = __atomic_load_n (&m->shards, __ATOMIC_ACQUIRE);
+
+  for (; s; s = s->next)
+    sum += __atomic_load_n (&s->counters[id], __ATOMIC_RELAXED);
+
+  return sum;
+}
+
+void
+metrics_merge (metrics_t *m, size_t id, metrics_hist_t *out)
+{
+  metrics_shard_t *s = __atomic_load_n (&m->shards, __ATOMIC_ACQUIRE);
+
+  memset (out, 0, sizeof (metrics_hist_t));
+
+  /* not a snapshot, each field is read once while the owners keep going */
+  for (; s; s = s->next)
+    {
+      metrics_hist_t *h = &s->hists[id];
+
+      out->count += __atomic_load_n (&h->count, __ATOMIC_RELAXED);
+      out->sum += __atomic_load_n (&h->sum, __ATOMIC_RELAXED);
+      for (size_t i = 0; i < METRICS_BUCKETS; i++)
+	out->buckets[i] += __atomic_load_n (&h->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t
+metrics_bound (size_t bucket)
+{
+  /* exclusive upper end of the values a bucket holds */
+  if (bucket < 2 << METRICS_SUB_BITS)
+    return bucket + 1;
+
+  size_t shift = (bucket >> METRICS_SUB_BITS) - 1;
+  uint64_t sub = bucket - (shift << METRICS_SUB_BITS);
+  return (sub + 1) << shift;
+}
@@ -0,0 +1,103 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* log-linear buckets, 8 per power of two, exact below 16 */
+#define METRICS_SUB_BITS 3
+#define METRICS_BUCKETS 320
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+typedef struct metrics_t metrics_t;
+typedef struct metrics_hist_t metrics_hist_t;
+typedef struct metrics_shard_t metrics_shard_t;
+
+struct metrics_hist_t
+{
+  uint64_t count;
+  uint64_t sum;
+  uint64_t buckets[METRICS_BUCKETS];
+};
+
+/* one per thread, written only by its owner and read by anyone */
+struct metrics_shard_t
+{
+  metrics_shard_t *next;
+  uint64_t *counters;
+  metrics_hist_t *hists;
+};
+
+struct metrics_t
+{
+  size_t counters;
+  size_t hists;
+  pthread_key_t key;
+  metrics_shard_t *shards;
+};
+
+extern int metrics_init (metrics_t *m, size_t counters, size_t hists)
+    attr_nonnull (1);
+
+extern void metrics_free (metrics_t *m) attr_nonnull (1);
+
+extern metrics_shard_t *metrics_shard (metrics_t *m) attr_nonnull (1);
+
+extern uint64_t metrics_counter (metrics_t *m, size_t id) attr_nonnull (1);
+
+extern void metrics_merge (metrics_t *m, size_t id, metrics_hist_t *out)
+    attr_nonnull (1, 3);
+
+extern uint64_t metrics_bound (size_t bucket);
+
+static inline uint64_t
+metrics_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline size_t
+metrics_bucket (uint64_t v)
+{
+  if (v < 2 << METRICS_SUB_BITS)
+    return v;
+
+  int shift = 63 - __builtin_clzll (v) - METRICS_SUB_BITS;
+  size_t b = ((size_t) shift << METRICS_SUB_BITS) + (v >> shift);
+  return b < METRICS_BUCKETS ? b : METRICS_BUCKETS - 1;
+}
+
+/* single writer, so a relaxed load and store is all a bump takes */
+#define metrics_bump(ptr, n)                                                  \
+  __atomic_store_n ((ptr), __atomic_load_n ((ptr), __ATOMIC_RELAXED) + (n),  \
+		    __ATOMIC_RELAXED)
+
+static inline void
+metrics_count (metrics_t *m, size_t id, uint64_t n)
+{
+  metrics_shard_t *s = pthread_getspecific (m->key) ?: metrics_shard (m);
+
+  if (s)
+    metrics_bump (&s->counters[id], n);
+}
+
+static inline void
+metrics_observe (metrics_t *m, size_t id, uint64_t v)
+{
+  metrics_shard_t *s = pthread_getspecific (m->key) ?: metrics_shard (m);
+
+  if (!s)
+    return;
+
+  metrics_hist_t *h = &s->hists[id];
+  metrics_bump (&h->buckets[metrics_bucket (v)], 1);
+  metrics_bump (&h->sum, v);
+  metrics_bump (&h->count, 1);
+}
+
+#endif
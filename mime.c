@@ -1,65 +1,310 @@
 #include "mime.h"
+#include "arena.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-static const char *table[][2] = {
-  { ".css", "text/css" },
-  { ".htm", "text/html" },
-  { ".html", "text/html" },
-  { ".txt", "text/plain" },
-  { ".js", "text/javascript" },
-
-  { ".png", "image/png" },
-  { ".bmp", "image/bmp" },
-  { ".gif", "image/gif" },
-  { ".jpg", "image/jpeg" },
-  { ".jpeg", "image/jpeg" },
-  { ".webp", "image/webp" },
-  { ".ico", "image/x-icon" },
-  { ".svg", "image/svg+xml" },
-
-  { ".ttf", "font/ttf" },
-  { ".otf", "font/otf" },
-  { ".woff", "font/woff" },
-  { ".woff2", "font/woff2" },
-
-  { ".wav", "audio/wav" },
-  { ".aac", "audio/aac" },
-  { ".mp3", "audio/mpeg" },
-  { ".flac", "audio/flac" },
-
-  { ".mp4", "video/mp4" },
-  { ".webm", "video/webm" },
-  { ".flv", "video/x-flv" },
-  { ".avi", "video/x-msvideo" },
-  { ".mkv", "video/x-matroska" },
-
-  { ".zip", "application/zip" },
-  { ".gz", "application/gzip" },
-  { ".tgz", "application/gzip" },
-  { ".bz", "application/x-bzip" },
-  { ".tar", "application/x-tar" },
-  { ".rar", "application/x-rar" },
-  { ".bz2", "application/x-bzip2" },
-  { ".7z", "application/x-7z-compressed" },
-
-  { ".pdf", "application/pdf" },
-  { ".json", "application/json" },
-  { ".epub", "application/epub+zip" },
+#define MAX_EXT_LEN 16
+#define MIN_CAP 128
+
+struct mime_slot_t
+{
+  uint32_t hash;
+  const char *ext;
+  const mime_t *mime;
+};
+
+static const struct
+{
+  const char *ext;
+  const char *type;
+  bool compressible;
+} table[] = {
+  { ".css", "text/css", true },
+  { ".htm", "text/html", true },
+  { ".html", "text/html", true },
+  { ".txt", "text/plain", true },
+  { ".js", "text/javascript", true },
+
+  { ".png", "image/png", false },
+  { ".bmp", "image/bmp", true },
+  { ".gif", "image/gif", false },
+  { ".jpg", "image/jpeg", false },
+  { ".jpeg", "image/jpeg", false },
+  { ".webp", "image/webp", false },
+  { ".ico", "image/x-icon", true },
+  { ".svg", "image/svg+xml", true },
+
+  { ".ttf", "font/ttf", true },
+  { ".otf", "font/otf", true },
+  { ".woff", "font/woff", false },
+  { ".woff2", "font/woff2", false },
+
+  { ".wav", "audio/wav", false },
+  { ".aac", "audio/aac", false },
+  { ".mp3", "audio/mpeg", false },
+  { ".flac", "audio/flac", false },
+
+  { ".mp4", "video/mp4", false },
+  { ".webm", "video/webm", false },
+  { ".flv", "video/x-flv", false },
+  { ".avi", "video/x-msvideo", false },
+  { ".mkv", "video/x-matroska", false },
+
+  { ".zip", "application/zip", false },
+  { ".gz", "application/gzip", false },
+  { ".tgz", "application/gzip", false },
+  { ".bz", "application/x-bzip", false },
+  { ".tar", "application/x-tar", false },
+  { ".rar", "application/x-rar", false },
+  { ".bz2", "application/x-bzip2", false },
+  { ".7z", "application/x-7z-compressed", false },
+
+  { ".pdf", "application/pdf", false },
+  { ".json", "application/json", true },
+  { ".epub", "application/epub+zip", false },
 };
 
 static const size_t table_size = sizeof (table) / sizeof (*table);
 
-const char *
-mime_of (const char *path)
+static uint32_t hash_ext (const char *ext, size_t len);
+static bool insert (mime_registry_t *reg, const char *ext, size_t len,
+		    const mime_t *mime);
+static const mime_t *intern (mime_registry_t *reg, const char *type,
+			     size_t len, bool compressible);
+
+void
+mime_free (mime_registry_t *reg)
+{
+  free (reg->slots);
+  arena_free (&reg->mpool);
+}
+
+int
+mime_init (mime_registry_t *reg, const char *path)
+{
+  *reg = (mime_registry_t) { .mpool = ARENA_INIT };
+
+  for (size_t i = 0; i < table_size; i++)
+    {
+      const char *type = table[i].type, *ext = table[i].ext + 1;
+      const mime_t *mime
+	  = intern (reg, type, strlen (type), table[i].compressible);
+      if (!mime || !insert (reg, ext, strlen (ext), mime))
+	goto err;
+    }
+
+  if (path && mime_load (reg, path) != 0)
+    goto err;
+
+  return 0;
+
+err:
+  mime_free (reg);
+  return -1;
+}
+
+int
+mime_load (mime_registry_t *reg, const char *path)
+{
+  FILE *file;
+  int ret = -1;
+  size_t cap = 0;
+  char *line = NULL;
+  static const char *blank = " \t\r\n";
+
+  if (!(file = fopen (path, "r")))
+    return ret;
+
+  /* <type> <ext>... per line, as in /etc/mime.types */
+  while (getline (&line, &cap, file) != -1)
+    {
+      char *pos = line + strspn (line, blank);
+      size_t len = strcspn (pos, blank);
+
+      if (!len || *pos == '#')
+	continue;
+
+      const char *type = pos;
+      size_t type_len = len;
+      const mime_t *mime = NULL;
+
+      for (pos += len; *(pos += strspn (pos, blank)); pos += len)
+	{
+	  len = strcspn (pos, blank);
+
+	  if (!mime && !(mime = intern (reg, type, type_len, false)))
+	    goto clean;
+
+	  if (!insert (reg, pos, len, mime))
+	    goto clean;
+	}
+    }
+
+  ret = 0;
+
+clean:
+  free (line);
+  fclose (file);
+  return ret;
+}
+
+const mime_t *
+mime_find (const mime_registry_t *reg, const char *path)
 {
   const char *ext;
 
-  if (!(ext = strrchr (path, '.')))
+  if (!reg->cap || !(ext = strrchr (path, '.')))
     return NULL;
 
-  for (size_t i = 0; i < table_size; i++)
-    if (strcmp (ext, table[i][0]) == 0)
-      return table[i][1];
+  size_t len = strlen (++ext);
+  if (!len || len > MAX_EXT_LEN || memchr (ext, '/', len))
+    return NULL;
+
+  uint32_t hash = hash_ext (ext, len);
+  size_t mask = reg->cap - 1;
+
+  for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+      mime_slot_t *slot = &reg->slots[i];
+
+      if (!slot->ext)
+	return NULL;
+
+      if (slot->hash == hash && strncasecmp (slot->ext, ext, len) == 0
+	  && !slot->ext[len])
+	return slot->mime;
+    }
+}
+
+const char *
+mime_of (const mime_registry_t *reg, const char *path)
+{
+  const mime_t *mime = mime_find (reg, path);
+  return mime ? mime->type : NULL;
+}
+
+static inline uint32_t
+hash_ext (const char *ext, size_t len)
+{
+  /* fnv-1a over the lowercased extension */
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < len; i++)
+    {
+      hash ^= (unsigned char) tolower ((unsigned char) ext[i]);
+      hash *= 16777619u;
+    }
+
+  return hash;
+}
+
+static inline bool
+grow (mime_registry_t *reg)
+{
+  mime_slot_t *slots;
+  size_t cap = reg->cap ? reg->cap * 2 : MIN_CAP;
+
+  if (!(slots = calloc (cap, sizeof (mime_slot_t))))
+    return false;
+
+  for (size_t i = 0; i < reg->cap; i++)
+    {
+      mime_slot_t *slot = &reg->slots[i];
+
+      if (!slot->ext)
+	continue;
+
+      size_t j = slot->hash & (cap - 1);
+      for (; slots[j].ext; j = (j + 1) & (cap - 1))
+	;
+      slots[j] = *slot;
+    }
+
+  free (reg->slots);
+  reg->slots = slots;
+  reg->cap = cap;
+  return true;
+}
+
+static inline bool
+insert (mime_registry_t *reg, const char *ext, size_t len, const mime_t *mime)
+{
+  char *key;
+
+  if (!len || len > MAX_EXT_LEN)
+    return true;
+
+  /* keep the load factor under 1/2 */
+  if ((reg->size + 1) * 2 > reg->cap && !grow (reg))
+    return false;
+
+  uint32_t hash = hash_ext (ext, len);
+  size_t mask = reg->cap - 1;
+  size_t i = hash & mask;
+
+  for (; reg->slots[i].ext; i = (i + 1) & mask)
+    {
+      mime_slot_t *slot = &reg->slots[i];
+
+      /* later definitions win */
+      if (slot->hash == hash && strncasecmp (slot->ext, ext, len) == 0
+	  && !slot->ext[len])
+	{
+	  slot->mime = mime;
+	  return true;
+	}
+    }
+
+  if (!(key = arena_alloc (&reg->mpool, len + 1)))
+    return false;
+
+  for (size_t j = 0; j < len; j++)
+    key[j] = tolower ((unsigned char) ext[j]);
+  key[len] = '\0';
+
+  reg->slots[i] = (mime_slot_t) { .hash = hash, .ext = key, .mime = mime };
+  reg->size++;
+  return true;
+}
+
+static inline const mime_t *
+intern (mime_registry_t *reg, const char *type, size_t len, bool compressible)
+{
+  mime_t *mime;
+  char *copy, *field;
+  static const char prefix[] = "Content-Type: ";
+  size_t field_len = sizeof (prefix) - 1 + len + 2;
+
+  if (!(mime = arena_aligned_alloc (&reg->mpool, sizeof (mime_t), 0)))
+    return NULL;
+
+  if (!(copy = arena_alloc (&reg->mpool, len + 1)))
+    return NULL;
+
+  if (!(field = arena_alloc (&reg->mpool, field_len + 1)))
+    return NULL;
+
+  memcpy (copy, type, len);
+  copy[len] = '\0';
+
+  /* the response header field is serialized once per type */
+  sprintf (field, "%s%s\r\n", prefix, copy);
+
+  /* loaded types have no flag, so guess from the type itself */
+  if (!compressible)
+    compressible = strncmp (copy, "text/", 5) == 0 || strstr (copy, "+xml")
+		   || strstr (copy, "+json") || strstr (copy, "/json")
+		   || strstr (copy, "/xml") || strstr (copy, "javascript");
 
-  return NULL;
+  *mime = (mime_t) {
+    .type = copy,
+    .field = field,
+    .field_len = field_len,
+    .compressible = compressible,
+  };
+  return mime;
 }
@@ -1,6 +1,40 @@
 #ifndef MIME_H
 #define MIME_H
 
-extern const char *mime_of (const char *path);
+#include "arena.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct mime_t mime_t;
+typedef struct mime_slot_t mime_slot_t;
+typedef struct mime_registry_t mime_registry_t;
+
+struct mime_t
+{
+  const char *type;
+  const char *field;
+  size_t field_len;
+  bool compressible;
+};
+
+/* one per server, written by mime_init and read-only afterwards */
+struct mime_registry_t
+{
+  size_t cap;
+  size_t size;
+  mime_slot_t *slots;
+  arena_t mpool;
+};
+
+extern void mime_free (mime_registry_t *reg);
+
+extern int mime_init (mime_registry_t *reg, const char *path);
+
+extern int mime_load (mime_registry_t *reg, const char *path);
+
+extern const mime_t *mime_find (const mime_registry_t *reg, const char *path);
+
+extern const char *mime_of (const mime_registry_t *reg, const char *path);
 
 #endif
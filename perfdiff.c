@@ -0,0 +1,534 @@
+#include "util.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SAMPLES_MAX 256
+#define SERIES_MAX 256
+#define NAME_MAX_LEN 64
+
+/* fewer samples a side and no ordering is ever significant */
+#define SAMPLES_MIN 3
+
+enum
+{
+  JSON_NULL,
+  JSON_BOOL,
+  JSON_NUMBER,
+  JSON_STRING,
+  JSON_ARRAY,
+  JSON_OBJECT,
+};
+
+enum
+{
+  VERDICT_OK,
+  VERDICT_BETTER,
+  VERDICT_WORSE,
+  VERDICT_FEW,
+  VERDICT_NEW,
+  VERDICT_GONE,
+};
+
+typedef struct json_t json_t;
+typedef struct series_t series_t;
+typedef struct set_t set_t;
+
+/* only what loadgen and microbench print, nothing is validated twice */
+struct json_t
+{
+  int type;
+  double num;
+  char *str;
+  size_t cnt;
+  char **keys;
+  json_t *items;
+};
+
+/* one metric of one benchmark, a sample per repetition or per run */
+struct series_t
+{
+  char name[NAME_MAX_LEN];
+  const char *metric;
+  bool higher;
+  size_t n;
+  double v[SAMPLES_MAX];
+};
+
+struct set_t
+{
+  size_t cnt;
+  series_t series[SERIES_MAX];
+};
+
+static struct
+{
+  double alpha;
+  double threshold;
+} opt = {
+  .alpha = 0.01,
+  .threshold = 5,
+};
+
+static const char *verdicts[] = {
+  [VERDICT_OK] = "ok",	   [VERDICT_BETTER] = "better",
+  [VERDICT_WORSE] = "WORSE", [VERDICT_FEW] = "few",
+  [VERDICT_NEW] = "new",   [VERDICT_GONE] = "gone",
+};
+
+static int json_parse (const char **pos, json_t *out);
+static int json_string (const char **pos, char **out);
+static void json_free (json_t *j);
+static const json_t *json_get (const json_t *j, const char *key);
+static void skip_space (const char **pos);
+
+static void set_load (set_t *set, const char *path);
+static void set_add (set_t *set, const char *name, const char *metric,
+		     bool higher, double v);
+static series_t *set_find (set_t *set, const series_t *like);
+
+static double median (const series_t *s);
+static double mann_whitney (const series_t *worse, const series_t *other);
+static int compare (const series_t *base, const series_t *cur, double *p);
+
+static void usage (const char *prog);
+
+int
+main (int argc, char **argv)
+{
+  int c;
+  static set_t base, cur;
+  size_t worse = 0;
+
+  while ((c = getopt (argc, argv, "a:t:h")) != -1)
+    switch (c)
+      {
+      case 'a':
+	opt.alpha = strtod (optarg, NULL);
+	break;
+      case 't':
+	opt.threshold = strtod (optarg, NULL);
+	break;
+      default:
+	usage (argv[0]);
+      }
+
+  if (argc - optind != 2 || opt.alpha <= 0 || opt.alpha >= 1)
+    usage (argv[0]);
+
+  set_load (&base, argv[optind]);
+  set_load (&cur, argv[optind + 1]);
+
+  printf ("%-28s %-7s %12s %12s %8s %7s  %s\n", "benchmark", "metric",
+	  "baseline", "current", "delta", "p", "verdict");
+
+  for (size_t i = 0; i < cur.cnt; i++)
+    {
+      double p = NAN;
+      series_t *s = &cur.series[i], *b = set_find (&base, s);
+
+      if (!b)
+	{
+	  printf ("%-28s %-7s %12s %12.2f %8s %7s  %s\n", s->name, s->metric,
+		  "-", median (s), "-", "-", verdicts[VERDICT_NEW]);
+	  continue;
+	}
+
+      int verdict = compare (b, s, &p);
+      double m = median (s), bm = median (b);
+
+      printf ("%-28s %-7s %12.2f %12.2f %+7.1f%% %7.4f  %s\n", s->name,
+	      s->metric, bm, m, (m - bm) / bm * 100, p, verdicts[verdict]);
+
+      worse += verdict == VERDICT_WORSE;
+    }
+
+  /* renamed or dropped benchmarks are shown, they do not fail the check */
+  for (size_t i = 0; i < base.cnt; i++)
+    if (!set_find (&cur, &base.series[i]))
+      printf ("%-28s %-7s %12.2f %12s %8s %7s  %s\n", base.series[i].name,
+	      base.series[i].metric, median (&base.series[i]), "-", "-", "-",
+	      verdicts[VERDICT_GONE]);
+
+  printf ("%zu regression%s (p < %g, at least %g%% worse)\n", worse,
+	  worse == 1 ? "" : "s", opt.alpha, opt.threshold);
+
+  return worse ? 1 : 0;
+}
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr,
+	   "usage: %s [-a alpha] [-t percent] baseline.json current.json\n",
+	   prog);
+  exit (2);
+}
+
+static void
+skip_space (const char **pos)
+{
+  while (**pos == ' ' || **pos == '\t' || **pos == '\n' || **pos == '\r')
+    (*pos)++;
+}
+
+static int
+json_string (const char **pos, char **out)
+{
+  const char *p = *pos + 1;
+  char *str, *w;
+
+  if (!(str = w = malloc (strlen (p) + 1)))
+    return -1;
+
+  for (; *p != '"'; p++)
+    {
+      if (!*p)
+	goto clean;
+
+      if (*p != '\\')
+	{
+	  *w++ = *p;
+	  continue;
+	}
+
+      switch (*++p)
+	{
+	case 'n':
+	  *w++ = '\n';
+	  break;
+	case 't':
+	  *w++ = '\t';
+	  break;
+	case 'u':
+	  /* names are ascii, anything else only has to survive */
+	  if (strlen (p) < 5)
+	    goto clean;
+	  *w++ = '?';
+	  p += 4;
+	  break;
+	case '\0':
+	  goto clean;
+	default:
+	  *w++ = *p;
+	}
+    }
+
+  *w = '\0';
+  *out = str;
+  *pos = p + 1;
+  return 0;
+
+clean:
+  free (str);
+  return -1;
+}
+
+static int
+json_parse (const char **pos, json_t *out)
+{
+  char *end;
+  const char *p;
+  bool object;
+
+  *out = (json_t) { .type = JSON_NULL };
+  skip_space (pos);
+  p = *pos;
+
+  switch (*p)
+    {
+    case '"':
+      out->type = JSON_STRING;
+      return json_string (pos, &out->str);
+
+    case '[':
+    case '{':
+      object = *p == '{';
+      out->type = object ? JSON_OBJECT : JSON_ARRAY;
+      *pos = p + 1;
+      skip_space (pos);
+
+      if (**pos == (object ? '}' : ']'))
+	{
+	  (*pos)++;
+	  return 0;
+	}
+
+      for (;;)
+	{
+	  json_t *items;
+	  char **keys, *key = NULL;
+
+	  if (object)
+	    {
+	      skip_space (pos);
+	      if (**pos != '"' || json_string (pos, &key) != 0)
+		goto clean;
+	      skip_space (pos);
+	      if (*(*pos)++ != ':')
+		goto clean_key;
+	    }
+
+	  if (!(items = realloc (out->items,
+				 (out->cnt + 1) * sizeof (*items))))
+	    goto clean_key;
+	  out->items = items;
+
+	  if (!(keys = realloc (out->keys, (out->cnt + 1) * sizeof (*keys))))
+	    goto clean_key;
+	  out->keys = keys;
+
+	  if (json_parse (pos, &out->items[out->cnt]) != 0)
+	    {
+	      json_free (&out->items[out->cnt]);
+	      goto clean_key;
+	    }
+	  out->keys[out->cnt++] = key;
+
+	  skip_space (pos);
+	  if (**pos == ',')
+	    {
+	      (*pos)++;
+	      continue;
+	    }
+	  if (*(*pos)++ == (object ? '}' : ']'))
+	    return 0;
+	  goto clean;
+
+	clean_key:
+	  free (key);
+	  goto clean;
+	}
+
+    case 't':
+    case 'f':
+    case 'n':
+      if (!strncmp (p, "true", 4) || !strncmp (p, "null", 4))
+	*pos = p + 4;
+      else if (!strncmp (p, "false", 5))
+	*pos = p + 5;
+      else
+	return -1;
+      out->type = *p == 'n' ? JSON_NULL : JSON_BOOL;
+      out->num = *p == 't';
+      return 0;
+
+    default:
+      errno = 0;
+      out->num = strtod (p, &end);
+      if (end == p || errno)
+	return -1;
+      out->type = JSON_NUMBER;
+      *pos = end;
+      return 0;
+    }
+
+clean:
+  json_free (out);
+  return -1;
+}
+
+static void
+json_free (json_t *j)
+{
+  for (size_t i = 0; i < j->cnt; i++)
+    {
+      json_free (&j->items[i]);
+      if (j->keys)
+	free (j->keys[i]);
+    }
+
+  free (j->items);
+  free (j->keys);
+  free (j->str);
+  *j = (json_t) { .type = JSON_NULL };
+}
+
+static const json_t *
+json_get (const json_t *j, const char *key)
+{
+  if (j->type != JSON_OBJECT)
+    return NULL;
+
+  for (size_t i = 0; i < j->cnt; i++)
+    if (!strcmp (j->keys[i], key))
+      return &j->items[i];
+
+  return NULL;
+}
+
+/* a microbench object, or any number of loadgen objects one run each */
+static void
+set_load (set_t *set, const char *path)
+{
+  FILE *file;
+  char *buf = NULL;
+  size_t size = 0;
+  const char *pos;
+
+  if (!(file = fopen (path, "r")))
+    error ("cannot open %s", path);
+
+  if (getdelim (&buf, &size, '\0', file) == -1)
+    error ("cannot read %s", path);
+  fclose (file);
+
+  for (pos = buf, skip_space (&pos); *pos; skip_space (&pos))
+    {
+      json_t root;
+      const json_t *suite, *list, *name, *rps, *lat, *p99;
+
+      if (json_parse (&pos, &root) != 0)
+	error ("%s: malformed json at offset %zu", path, pos - buf);
+
+      suite = json_get (&root, "suite");
+      list = json_get (&root, "benchmarks");
+
+      if (suite && suite->type == JSON_STRING && list
+	  && list->type == JSON_ARRAY)
+	for (size_t i = 0; i < list->cnt; i++)
+	  {
+	    const json_t *b = &list->items[i];
+	    const json_t *samples = json_get (b, "samples");
+	    char full[NAME_MAX_LEN];
+
+	    if (!(name = json_get (b, "name")) || name->type != JSON_STRING
+		|| !samples || samples->type != JSON_ARRAY)
+	      error ("%s: benchmark without name or samples", path);
+
+	    snprintf (full, sizeof (full), "%s/%s", suite->str, name->str);
+	    for (size_t k = 0; k < samples->cnt; k++)
+	      set_add (set, full, "ns/op", false, samples->items[k].num);
+	  }
+      else if ((name = json_get (&root, "name")) && name->type == JSON_STRING
+	       && (rps = json_get (&root, "rps"))
+	       && (lat = json_get (&root, "latency_us"))
+	       && (p99 = json_get (lat, "p99")))
+	{
+	  set_add (set, name->str, "req/s", true, rps->num);
+	  set_add (set, name->str, "p99 us", false, p99->num);
+	}
+      else
+	error ("%s: neither microbench nor loadgen output", path);
+
+      json_free (&root);
+    }
+
+  free (buf);
+}
+
+static void
+set_add (set_t *set, const char *name, const char *metric, bool higher,
+	 double v)
+{
+  series_t like = { .metric = metric }, *s;
+
+  snprintf (like.name, sizeof (like.name), "%s", name);
+  if (!(s = set_find (set, &like)))
+    {
+      if (set->cnt == SERIES_MAX)
+	error ("more than %d series", SERIES_MAX);
+      s = &set->series[set->cnt++];
+      *s = like;
+      s->higher = higher;
+    }
+
+  if (s->n == SAMPLES_MAX)
+    error ("%s: more than %d samples", name, SAMPLES_MAX);
+  s->v[s->n++] = v;
+}
+
+static series_t *
+set_find (set_t *set, const series_t *like)
+{
+  for (size_t i = 0; i < set->cnt; i++)
+    if (!strcmp (set->series[i].name, like->name)
+	&& !strcmp (set->series[i].metric, like->metric))
+      return &set->series[i];
+  return NULL;
+}
+
+static int
+sample_comp (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static double
+median (const series_t *s)
+{
+  double sorted[SAMPLES_MAX];
+
+  memcpy (sorted, s->v, s->n * sizeof (double));
+  qsort (sorted, s->n, sizeof (double), sample_comp);
+  return s->n % 2 ? sorted[s->n / 2]
+		  : (sorted[s->n / 2 - 1] + sorted[s->n / 2]) / 2;
+}
+
+/* one-sided, the chance that worse would rank this far above other if both
+   came from the same distribution; normal approximation, ties corrected */
+static double
+mann_whitney (const series_t *worse, const series_t *other)
+{
+  double n1 = worse->n, n2 = other->n, u = 0, ties = 0;
+
+  /* u counts the pairs worse wins, a tie counts half */
+  for (size_t i = 0; i < worse->n; i++)
+    for (size_t k = 0; k < other->n; k++)
+      u += worse->v[i] > other->v[k]	 ? 1
+	   : worse->v[i] == other->v[k] ? 0.5
+					: 0;
+
+  /* each group of t equal values shrinks the variance by t^3 - t */
+  double all[2 * SAMPLES_MAX], n = n1 + n2;
+  memcpy (all, worse->v, worse->n * sizeof (double));
+  memcpy (all + worse->n, other->v, other->n * sizeof (double));
+  qsort (all, n, sizeof (double), sample_comp);
+  for (size_t i = 0, k; i < n; i = k)
+    {
+      for (k = i + 1; k < n && all[k] == all[i]; k++)
+	;
+      ties += (double) (k - i) * (k - i) * (k - i) - (k - i);
+    }
+
+  double var = n1 * n2 / 12 * (n + 1 - ties / (n * (n - 1)));
+  if (var <= 0)
+    return 1;
+
+  double z = (u - n1 * n2 / 2 - 0.5) / sqrt (var);
+  return erfc (z / sqrt (2)) / 2;
+}
+
+/* worse needs both a significant shift and one large enough to matter,
+   samples from a single run are never significant on their own */
+static int
+compare (const series_t *base, const series_t *cur, double *p)
+{
+  if (base->n < SAMPLES_MIN || cur->n < SAMPLES_MIN)
+    return VERDICT_FEW;
+
+  double bm = median (base), cm = median (cur);
+  double delta = (cm - bm) / bm * 100 * (base->higher ? -1 : 1);
+
+  /* lower ns or latency is better, higher throughput is */
+  const series_t *hi = base->higher ? base : cur;
+  const series_t *lo = base->higher ? cur : base;
+
+  if ((*p = mann_whitney (hi, lo)) < opt.alpha && delta >= opt.threshold)
+    return VERDICT_WORSE;
+
+  double q = mann_whitney (lo, hi);
+  if (q < opt.alpha && -delta >= opt.threshold)
+    {
+      *p = q;
+      return VERDICT_BETTER;
+    }
+
+  return VERDICT_OK;
+}
@@ -0,0 +1,20 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+/* usdt probes under the httpd provider, a nop until perf or bpftrace
+   attaches; without sys/sdt.h, or with NO_PROBES, they compile away */
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HTTPD_PROBES 1
+#endif
+#endif
+
+/* arguments must be integers or pointers, at most twelve */
+#ifdef HTTPD_PROBES
+#define probe(name, ...) STAP_PROBEV (httpd, name, ##__VA_ARGS__)
+#else
+#define probe(name, ...) ((void) 0)
+#endif
+
+#endif
@@ -0,0 +1,599 @@
+#include "proxy.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+
+#define STR(s) s, sizeof (s) - 1
+
+enum
+{
+  CHUNK_SIZE,
+  CHUNK_TAIL,
+  CHUNK_TRAILER,
+};
+
+typedef struct proxy_pool_t proxy_pool_t;
+
+/* idle connections of one worker, reused last in first out */
+struct proxy_pool_t
+{
+  size_t cnt;
+  proxy_conn_t *conns[];
+};
+
+static void pool_free (void *arg);
+static void conn_free (proxy_conn_t *conn);
+static int conn_connect (proxy_t *px);
+static ssize_t conn_recv (proxy_conn_t *conn, void *buf, size_t len);
+static ssize_t conn_fill (proxy_conn_t *conn);
+static int conn_chunk (proxy_conn_t *conn);
+static bool has_token (const char *value, size_t len, const char *token);
+static int parse_addr (proxy_t *px, const char *upstream);
+static int parse_head (proxy_conn_t *conn, char *pos, char *end, bool head);
+
+void
+proxy_free (proxy_t *px)
+{
+  pthread_key_delete (px->pool);
+}
+
+int
+proxy_init (proxy_t *px, const char *upstream, int connect_timeout,
+	    int timeout, size_t idle)
+{
+  px->idle = idle;
+  px->timeout = timeout;
+  px->connect_timeout = connect_timeout;
+
+  if (parse_addr (px, upstream) != 0)
+    return -1;
+
+  /* each worker closes its idle connections when it exits */
+  return pthread_key_create (&px->pool, pool_free) == 0 ? 0 : -1;
+}
+
+proxy_conn_t *
+proxy_open (proxy_t *px)
+{
+  char c;
+  proxy_conn_t *conn;
+  proxy_pool_t *pool = pthread_getspecific (px->pool);
+
+  while (pool && pool->cnt)
+    {
+      conn = pool->conns[--pool->cnt];
+
+      /* an idle connection has nothing to say but EOF */
+      if (recv (conn->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1
+	  && errno == EAGAIN)
+	{
+	  conn->reused = true;
+	  goto reset;
+	}
+
+      conn_free (conn);
+    }
+
+  if (!(conn = malloc (sizeof (proxy_conn_t))))
+    return NULL;
+
+  if (!(conn->buf = malloc (PROXY_HEAD_MAX)))
+    goto clean_conn;
+
+  if ((conn->sock = conn_connect (px)) == -1)
+    goto clean_buf;
+
+  conn->proxy = px;
+  conn->reused = false;
+
+reset:
+  conn->pos = conn->len = 0;
+  conn->keep = true;
+  conn->status = 0;
+  conn->cnt = 0;
+  conn->body = PROXY_BODY_NONE;
+  conn->state = CHUNK_SIZE;
+  conn->done = false;
+  conn->length = -1;
+  conn->remain = 0;
+  return conn;
+
+clean_buf:
+  free (conn->buf);
+
+clean_conn:
+  free (conn);
+  return NULL;
+}
+
+void
+proxy_close (void *arg)
+{
+  proxy_conn_t *conn = arg;
+  proxy_release (conn, conn->done);
+}
+
+void
+proxy_release (void *arg, bool done)
+{
+  proxy_conn_t *conn = arg;
+  proxy_t *px = conn->proxy;
+  proxy_pool_t *pool = pthread_getspecific (px->pool);
+
+  /* only a cleanly finished exchange leaves the stream in sync */
+  if (!done || !conn->keep || conn->pos != conn->len)
+    return conn_free (conn);
+
+  if (!pool)
+    {
+      size_t size = sizeof (proxy_pool_t) + px->idle * sizeof (proxy_conn_t *);
+      if (!(pool = malloc (size)) || pthread_setspecific (px->pool, pool) != 0)
+	{
+	  free (pool);
+	  return conn_free (conn);
+	}
+      pool->cnt = 0;
+    }
+
+  if (pool->cnt == px->idle)
+    return conn_free (conn);
+
+  pool->conns[pool->cnt++] = conn;
+}
+
+bool
+proxy_send (proxy_conn_t *conn, const void *data, size_t len)
+{
+  for (ssize_t n; len; data = (const char *) data + n, len -= n)
+    if ((n = send (conn->sock, data, len, MSG_NOSIGNAL)) == -1)
+      {
+	if (errno == EAGAIN)
+	  errno = ETIMEDOUT;
+	return false;
+      }
+
+  return true;
+}
+
+int
+proxy_head (proxy_conn_t *conn, bool head)
+{
+  for (char *pos, *end;;)
+    {
+      pos = conn->buf + conn->pos;
+      if (!(end = memmem (pos, conn->len - conn->pos, STR ("\r\n\r\n"))))
+	{
+	  if (conn_fill (conn) <= 0)
+	    return -1;
+	  continue;
+	}
+
+      int ret = parse_head (conn, pos, end + 2, head);
+      conn->pos = end + 4 - conn->buf;
+
+      /* interim responses are ours to swallow */
+      if (ret == 1)
+	continue;
+
+      return ret;
+    }
+}
+
+ssize_t
+proxy_read (void *arg, void *dst, size_t max)
+{
+  ssize_t n;
+  proxy_conn_t *conn = arg;
+
+  while (!conn->done)
+    {
+      if (conn->body == PROXY_BODY_CHUNKED && !conn->remain)
+	{
+	  if ((n = conn_chunk (conn)) == -1)
+	    return -1;
+	  if (!n && conn_fill (conn) <= 0)
+	    return -1;
+	  continue;
+	}
+
+      if (conn->body != PROXY_BODY_CLOSE && max > conn->remain)
+	max = conn->remain;
+
+      /* bytes that came with the head first, then the socket */
+      size_t avail = conn->len - conn->pos;
+      if (avail)
+	{
+	  n = avail < max ? avail : max;
+	  memcpy (dst, conn->buf + conn->pos, n);
+	  conn->pos += n;
+	}
+      else if ((n = conn_recv (conn, dst, max)) <= 0)
+	{
+	  if (n == 0 && conn->body == PROXY_BODY_CLOSE)
+	    {
+	      conn->done = true;
+	      return 0;
+	    }
+
+	  if (n == 0)
+	    errno = ECONNRESET;
+	  return -1;
+	}
+
+      if (conn->body == PROXY_BODY_CLOSE)
+	return n;
+
+      conn->remain -= n;
+      if (conn->body == PROXY_BODY_LENGTH && !conn->remain)
+	conn->done = true;
+
+      return n;
+    }
+
+  return 0;
+}
+
+static void
+pool_free (void *arg)
+{
+  proxy_pool_t *pool = arg;
+
+  for (size_t i = 0; i < pool->cnt; i++)
+    conn_free (pool->conns[i]);
+
+  free (pool);
+}
+
+static void
+conn_free (proxy_conn_t *conn)
+{
+  close (conn->sock);
+  free (conn->buf);
+  free (conn);
+}
+
+static int
+conn_connect (proxy_t *px)
+{
+  int sock, err;
+  socklen_t len = sizeof (err);
+  struct pollfd pfd = { .events = POLLOUT };
+  int family = px->addr.ss_family;
+
+  if ((sock = socket (family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))
+      == -1)
+    return -1;
+
+  /* bounded by the connect timeout, then blocking with I/O timeouts */
+  if (connect (sock, (void *) &px->addr, px->len) != 0)
+    {
+      if (errno != EINPROGRESS)
+	goto clean_sock;
+
+      pfd.fd = sock;
+      if ((err = poll (&pfd, 1, px->connect_timeout)) <= 0)
+	{
+	  if (err == 0)
+	    errno = ETIMEDOUT;
+	  goto clean_sock;
+	}
+
+      if (getsockopt (sock, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+	goto clean_sock;
+
+      if (err)
+	{
+	  errno = err;
+	  goto clean_sock;
+	}
+    }
+
+  struct timeval tv = {
+    .tv_sec = px->timeout / 1000,
+    .tv_usec = px->timeout % 1000 * 1000,
+  };
+
+  if (fcntl (sock, F_SETFL, 0) != 0
+      || setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) != 0
+      || setsockopt (sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv)) != 0)
+    goto clean_sock;
+
+  if (family != AF_UNIX)
+    {
+      int opt = true;
+      setsockopt (sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof (opt));
+    }
+
+  return sock;
+
+clean_sock:
+  err = errno;
+  close (sock);
+  errno = err;
+  return -1;
+}
+
+static ssize_t
+conn_recv (proxy_conn_t *conn, void *buf, size_t len)
+{
+  ssize_t n;
+
+  /* the receive timeout surfaces as EAGAIN on a blocking socket */
+  if ((n = recv (conn->sock, buf, len, 0)) == -1 && errno == EAGAIN)
+    errno = ETIMEDOUT;
+
+  return n;
+}
+
+static ssize_t
+conn_fill (proxy_conn_t *conn)
+{
+  ssize_t n;
+
+  /* keep the unread tail at the front */
+  if (conn->pos)
+    {
+      conn->len -= conn->pos;
+      memmove (conn->buf, conn->buf + conn->pos, conn->len);
+      conn->pos = 0;
+    }
+
+  if (conn->len == PROXY_HEAD_MAX)
+    {
+      errno = EPROTO;
+      return -1;
+    }
+
+  n = conn_recv (conn, conn->buf + conn->len, PROXY_HEAD_MAX - conn->len);
+  if (n > 0)
+    conn->len += n;
+  else if (n == 0)
+    errno = ECONNRESET;
+
+  return n;
+}
+
+static int
+conn_chunk (proxy_conn_t *conn)
+{
+  size_t size = 0;
+  char *line = conn->buf + conn->pos, *eol, *pos;
+
+  /* framing lines are handled whole, 0 asks for more input */
+  if (!(eol = memchr (line, '\n', conn->len - conn->pos)))
+    return 0;
+
+  conn->pos = eol + 1 - conn->buf;
+  if (eol > line && eol[-1] == '\r')
+    eol--;
+
+  switch (conn->state)
+    {
+    case CHUNK_TAIL:
+      conn->state = CHUNK_SIZE;
+      if (eol == line)
+	return 1;
+      break;
+
+    case CHUNK_SIZE:
+      for (pos = line; pos < eol && isxdigit ((unsigned char) *pos); pos++)
+	{
+	  if (size > SIZE_MAX >> 4)
+	    break;
+	  int digit = *pos <= '9' ? *pos - '0' : (*pos | 32) - 'a' + 10;
+	  size = size << 4 | digit;
+	}
+
+      /* extensions after ';' are ignored */
+      if (pos == line || (pos < eol && !strchr ("; \t", *pos)))
+	break;
+
+      conn->remain = size;
+      conn->state = size ? CHUNK_TAIL : CHUNK_TRAILER;
+      return 1;
+
+    case CHUNK_TRAILER:
+      /* trailer fields are dropped */
+      if (eol == line)
+	conn->done = true;
+      return 1;
+    }
+
+  errno = EPROTO;
+  return -1;
+}
+
+static bool
+has_token (const char *value, size_t len, const char *token)
+{
+  size_t n = strlen (token);
+
+  for (size_t i = 0; i + n <= len; i++)
+    if (strncasecmp (value + i, token, n) == 0)
+      return true;
+
+  return false;
+}
+
+static int
+parse_addr (proxy_t *px, const char *upstream)
+{
+  struct addrinfo *res;
+  struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+
+  memset (&px->addr, 0, sizeof (px->addr));
+
+  /* "unix:/path" or "host:port", IPv6 hosts in brackets */
+  if (strncmp (upstream, "unix:", 5) == 0)
+    {
+      struct sockaddr_un *un = (void *) &px->addr;
+      const char *path = upstream + 5;
+      size_t len = strlen (path);
+
+      if (!len || len >= sizeof (un->sun_path))
+	return -1;
+
+      un->sun_family = AF_UNIX;
+      memcpy (un->sun_path, path, len + 1);
+      px->len = sizeof (*un);
+      return 0;
+    }
+
+  const char *sep = strrchr (upstream, ':');
+  if (!sep || !sep[1])
+    return -1;
+
+  size_t len = sep - upstream;
+  if (len >= 2 && upstream[0] == '[' && upstream[len - 1] == ']')
+    upstream++, len -= 2;
+
+  char host[256];
+  if (!len || len >= sizeof (host))
+    return -1;
+
+  memcpy (host, upstream, len);
+  host[len] = '\0';
+
+  if (getaddrinfo (host, sep + 1, &hints, &res) != 0)
+    return -1;
+
+  memcpy (&px->addr, res->ai_addr, res->ai_addrlen);
+  px->len = res->ai_addrlen;
+  freeaddrinfo (res);
+  return 0;
+}
+
+static int
+parse_head (proxy_conn_t *conn, char *pos, char *end, bool head)
+{
+  char *eol;
+  bool te = false, chunked = false;
+
+  /* HTTP/1.x SP 3DIGIT SP reason */
+  eol = memchr (pos, '\r', end - pos);
+  if (eol - pos < 12 || strncmp (pos, "HTTP/1.", 7) != 0 || pos[8] != ' '
+      || !isdigit ((unsigned char) pos[9]) || !isdigit ((unsigned char) pos[10])
+      || !isdigit ((unsigned char) pos[11]))
+    goto proto;
+
+  conn->keep = pos[7] == '1';
+  conn->status = (pos[9] - '0') * 100 + (pos[10] - '0') * 10 + pos[11] - '0';
+  conn->reason = pos + 12 + (pos[12] == ' ');
+  conn->reason_len = eol - conn->reason;
+
+  /* no tunnels through the proxy */
+  if (conn->status == 101)
+    goto proto;
+
+  if (conn->status / 100 == 1)
+    return 1;
+
+  conn->cnt = 0;
+  conn->length = -1;
+
+  for (pos = eol + 2; pos < end; pos = eol + 2)
+    {
+      char *sep, *value;
+
+      eol = memchr (pos, '\r', end - pos);
+      if (!(sep = memchr (pos, ':', eol - pos)) || sep == pos)
+	goto proto;
+
+      size_t name_len = sep - pos;
+      for (char *c = pos; c < sep; c++)
+	*c = tolower ((unsigned char) *c);
+
+      for (value = sep + 1; value < eol && (*value == ' ' || *value == '\t');)
+	value++;
+
+      size_t len = eol - value;
+      while (len && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+	len--;
+
+#define is(name) (name_len == sizeof (name) - 1 && memcmp (pos, STR (name)) == 0)
+
+      if (is ("content-length"))
+	{
+	  size_t n = 0;
+	  if (!len || len > 18)
+	    goto proto;
+
+	  for (size_t i = 0; i < len; i++)
+	    {
+	      if (!isdigit ((unsigned char) value[i]))
+		goto proto;
+	      n = n * 10 + (value[i] - '0');
+	    }
+
+	  if (conn->length != -1 && (size_t) conn->length != n)
+	    goto proto;
+	  conn->length = n;
+	}
+
+      else if (is ("transfer-encoding"))
+	{
+	  te = true;
+	  chunked = len >= 7 && strncasecmp (value + len - 7, "chunked", 7) == 0;
+	}
+
+      else if (is ("connection"))
+	{
+	  if (has_token (value, len, "close"))
+	    conn->keep = false;
+	  else if (has_token (value, len, "keep-alive"))
+	    conn->keep = true;
+	}
+
+      /* the other hop-by-hop fields stop here as well */
+      else if (!is ("keep-alive") && !is ("proxy-connection") && !is ("te")
+	       && !is ("trailer") && !is ("upgrade"))
+	{
+	  if (conn->cnt == PROXY_FIELDS)
+	    goto proto;
+
+	  conn->fields[conn->cnt++] = (proxy_field_t) {
+	    pos, name_len, value, len
+	  };
+	}
+
+#undef is
+    }
+
+  /* framing decides whether the connection can be kept */
+  if (te)
+    conn->length = -1;
+
+  if (head || conn->status == 204 || conn->status == 304)
+    conn->body = PROXY_BODY_NONE;
+  else if (te)
+    conn->body = chunked ? PROXY_BODY_CHUNKED : PROXY_BODY_CLOSE;
+  else if (conn->length > 0)
+    conn->body = PROXY_BODY_LENGTH;
+  else if (conn->length == 0)
+    conn->body = PROXY_BODY_NONE;
+  else
+    conn->body = PROXY_BODY_CLOSE;
+
+  if (conn->body == PROXY_BODY_CLOSE)
+    conn->keep = false;
+
+  conn->state = CHUNK_SIZE;
+  conn->remain = conn->body == PROXY_BODY_LENGTH ? (size_t) conn->length : 0;
+  conn->done = conn->body == PROXY_BODY_NONE;
+  return 0;
+
+proto:
+  errno = EPROTO;
+  return -1;
+}
@@ -0,0 +1,91 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define PROXY_HEAD_MAX 8192
+#define PROXY_FIELDS 48
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+enum
+{
+  PROXY_BODY_NONE,
+  PROXY_BODY_LENGTH,
+  PROXY_BODY_CHUNKED,
+  PROXY_BODY_CLOSE,
+};
+
+typedef struct proxy_t proxy_t;
+typedef struct proxy_conn_t proxy_conn_t;
+typedef struct proxy_field_t proxy_field_t;
+
+struct proxy_t
+{
+  socklen_t len;
+  struct sockaddr_storage addr;
+
+  int timeout;
+  int connect_timeout;
+
+  size_t idle;
+  pthread_key_t pool;
+};
+
+struct proxy_field_t
+{
+  const char *name;
+  size_t name_len;
+  const char *value;
+  size_t value_len;
+};
+
+/* one upstream connection, borrowed for a single exchange */
+struct proxy_conn_t
+{
+  int sock;
+  bool keep;
+  bool reused;
+  proxy_t *proxy;
+
+  char *buf;
+  size_t pos;
+  size_t len;
+
+  int status;
+  const char *reason;
+  size_t reason_len;
+  size_t cnt;
+  proxy_field_t fields[PROXY_FIELDS];
+
+  int body;
+  int state;
+  bool done;
+  ssize_t length;
+  size_t remain;
+};
+
+extern void proxy_free (proxy_t *px) attr_nonnull (1);
+
+extern int proxy_init (proxy_t *px, const char *upstream, int connect_timeout,
+		       int timeout, size_t idle) attr_nonnull (1, 2);
+
+extern proxy_conn_t *proxy_open (proxy_t *px) attr_nonnull (1);
+
+extern void proxy_close (void *arg) attr_nonnull (1);
+
+extern void proxy_release (void *arg, bool done) attr_nonnull (1);
+
+extern bool proxy_send (proxy_conn_t *conn, const void *data, size_t len)
+    attr_nonnull (1);
+
+extern int proxy_head (proxy_conn_t *conn, bool head) attr_nonnull (1);
+
+extern ssize_t proxy_read (void *arg, void *dst, size_t max)
+    attr_nonnull (1, 2);
+
+#endif
@@ -0,0 +1,511 @@
+#include "response.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* room for the chunk size line in front of a block */
+#define CHUNK_HEAD 16
+
+static response_seg_t *seg_push (response_t *res, int type, size_t len);
+
+static ssize_t flush_iov (response_t *res, int sock, SSL *ssl);
+static ssize_t flush_file (response_t *res, int sock, SSL *ssl, size_t max);
+static ssize_t flush_stream (response_t *res, int sock, SSL *ssl);
+static ssize_t flush_splice (response_t *res, int sock, SSL *ssl, size_t max);
+
+void
+response_free (response_t *res)
+{
+  for (size_t i = res->head; i < res->size; i++)
+    response_seg_free (&res->segs[i]);
+
+  free (res->segs);
+  free (res->buf.data);
+  free (res->carry.data);
+
+  if (res->pipe.open)
+    {
+      close (res->pipe.fds[0]);
+      close (res->pipe.fds[1]);
+    }
+
+  *res = RESPONSE_INIT;
+}
+
+void
+response_seg_free (response_seg_t *seg)
+{
+  switch (seg->type)
+    {
+    case RESPONSE_SEG_BLOB:
+      respool_blob_put (seg->blob);
+      break;
+
+    case RESPONSE_SEG_FILE:
+      respool_put (seg->file.res);
+      break;
+
+    case RESPONSE_SEG_STREAM:
+      if (seg->stream.close)
+	seg->stream.close (seg->stream.arg);
+      break;
+
+    case RESPONSE_SEG_SPLICE:
+      seg->splice.release (seg->splice.arg, seg->off == seg->len);
+      break;
+    }
+}
+
+void
+response_rewind (response_t *res, response_mark_t mark)
+{
+  for (size_t i = mark.size; i < res->size; i++)
+    response_seg_free (&res->segs[i]);
+
+  res->size = mark.size;
+  res->buf.len = mark.len;
+
+  /* undo copies merged into the last kept segment */
+  response_seg_t *seg;
+  seg = res->size > res->head ? &res->segs[res->size - 1] : NULL;
+  if (seg && seg->type == RESPONSE_SEG_COPY && seg->pos + seg->len > mark.len)
+    seg->len = mark.len - seg->pos;
+}
+
+bool
+response_add_ref (response_t *res, const void *data, size_t len)
+{
+  response_seg_t *seg;
+
+  if (!len)
+    return true;
+
+  if (!(seg = seg_push (res, RESPONSE_SEG_REF, len)))
+    return false;
+
+  seg->ref = data;
+  return true;
+}
+
+bool
+response_add_copy (response_t *res, const void *data, size_t len)
+{
+  response_seg_t *seg;
+
+  if (!len)
+    return true;
+
+  if (res->buf.len + len > res->buf.cap)
+    {
+      char *buf;
+      size_t cap = res->buf.cap ? res->buf.cap : 256;
+
+      for (; cap < res->buf.len + len;)
+	cap <<= 1;
+
+      if (!(buf = realloc (res->buf.data, cap)))
+	return false;
+
+      res->buf.data = buf;
+      res->buf.cap = cap;
+    }
+
+  /* extend the previous copy when contiguous */
+  seg = res->size > res->head ? &res->segs[res->size - 1] : NULL;
+  if (seg && seg->type == RESPONSE_SEG_COPY
+      && seg->pos + seg->len == res->buf.len)
+    seg->len += len;
+  else if ((seg = seg_push (res, RESPONSE_SEG_COPY, len)))
+    seg->pos = res->buf.len;
+  else
+    return false;
+
+  memcpy (res->buf.data + res->buf.len, data, len);
+  res->buf.len += len;
+  return true;
+}
+
+bool
+response_add_blob (response_t *res, resource_blob_t *blob, size_t off,
+		   size_t len)
+{
+  response_seg_t *seg;
+
+  if (!len || !(seg = seg_push (res, RESPONSE_SEG_BLOB, len)))
+    {
+      respool_blob_put (blob);
+      return !len;
+    }
+
+  seg->blob = blob;
+  seg->off = off;
+  seg->len += off;
+  return true;
+}
+
+bool
+response_add_file (response_t *res, resource_t *file, int fd, off_t off,
+		   size_t len)
+{
+  response_seg_t *seg;
+
+  if (!len || !(seg = seg_push (res, RESPONSE_SEG_FILE, len)))
+    {
+      respool_put (file);
+      return !len;
+    }
+
+  seg->file.fd = fd;
+  seg->file.pos = off;
+  seg->file.res = file;
+  return true;
+}
+
+bool
+response_add_stream (response_t *res, response_read_t *read,
+		     response_close_t *close, void *arg, bool chunked)
+{
+  response_seg_t *seg;
+
+  if (!res->carry.data
+      && !(res->carry.data = malloc (RESPONSE_BLOCK_SIZE + CHUNK_HEAD + 2)))
+    goto err;
+
+  if (!(seg = seg_push (res, RESPONSE_SEG_STREAM, 0)))
+    goto err;
+
+  seg->stream.arg = arg;
+  seg->stream.read = read;
+  seg->stream.close = close;
+  seg->stream.chunked = chunked;
+  seg->stream.done = false;
+  return true;
+
+err:
+  if (close)
+    close (arg);
+  return false;
+}
+
+bool
+response_add_splice (response_t *res, int fd, size_t len,
+		     response_release_t *release, void *arg)
+{
+  response_seg_t *seg;
+
+  if (!len || !(seg = seg_push (res, RESPONSE_SEG_SPLICE, len)))
+    {
+      release (arg, !len);
+      return !len;
+    }
+
+  seg->splice.fd = fd;
+  seg->splice.arg = arg;
+  seg->splice.release = release;
+  return true;
+}
+
+int
+response_flush (response_t *res, int sock, SSL *ssl, size_t chunk,
+		size_t quota)
+{
+  for (ssize_t n; response_pending (res);)
+    {
+      /* yield the caller to other connections */
+      if (!quota)
+	return RESPONSE_AGAIN;
+
+      switch (res->segs[res->head].type)
+	{
+	case RESPONSE_SEG_FILE:
+	  n = flush_file (res, sock, ssl, chunk < quota ? chunk : quota);
+	  break;
+
+	case RESPONSE_SEG_STREAM:
+	  n = flush_stream (res, sock, ssl);
+	  break;
+
+	case RESPONSE_SEG_SPLICE:
+	  n = flush_splice (res, sock, ssl, chunk < quota ? chunk : quota);
+	  break;
+
+	default:
+	  n = flush_iov (res, sock, ssl);
+	  break;
+	}
+
+      if (n < 0)
+	return errno == EAGAIN ? RESPONSE_AGAIN : RESPONSE_ERROR;
+
+      /* short write, the socket buffer is full */
+      if (n == 0)
+	return RESPONSE_AGAIN;
+
+      quota -= (size_t) n < quota ? (size_t) n : quota;
+    }
+
+  res->head = res->size = 0;
+  res->buf.len = 0;
+  return RESPONSE_DONE;
+}
+
+static inline response_seg_t *
+seg_push (response_t *res, int type, size_t len)
+{
+  if (res->size >= res->cap)
+    {
+      response_seg_t *segs;
+      size_t cap = res->cap ? res->cap * 2 : 16;
+
+      if (!(segs = realloc (res->segs, cap * sizeof (response_seg_t))))
+	return NULL;
+
+      res->segs = segs;
+      res->cap = cap;
+    }
+
+  response_seg_t *seg = &res->segs[res->size++];
+  *seg = (response_seg_t) { .type = type, .len = len };
+  return seg;
+}
+
+static inline bool
+seg_memory (const response_seg_t *seg)
+{
+  return seg->type == RESPONSE_SEG_REF || seg->type == RESPONSE_SEG_COPY
+	 || seg->type == RESPONSE_SEG_BLOB;
+}
+
+static inline ssize_t
+flush_iov (response_t *res, int sock, SSL *ssl)
+{
+  int cnt = 0, flags = 0;
+  size_t i = res->head, total = 0;
+  struct iovec iov[RESPONSE_IOV_MAX];
+
+  /* gather the run of memory segments */
+  for (; i < res->size && cnt < RESPONSE_IOV_MAX; i++, cnt++)
+    {
+      const char *base;
+      response_seg_t *seg = &res->segs[i];
+
+      if (!seg_memory (seg))
+	break;
+
+      if (seg->type == RESPONSE_SEG_REF)
+	base = seg->ref;
+      else if (seg->type == RESPONSE_SEG_COPY)
+	base = res->buf.data + seg->pos;
+      else
+	base = seg->blob->data;
+
+      iov[cnt].iov_base = (char *) base + seg->off;
+      iov[cnt].iov_len = seg->len - seg->off;
+      total += iov[cnt].iov_len;
+
+      /* userspace TLS encrypts from a bounded staging buffer */
+      if (ssl && total >= TLS_STAGE_SIZE)
+	{
+	  iov[cnt].iov_len -= total - TLS_STAGE_SIZE;
+	  total = TLS_STAGE_SIZE;
+	  i++, cnt++;
+	  break;
+	}
+    }
+
+  /* let the tail wait for the segment that follows */
+  if (i < res->size)
+    flags = MSG_MORE;
+
+  ssize_t n;
+  struct msghdr msg = { .msg_iov = iov, .msg_iovlen = cnt };
+  if (ssl)
+    n = tls_writev (ssl, iov, cnt);
+  else
+    n = sendmsg (sock, &msg, flags);
+
+  if (n == -1)
+    return -1;
+
+  /* consume what was written */
+  for (size_t left = n; left;)
+    {
+      response_seg_t *seg = &res->segs[res->head];
+      size_t rest = seg->len - seg->off;
+
+      if (left < rest)
+	{
+	  seg->off += left;
+	  break;
+	}
+
+      left -= rest;
+      response_seg_free (seg);
+      res->head++;
+    }
+
+  return (size_t) n == total ? n : 0;
+}
+
+static inline ssize_t
+flush_file (response_t *res, int sock, SSL *ssl, size_t max)
+{
+  ssize_t n;
+  response_seg_t *seg = &res->segs[res->head];
+  size_t size = seg->len - seg->off;
+  off_t pos = seg->file.pos + seg->off;
+
+  if (size > max)
+    size = max;
+
+  if (ssl && size > TLS_STAGE_SIZE)
+    size = TLS_STAGE_SIZE;
+
+  if (ssl)
+    n = tls_sendfile (ssl, seg->file.fd, pos, size);
+  else
+    n = sendfile (sock, seg->file.fd, &pos, size);
+
+  if (n <= 0)
+    {
+      /* the file shrank under us */
+      if (n == 0)
+	errno = EIO;
+      return -1;
+    }
+
+  if ((seg->off += n) == seg->len)
+    {
+      response_seg_free (seg);
+      res->head++;
+    }
+
+  return (size_t) n == size ? n : 0;
+}
+
+static inline ssize_t
+flush_stream (response_t *res, int sock, SSL *ssl)
+{
+  ssize_t n;
+  response_seg_t *seg = &res->segs[res->head];
+
+  /* produce the next block */
+  if (res->carry.off == res->carry.len)
+    {
+      if (seg->stream.done)
+	{
+	  response_seg_free (seg);
+	  res->head++;
+	  return 1;
+	}
+
+      char *data = res->carry.data + CHUNK_HEAD;
+      if ((n = seg->stream.read (seg->stream.arg, data, RESPONSE_BLOCK_SIZE))
+	  < 0)
+	{
+	  errno = EIO;
+	  return -1;
+	}
+
+      res->carry.off = CHUNK_HEAD;
+      res->carry.len = CHUNK_HEAD + n;
+      seg->stream.done = n == 0;
+
+      if (seg->stream.chunked)
+	{
+	  char line[sizeof (size_t) * 2 + 3];
+	  int len = sprintf (line, "%zx\r\n", n);
+
+	  res->carry.off -= len;
+	  memcpy (res->carry.data + res->carry.off, line, len);
+	  memcpy (res->carry.data + res->carry.len, "\r\n", 2);
+	  res->carry.len += 2;
+	}
+    }
+
+  size_t size = res->carry.len - res->carry.off;
+  int flags = seg->stream.done && res->head + 1 == res->size ? 0 : MSG_MORE;
+
+  if (!size)
+    return 1;
+
+  const char *data = res->carry.data + res->carry.off;
+  if (ssl)
+    n = tls_send (ssl, data, size);
+  else
+    n = send (sock, data, size, flags);
+
+  if (n == -1)
+    return -1;
+
+  res->carry.off += n;
+  return (size_t) n == size ? n : 0;
+}
+
+static inline ssize_t
+flush_splice (response_t *res, int sock, SSL *ssl, size_t max)
+{
+  ssize_t n;
+  response_seg_t *seg = &res->segs[res->head];
+
+  /* userspace TLS has to see the bytes */
+  if (ssl)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  if (!res->pipe.open)
+    {
+      if (pipe2 (res->pipe.fds, O_CLOEXEC) != 0)
+	return -1;
+      res->pipe.open = true;
+    }
+
+  /* refill the pipe once the socket took everything it held */
+  if (!res->pipe.len)
+    {
+      size_t size = seg->len - seg->off;
+      if (size > max)
+	size = max;
+      if (size > RESPONSE_BLOCK_SIZE)
+	size = RESPONSE_BLOCK_SIZE;
+
+      n = splice (seg->splice.fd, NULL, res->pipe.fds[1], NULL, size,
+		  SPLICE_F_MOVE);
+
+      /* the source ended early, or stalled past its receive timeout */
+      if (n <= 0)
+	{
+	  errno = n == 0 ? EIO : errno == EAGAIN ? ETIMEDOUT : errno;
+	  return -1;
+	}
+
+      res->pipe.len = n;
+    }
+
+  size_t size = res->pipe.len;
+  int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+  if (seg->off + size < seg->len || res->head + 1 < res->size)
+    flags |= SPLICE_F_MORE;
+
+  if ((n = splice (res->pipe.fds[0], NULL, sock, NULL, size, flags)) == -1)
+    return -1;
+
+  res->pipe.len -= n;
+  if ((seg->off += n) == seg->len)
+    {
+      response_seg_free (seg);
+      res->head++;
+    }
+
+  return (size_t) n == size ? n : 0;
+}
@@ -0,0 +1,151 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include "respool.h"
+#include "tls.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define RESPONSE_IOV_MAX 64
+#define RESPONSE_BLOCK_SIZE (64 << 10)
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+enum
+{
+  RESPONSE_DONE,
+  RESPONSE_AGAIN,
+  RESPONSE_ERROR,
+};
+
+enum
+{
+  RESPONSE_SEG_REF,
+  RESPONSE_SEG_COPY,
+  RESPONSE_SEG_BLOB,
+  RESPONSE_SEG_FILE,
+  RESPONSE_SEG_STREAM,
+  RESPONSE_SEG_SPLICE,
+};
+
+typedef struct response_t response_t;
+typedef struct response_seg_t response_seg_t;
+typedef struct response_mark_t response_mark_t;
+
+typedef void response_close_t (void *arg);
+typedef ssize_t response_read_t (void *arg, void *dst, size_t max);
+typedef void response_release_t (void *arg, bool done);
+
+struct response_seg_t
+{
+  int type;
+  size_t off;
+  size_t len;
+
+  union
+  {
+    size_t pos;
+    const char *ref;
+    resource_blob_t *blob;
+
+    struct
+    {
+      int fd;
+      off_t pos;
+      resource_t *res;
+    } file;
+
+    struct
+    {
+      void *arg;
+      bool done;
+      bool chunked;
+      response_read_t *read;
+      response_close_t *close;
+    } stream;
+
+    struct
+    {
+      int fd;
+      void *arg;
+      response_release_t *release;
+    } splice;
+  };
+};
+
+struct response_t
+{
+  size_t cap;
+  size_t head;
+  size_t size;
+  response_seg_t *segs;
+
+  struct
+  {
+    size_t cap;
+    size_t len;
+    char *data;
+  } buf;
+
+  struct
+  {
+    size_t off;
+    size_t len;
+    char *data;
+  } carry;
+
+  struct
+  {
+    bool open;
+    size_t len;
+    int fds[2];
+  } pipe;
+};
+
+struct response_mark_t
+{
+  size_t size;
+  size_t len;
+};
+
+#define RESPONSE_INIT                                                         \
+  (response_t) {}
+
+#define response_pending(res) ((res)->head < (res)->size)
+
+#define response_mark(res)                                                    \
+  ((response_mark_t) { .size = (res)->size, .len = (res)->buf.len })
+
+extern void response_free (response_t *res) attr_nonnull (1);
+
+extern void response_seg_free (response_seg_t *seg) attr_nonnull (1);
+
+extern void response_rewind (response_t *res, response_mark_t mark)
+    attr_nonnull (1);
+
+extern bool response_add_ref (response_t *res, const void *data, size_t len)
+    attr_nonnull (1);
+
+extern bool response_add_copy (response_t *res, const void *data, size_t len)
+    attr_nonnull (1);
+
+extern bool response_add_blob (response_t *res, resource_blob_t *blob,
+			       size_t off, size_t len) attr_nonnull (1, 2);
+
+extern bool response_add_file (response_t *res, resource_t *file, int fd,
+			       off_t off, size_t len) attr_nonnull (1, 2);
+
+extern bool response_add_stream (response_t *res, response_read_t *read,
+				 response_close_t *close, void *arg,
+				 bool chunked) attr_nonnull (1, 2);
+
+extern bool response_add_splice (response_t *res, int fd, size_t len,
+				 response_release_t *release, void *arg)
+    attr_nonnull (1, 4);
+
+extern int response_flush (response_t *res, int sock, SSL *ssl, size_t chunk,
+			   size_t quota) attr_nonnull (1);
+
+#endif
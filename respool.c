@@ -1,4 +1,5 @@
 #include "respool.h"
+#include "probe.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -7,13 +8,33 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#define timespec_equal(a, b)                                                  \
+  ((a).tv_sec == (b).tv_sec && (a).tv_nsec == (b).tv_nsec)
+
 static void node_free (rbtree_node_t *n);
 static int node_comp (const rbtree_node_t *a, const rbtree_node_t *b);
 
+static resource_t *resource_open (respool_t *pool, const char *path,
+				  const struct stat *info);
+static resource_t *resource_publish (respool_t *pool, resource_t *res);
+static void resource_probe (resource_t *res, int enc, const char *path);
+static resource_blob_t *resource_unlink (respool_t *pool, resource_t *res);
+
+static void gzip_drop (resource_blob_t *blob);
+
+const char *const resource_encodings[RESOURCE_ENC_NUM][2] = {
+  [RESOURCE_ENC_BR] = { ".br", "br" },
+  [RESOURCE_ENC_ZSTD] = { ".zst", "zstd" },
+  [RESOURCE_ENC_GZIP] = { ".gz", "gzip" },
+};
+
 int
-respool_init (respool_t *pool)
+respool_init (respool_t *pool, size_t cache, const mime_registry_t *mime)
 {
+  pool->mime = mime;
   pool->tree = RBTREE_INIT;
+  pool->count = pool->bytes = 0;
+  pool->cache = (respool_cache_t) { .max = cache, .drop = gzip_drop };
   return pthread_rwlock_init (&pool->lock, NULL);
 }
 
@@ -28,14 +49,18 @@ void
 respool_del (respool_t *pool, const char *path)
 {
   rbtree_node_t *node;
+  resource_blob_t *blob = NULL;
   resource_t target = { .path = MSTR_VIEW (path, strlen (path)) };
 
   pthread_rwlock_wrlock (&pool->lock);
   if ((node = rbtree_find (&pool->tree, &target.node, node_comp)))
-    rbtree_erase (&pool->tree, node);
+    blob = resource_unlink (pool, container_of (node, resource_t, node));
   pthread_rwlock_unlock (&pool->lock);
 
-  node_free (node);
+  if (blob)
+    respool_blob_put (blob);
+  if (node)
+    respool_put (container_of (node, resource_t, node));
 }
 
 resource_t *
@@ -45,12 +70,175 @@ respool_add (respool_t *pool, const char *path)
   if (stat (path, &info) != 0)
     return NULL;
 
+  resource_t *res;
+  if (!(res = resource_open (pool, path, &info)))
+    return NULL;
+
+  return resource_publish (pool, res);
+}
+
+resource_t *
+respool_get (respool_t *pool, const char *path)
+{
+  resource_t *res = NULL;
+  resource_t target = { .path = MSTR_VIEW (path, strlen (path)) };
+
+  pthread_rwlock_rdlock (&pool->lock);
+  rbtree_node_t *node = rbtree_find (&pool->tree, &target.node, node_comp);
+  if (node)
+    {
+      res = container_of (node, resource_t, node);
+      __atomic_fetch_add (&res->refs, 1, __ATOMIC_RELAXED);
+    }
+  pthread_rwlock_unlock (&pool->lock);
+
+  if (!res)
+    {
+      probe (respool_miss, path);
+      return respool_add (pool, path);
+    }
+
+  struct stat info;
+  if (stat (path, &info) != 0)
+    return (respool_put (res), NULL);
+
+  if (timespec_equal (res->mtime, info.st_mtim))
+    {
+      probe (respool_hit, path, res->size);
+      return res;
+    }
+
+  /* publish a new version, the old one lives on until its last put */
+  resource_t *old = res;
+  probe (respool_update, path, old->size, (size_t) info.st_size);
+  if ((res = resource_open (pool, path, &info)))
+    res = resource_publish (pool, res);
+
+  respool_put (old);
+  return res;
+}
+
+void
+respool_put (resource_t *res)
+{
+  if (__atomic_sub_fetch (&res->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    node_free (&res->node);
+}
+
+resource_t *
+respool_hold (resource_t *res)
+{
+  __atomic_fetch_add (&res->refs, 1, __ATOMIC_RELAXED);
+  return res;
+}
+
+int
+respool_select (const resource_t *res, int accept)
+{
+  int best = -1;
+  size_t size = res->size;
+
+  if (!(accept &= res->encs))
+    return best;
+
+  /* smallest acceptable variant wins */
+  for (int i = 0; i < RESOURCE_ENC_NUM; i++)
+    if ((accept & (1 << i)) && res->variants[i].size < size)
+      {
+	size = res->variants[i].size;
+	best = i;
+      }
+
+  return best;
+}
+
+resource_blob_t *
+respool_blob_new (size_t cap)
+{
+  resource_blob_t *blob;
+  if (!(blob = malloc (sizeof (resource_blob_t) + cap)))
+    return NULL;
+
+  *blob = (resource_blob_t) { .refs = 1 };
+  return blob;
+}
+
+void
+respool_blob_put (resource_blob_t *blob)
+{
+  if (__atomic_sub_fetch (&blob->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    free (blob);
+}
+
+resource_blob_t *
+respool_blob_hold (resource_blob_t *blob)
+{
+  __atomic_fetch_add (&blob->refs, 1, __ATOMIC_RELAXED);
+  return blob;
+}
+
+resource_blob_t *
+respool_blob_get (respool_t *pool, resource_t *res)
+{
+  resource_blob_t *blob;
+
+  pthread_rwlock_rdlock (&pool->lock);
+  if ((blob = res->gzip))
+    {
+      __atomic_fetch_add (&blob->refs, 1, __ATOMIC_RELAXED);
+      __atomic_store_n (&blob->used, 1, __ATOMIC_RELAXED);
+    }
+  pthread_rwlock_unlock (&pool->lock);
+
+  return blob;
+}
+
+resource_blob_t *
+respool_blob_set (respool_t *pool, resource_t *res, resource_blob_t *blob)
+{
+  resource_blob_t *victims = NULL, *old = NULL;
+
+  pthread_rwlock_wrlock (&pool->lock);
+  if (res->gzip)
+    { /* lost the race, share the cached one */
+      old = blob;
+      blob = res->gzip;
+      __atomic_fetch_add (&blob->refs, 1, __ATOMIC_RELAXED);
+    }
+  else if (!res->stale && blob->size <= pool->cache.max)
+    {
+      victims = respool_cache_evict (&pool->cache, blob->size);
+      blob->owner = res;
+      blob->refs++;
+      res->gzip = blob;
+      respool_cache_link (&pool->cache, blob);
+    }
+  pthread_rwlock_unlock (&pool->lock);
+
+  for (resource_blob_t *next; victims; victims = next)
+    {
+      next = victims->next;
+      respool_blob_put (victims);
+    }
+
+  if (old)
+    respool_blob_put (old);
+  return blob;
+}
+
+static inline resource_t *
+resource_open (respool_t *pool, const char *path, const struct stat *info)
+{
   resource_t *res;
   if (!(res = malloc (sizeof (resource_t))))
     return NULL;
 
-  res->size = info.st_size;
-  res->mtime = info.st_mtim;
+  /* owned by the tree */
+  res->refs = 1;
+  res->gzip = NULL;
+  res->stale = false;
+  res->size = info->st_size;
+  res->mtime = info->st_mtim;
 
   int fd = open (path, O_RDONLY);
   if ((res->fd = fd) == -1)
@@ -60,16 +248,15 @@ respool_add (respool_t *pool, const char *path)
   if (!mstr_assign_cstr (&res->path, path))
     goto clean_fd;
 
-  pthread_rwlock_wrlock (&pool->lock);
-  bool ok = rbtree_insert (&pool->tree, &res->node, node_comp);
-  pthread_rwlock_unlock (&pool->lock);
+  /* resolve the type once per version, a pool without types serves none */
+  res->mime = pool->mime ? mime_find (pool->mime, path) : NULL;
 
-  if (!ok)
-    goto clean_path;
-  return res;
+  /* sidecars are resolved once per version */
+  res->encs = 0;
+  for (int i = 0; i < RESOURCE_ENC_NUM; i++)
+    resource_probe (res, i, path);
 
-clean_path:
-  mstr_free (&res->path);
+  return res;
 
 clean_fd:
   close (fd);
@@ -79,52 +266,103 @@ clean_res:
   return NULL;
 }
 
-#define timespec_equal(a, b)                                                  \
-  ((a).tv_sec == (b).tv_sec && (a).tv_nsec == (b).tv_nsec)
-
 static inline resource_t *
-resource_update (resource_t *res, const char *path, struct stat info)
+resource_publish (respool_t *pool, resource_t *res)
 {
-  int nfd = open (path, O_RDONLY);
-  if (nfd == -1)
-    return NULL;
+  rbtree_node_t *node;
+  resource_t *old = NULL;
+  resource_blob_t *blob = NULL;
 
-  close (res->fd);
+  pthread_rwlock_wrlock (&pool->lock);
+  if ((node = rbtree_find (&pool->tree, &res->node, node_comp)))
+    {
+      old = container_of (node, resource_t, node);
+
+      if (timespec_equal (old->mtime, res->mtime))
+	{ /* lost the race to an identical version */
+	  resource_t *tmp = old;
+	  old = res;
+	  res = tmp;
+	  goto ret;
+	}
 
-  res->mtime = info.st_mtim;
-  res->size = info.st_size;
-  res->fd = nfd;
+      blob = resource_unlink (pool, old);
+    }
+  rbtree_insert (&pool->tree, &res->node, node_comp);
+  __atomic_store_n (&pool->count, pool->count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n (&pool->bytes, pool->bytes + res->size, __ATOMIC_RELAXED);
+
+ret:
+  __atomic_fetch_add (&res->refs, 1, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock (&pool->lock);
 
+  if (blob)
+    respool_blob_put (blob);
+  if (old)
+    respool_put (old);
   return res;
 }
 
-resource_t *
-respool_get (respool_t *pool, const char *path)
+/* called with the write lock held */
+static inline resource_blob_t *
+resource_unlink (respool_t *pool, resource_t *res)
 {
-  resource_t target = { .path = MSTR_VIEW (path, strlen (path)) };
+  resource_blob_t *blob;
 
-  pthread_rwlock_rdlock (&pool->lock);
-  rbtree_node_t *node = rbtree_find (&pool->tree, &target.node, node_comp);
-  pthread_rwlock_unlock (&pool->lock);
+  rbtree_erase (&pool->tree, &res->node);
+  res->stale = true;
+
+  __atomic_store_n (&pool->count, pool->count - 1, __ATOMIC_RELAXED);
+  __atomic_store_n (&pool->bytes, pool->bytes - res->size, __ATOMIC_RELAXED);
+
+  if ((blob = res->gzip))
+    respool_cache_unlink (&pool->cache, blob);
 
-  if (!node)
-    return respool_add (pool, path);
+  return blob;
+}
 
+static inline void
+resource_probe (resource_t *res, int enc, const char *path)
+{
   struct stat info;
-  if (stat (path, &info) != 0)
-    return NULL;
+  resource_variant_t *var = &res->variants[enc];
+  const char *suffix = resource_encodings[enc][0];
 
-  resource_t *res = container_of (node, resource_t, node);
-  if (!timespec_equal (res->mtime, info.st_mtim))
-    res = resource_update (res, path, info);
+  size_t path_len = mstr_len (&res->path);
+  char *side = alloca (path_len + strlen (suffix) + 1);
 
-  return res;
+  memcpy (side, path, path_len);
+  strcpy (side + path_len, suffix);
+  var->fd = -1;
+
+  if (stat (side, &info) != 0 || !S_ISREG (info.st_mode))
+    return;
+
+  /* ignore sidecars older than the original */
+  if (info.st_mtim.tv_sec < res->mtime.tv_sec
+      || (info.st_mtim.tv_sec == res->mtime.tv_sec
+	  && info.st_mtim.tv_nsec < res->mtime.tv_nsec))
+    return;
+
+  if ((var->fd = open (side, O_RDONLY)) == -1)
+    return;
+
+  var->size = info.st_size;
+  res->encs |= 1 << enc;
 }
 
 static inline void
 node_free (rbtree_node_t *n)
 {
   resource_t *rn = container_of (n, resource_t, node);
+
+  for (int i = 0; i < RESOURCE_ENC_NUM; i++)
+    if (rn->encs & (1 << i))
+      close (rn->variants[i].fd);
+
+  if (rn->gzip)
+    respool_blob_put (rn->gzip);
+
   mstr_free (&rn->path);
   close (rn->fd);
   free (rn);
@@ -137,3 +375,71 @@ node_comp (const rbtree_node_t *a, const rbtree_node_t *b)
   resource_t *rb = container_of (b, resource_t, node);
   return mstr_cmp_mstr (&ra->path, &rb->path);
 }
+
+static inline void
+gzip_drop (resource_blob_t *blob)
+{
+  ((resource_t *) blob->owner)->gzip = NULL;
+}
+
+/* the cache is a clock over blobs, called with the owner's lock held */
+
+void
+respool_cache_link (respool_cache_t *cache, resource_blob_t *blob)
+{
+  resource_blob_t *hand;
+
+  if (!(hand = cache->hand))
+    blob->prev = blob->next = cache->hand = blob;
+  else
+    { /* insert behind the hand */
+      blob->next = hand;
+      blob->prev = hand->prev;
+      hand->prev->next = blob;
+      hand->prev = blob;
+    }
+
+  cache->size += blob->size;
+}
+
+void
+respool_cache_unlink (respool_cache_t *cache, resource_blob_t *blob)
+{
+  if (blob->next == blob)
+    cache->hand = NULL;
+  else
+    {
+      blob->prev->next = blob->next;
+      blob->next->prev = blob->prev;
+      if (cache->hand == blob)
+	cache->hand = blob->next;
+    }
+
+  cache->size -= blob->size;
+  cache->drop (blob);
+  blob->owner = NULL;
+}
+
+resource_blob_t *
+respool_cache_evict (respool_cache_t *cache, size_t need)
+{
+  resource_blob_t *victims = NULL;
+
+  for (resource_blob_t *blob; cache->size + need > cache->max;)
+    {
+      blob = cache->hand;
+
+      /* second chance for recently used blobs */
+      if (__atomic_exchange_n (&blob->used, 0, __ATOMIC_RELAXED))
+	{
+	  cache->hand = blob->next;
+	  continue;
+	}
+
+      respool_cache_unlink (cache, blob);
+      blob->next = victims;
+      victims = blob;
+    }
+
+  return victims;
+}
@@ -1,31 +1,87 @@
 #ifndef RESPOOL_H
 #define RESPOOL_H
 
+#include "mime.h"
 #include "mstr.h"
 #include "rbtree.h"
 
 #include <pthread.h>
 
+enum
+{
+  RESOURCE_ENC_BR,
+  RESOURCE_ENC_ZSTD,
+  RESOURCE_ENC_GZIP,
+  RESOURCE_ENC_NUM,
+};
+
 typedef struct respool_t respool_t;
+typedef struct respool_cache_t respool_cache_t;
 typedef struct resource_t resource_t;
 typedef struct respool_node_t respool_node_t;
+typedef struct resource_blob_t resource_blob_t;
+typedef struct resource_variant_t resource_variant_t;
+
+typedef void respool_drop_t (resource_blob_t *blob);
+
+/* a clock over blobs, guarded by whatever lock its owner holds */
+struct respool_cache_t
+{
+  size_t max;
+  size_t size;
+  resource_blob_t *hand;
+  respool_drop_t *drop;
+};
 
 struct respool_t
 {
   rbtree_t tree;
   pthread_rwlock_t lock;
+  respool_cache_t cache;
+  const mime_registry_t *mime;
+
+  /* written under the lock, sampled without it */
+  size_t count;
+  size_t bytes;
+};
+
+struct resource_blob_t
+{
+  int refs;
+  int used;
+  size_t size;
+  void *owner;
+  resource_blob_t *prev;
+  resource_blob_t *next;
+  char data[];
+};
+
+struct resource_variant_t
+{
+  int fd;
+  size_t size;
 };
 
 struct resource_t
 {
   int fd;
+  int refs;
+  int encs;
+  bool stale;
   size_t size;
   mstr_t path;
   rbtree_node_t node;
+  const mime_t *mime;
   struct timespec mtime;
+  resource_blob_t *gzip;
+  resource_variant_t variants[RESOURCE_ENC_NUM];
 };
 
-extern int respool_init (respool_t *pool);
+/* { sidecar suffix, content-coding } */
+extern const char *const resource_encodings[RESOURCE_ENC_NUM][2];
+
+extern int respool_init (respool_t *pool, size_t cache,
+			 const mime_registry_t *mime);
 
 extern void respool_free (respool_t *pool);
 
@@ -35,4 +91,29 @@ extern resource_t *respool_get (respool_t *pool, const char *path);
 
 extern resource_t *respool_add (respool_t *pool, const char *path);
 
+extern void respool_put (resource_t *res);
+
+extern resource_t *respool_hold (resource_t *res);
+
+extern int respool_select (const resource_t *res, int accept);
+
+extern resource_blob_t *respool_blob_new (size_t cap);
+
+extern void respool_blob_put (resource_blob_t *blob);
+
+extern resource_blob_t *respool_blob_hold (resource_blob_t *blob);
+
+extern resource_blob_t *respool_blob_get (respool_t *pool, resource_t *res);
+
+extern resource_blob_t *respool_blob_set (respool_t *pool, resource_t *res,
+					  resource_blob_t *blob);
+
+extern void respool_cache_link (respool_cache_t *cache, resource_blob_t *blob);
+
+extern void respool_cache_unlink (respool_cache_t *cache,
+				  resource_blob_t *blob);
+
+extern resource_blob_t *respool_cache_evict (respool_cache_t *cache,
+					     size_t need);
+
 #endif
@@ -0,0 +1,255 @@
+#include "router.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void node_free (router_node_t *node);
+static router_node_t *node_new (const char *label, size_t len);
+static router_node_t *node_child (const router_node_t *node, char c);
+static router_node_t *node_split (router_node_t *node, size_t at);
+static router_node_t *node_static (router_node_t *node, const char *pos,
+				   size_t len);
+static router_node_t *node_var (router_node_t **slot, const char *name,
+				size_t len);
+static const router_node_t *node_match (const router_node_t *node,
+					const char *pos, const char *end,
+					router_match_t *m);
+
+void
+router_free (router_t *rt)
+{
+  node_free (rt->root);
+}
+
+int
+router_init (router_t *rt)
+{
+  return (rt->root = node_new ("", 0)) ? 0 : -1;
+}
+
+int
+router_add (router_t *rt, int method, const char *pattern, void *handler)
+{
+  size_t vars = 0;
+  const char *pos = pattern;
+  router_node_t *node = rt->root;
+
+  if (method < 0 || method >= ROUTER_METHODS)
+    return -1;
+
+  while (node && *pos)
+    {
+      size_t len = strcspn (pos, ":*");
+      if (len)
+	{
+	  node = node_static (node, pos, len);
+	  pos += len;
+	  continue;
+	}
+
+      /* a parameter spans one segment, a wildcard the rest of the path */
+      bool wild = *pos++ == '*';
+      len = wild ? strlen (pos) : strcspn (pos, "/");
+      node = node_var (wild ? &node->wild : &node->param, pos, len);
+      pos += len;
+
+      if (++vars > ROUTER_PARAMS)
+	return -1;
+    }
+
+  if (!node || node->handlers[method])
+    return -1;
+
+  node->handlers[method] = handler;
+  node->live++;
+  return 0;
+}
+
+int
+router_match (const router_t *rt, int method, const char *path, size_t len,
+	      router_match_t *m)
+{
+  const router_node_t *node;
+
+  m->cnt = 0;
+  m->handler = NULL;
+
+  if (!(node = node_match (rt->root, path, path + len, m)))
+    return ROUTER_MISS;
+
+  if (method < 0 || method >= ROUTER_METHODS
+      || !(m->handler = node->handlers[method]))
+    return ROUTER_NOT_ALLOWED;
+
+  return ROUTER_FOUND;
+}
+
+static void
+node_free (router_node_t *node)
+{
+  if (!node)
+    return;
+
+  for (size_t i = 0; i < node->cnt; i++)
+    node_free (node->children[i]);
+
+  node_free (node->param);
+  node_free (node->wild);
+  free (node->children);
+  free (node->label);
+  free (node);
+}
+
+static router_node_t *
+node_new (const char *label, size_t len)
+{
+  router_node_t *node;
+
+  if (!(node = malloc (sizeof (router_node_t))))
+    return NULL;
+
+  *node = (router_node_t) { .len = len };
+  if (!(node->label = malloc (len + 1)))
+    {
+      free (node);
+      return NULL;
+    }
+
+  memcpy (node->label, label, len);
+  node->label[len] = '\0';
+  return node;
+}
+
+static inline router_node_t *
+node_child (const router_node_t *node, char c)
+{
+  /* siblings never share a first byte */
+  for (size_t i = 0; i < node->cnt; i++)
+    if (node->children[i]->label[0] == c)
+      return node->children[i];
+
+  return NULL;
+}
+
+static router_node_t *
+node_split (router_node_t *node, size_t at)
+{
+  router_node_t *tail, **children;
+
+  if (!(children = malloc (sizeof (router_node_t *))))
+    return NULL;
+
+  if (!(tail = node_new (node->label + at, node->len - at)))
+    {
+      free (children);
+      return NULL;
+    }
+
+  /* the tail inherits everything below the split point */
+  char *label = tail->label;
+  *tail = *node;
+  tail->label = label;
+  tail->len = node->len - at;
+
+  *node = (router_node_t) {
+    .label = node->label,
+    .len = at,
+    .cnt = 1,
+    .children = children,
+  };
+
+  node->label[at] = '\0';
+  children[0] = tail;
+  return node;
+}
+
+static router_node_t *
+node_static (router_node_t *node, const char *pos, size_t len)
+{
+  while (len)
+    {
+      router_node_t *child, **children;
+
+      if (!(child = node_child (node, *pos)))
+	{
+	  size_t size = (node->cnt + 1) * sizeof (router_node_t *);
+	  if (!(children = realloc (node->children, size)))
+	    return NULL;
+
+	  node->children = children;
+	  if (!(child = node_new (pos, len)))
+	    return NULL;
+
+	  node->children[node->cnt++] = child;
+	  return child;
+	}
+
+      size_t n = 1;
+      while (n < child->len && n < len && child->label[n] == pos[n])
+	n++;
+
+      if (n < child->len && !node_split (child, n))
+	return NULL;
+
+      node = child;
+      pos += n;
+      len -= n;
+    }
+
+  return node;
+}
+
+static router_node_t *
+node_var (router_node_t **slot, const char *name, size_t len)
+{
+  if (!*slot)
+    return *slot = node_new (name, len);
+
+  /* one name per position */
+  if ((*slot)->len != len || memcmp ((*slot)->label, name, len) != 0)
+    return NULL;
+
+  return *slot;
+}
+
+static const router_node_t *
+node_match (const router_node_t *node, const char *pos, const char *end,
+	    router_match_t *m)
+{
+  const router_node_t *found, *child;
+
+  if (pos == end && node->live)
+    return node;
+
+  /* static edges first, then a segment parameter, then the wildcard */
+  if (pos < end && (child = node_child (node, *pos))
+      && (size_t) (end - pos) >= child->len
+      && memcmp (pos, child->label, child->len) == 0
+      && (found = node_match (child, pos + child->len, end, m)))
+    return found;
+
+  if (m->cnt == ROUTER_PARAMS)
+    return NULL;
+
+  router_param_t *p = &m->params[m->cnt];
+
+  if (pos < end && *pos != '/' && (child = node->param))
+    {
+      const char *seg = memchr (pos, '/', end - pos) ?: end;
+      *p = (router_param_t) { child->label, child->len, pos, seg - pos };
+
+      m->cnt++;
+      if ((found = node_match (child, seg, end, m)))
+	return found;
+      m->cnt--;
+    }
+
+  if ((child = node->wild) && child->live)
+    {
+      *p = (router_param_t) { child->label, child->len, pos, end - pos };
+      m->cnt++;
+      return child;
+    }
+
+  return NULL;
+}
@@ -0,0 +1,70 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ROUTER_METHODS 16
+#define ROUTER_PARAMS 8
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+enum
+{
+  ROUTER_MISS,
+  ROUTER_FOUND,
+  ROUTER_NOT_ALLOWED,
+};
+
+typedef struct router_t router_t;
+typedef struct router_node_t router_node_t;
+typedef struct router_param_t router_param_t;
+typedef struct router_match_t router_match_t;
+
+/* compressed radix tree, ":name" matches one segment, "*name" the rest */
+struct router_node_t
+{
+  char *label;
+  size_t len;
+  size_t live;
+
+  size_t cnt;
+  router_node_t **children;
+
+  router_node_t *param;
+  router_node_t *wild;
+
+  void *handlers[ROUTER_METHODS];
+};
+
+struct router_t
+{
+  router_node_t *root;
+};
+
+struct router_param_t
+{
+  const char *name;
+  size_t name_len;
+  const char *value;
+  size_t value_len;
+};
+
+struct router_match_t
+{
+  void *handler;
+  size_t cnt;
+  router_param_t params[ROUTER_PARAMS];
+};
+
+extern void router_free (router_t *rt) attr_nonnull (1);
+
+extern int router_init (router_t *rt) attr_nonnull (1);
+
+extern int router_add (router_t *rt, int method, const char *pattern,
+		       void *handler) attr_nonnull (1, 3, 4);
+
+extern int router_match (const router_t *rt, int method, const char *path,
+			 size_t len, router_match_t *m) attr_nonnull (1, 3, 5);
+
+#endif
@@ -0,0 +1,197 @@
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define align(n) (((n) + 63) & ~(size_t) 63)
+
+static int create (const char *name);
+
+int
+stats_name (char *dst, size_t size, const char *prefix, unsigned port)
+{
+  int n = snprintf (dst, size, "%s-%u", prefix, port);
+
+  if (n < 0 || (size_t) n >= size)
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+
+  return 0;
+}
+
+int
+stats_init (stats_t *st, const char *name, const stats_field_t *fields,
+	    size_t cnt)
+{
+  int fd;
+  void *mem;
+  size_t off_fields = align (sizeof (stats_head_t));
+  size_t off_values = align (off_fields + cnt * sizeof (stats_field_t));
+
+  *st = (stats_t) {
+    .owner = true,
+    .size = off_values + cnt * sizeof (stats_value_t),
+  };
+
+  if (!(st->name = strdup (name)))
+    return -1;
+
+  if ((fd = create (name)) == -1)
+    goto clean_name;
+
+  /* the values start out zero */
+  if (ftruncate (fd, st->size) != 0)
+    goto clean_shm;
+
+  mem = mmap (NULL, st->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED)
+    goto clean_shm;
+  close (fd);
+
+  st->head = mem;
+  st->fields = memcpy ((char *) mem + off_fields, fields,
+		       cnt * sizeof (stats_field_t));
+  st->values = (stats_value_t *) ((char *) mem + off_values);
+
+  *st->head = (stats_head_t) {
+    .version = STATS_VERSION,
+    .count = cnt,
+    .pid = getpid (),
+    .started = time (NULL),
+    .fields = off_fields,
+    .values = off_values,
+    .size = st->size,
+  };
+
+  /* last, a reader that sees it sees the rest */
+  __atomic_store_n (&st->head->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+
+clean_shm:
+  close (fd);
+  shm_unlink (name);
+
+clean_name:
+  free (st->name);
+  return -1;
+}
+
+void
+stats_free (stats_t *st)
+{
+  if (st->owner)
+    {
+      __atomic_store_n (&st->head->closed, 1, __ATOMIC_RELEASE);
+      shm_unlink (st->name);
+    }
+
+  munmap (st->head, st->size);
+  free (st->name);
+}
+
+int
+stats_open (stats_t *st, const char *name)
+{
+  int fd;
+  void *mem;
+  struct stat info;
+  stats_head_t *head;
+
+  *st = (stats_t) {};
+
+  if (!(st->name = strdup (name)))
+    return -1;
+
+  if ((fd = shm_open (name, O_RDONLY | O_CLOEXEC, 0)) == -1)
+    goto clean_name;
+
+  if (fstat (fd, &info) != 0)
+    goto clean_fd;
+
+  if ((size_t) info.st_size < sizeof (stats_head_t))
+    {
+      errno = EPROTO;
+      goto clean_fd;
+    }
+
+  st->size = info.st_size;
+  if ((mem = mmap (NULL, st->size, PROT_READ, MAP_SHARED, fd, 0))
+      == MAP_FAILED)
+    goto clean_fd;
+  close (fd);
+
+  /* a server still starting up looks the same as a foreign segment */
+  head = mem;
+  if (__atomic_load_n (&head->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC
+      || head->version != STATS_VERSION || head->size > st->size
+      || head->fields + head->count * sizeof (stats_field_t) > head->size
+      || head->values + head->count * sizeof (stats_value_t) > head->size)
+    {
+      munmap (mem, st->size);
+      errno = EPROTO;
+      goto clean_name;
+    }
+
+  st->head = head;
+  st->fields = (const stats_field_t *) ((char *) mem + head->fields);
+  st->values = (stats_value_t *) ((char *) mem + head->values);
+  return 0;
+
+clean_fd:
+  close (fd);
+
+clean_name:
+  free (st->name);
+  return -1;
+}
+
+bool
+stats_alive (const stats_t *st)
+{
+  if (__atomic_load_n (&st->head->closed, __ATOMIC_ACQUIRE))
+    return false;
+
+  /* a server killed hard never gets to mark it */
+  return kill (st->head->pid, 0) == 0 || errno == EPERM;
+}
+
+/* one left by a dead server is replaced, whoever still maps it sees its pid
+   gone; a live owner keeps its name */
+static int
+create (const char *name)
+{
+  int fd;
+  stats_t old;
+  int flags = O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC;
+
+  if ((fd = shm_open (name, flags, 0644)) != -1 || errno != EEXIST)
+    return fd;
+
+  /* one that is not a segment of ours at all is replaced as well */
+  if (stats_open (&old, name) == 0)
+    {
+      bool alive = stats_alive (&old);
+      stats_free (&old);
+
+      if (alive)
+	{
+	  errno = EADDRINUSE;
+	  return -1;
+	}
+    }
+
+  /* the owner binds its port first, nobody live races for the name */
+  shm_unlink (name);
+  return shm_open (name, flags, 0644);
+}
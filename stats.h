@@ -0,0 +1,102 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* bumped when the head, field or value layout changes, not for new fields */
+#define STATS_MAGIC 0x54535448 /* "HTST" */
+#define STATS_VERSION 1
+
+#define STATS_NAME 32
+#define STATS_DESC 92
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+enum
+{
+  STATS_COUNTER,
+  STATS_GAUGE,
+};
+
+typedef struct stats_t stats_t;
+typedef struct stats_head_t stats_head_t;
+typedef struct stats_field_t stats_field_t;
+typedef struct stats_value_t stats_value_t;
+
+/* readers trust nothing past the head until magic is there */
+struct stats_head_t
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;
+  uint32_t closed;
+  int64_t pid;
+  int64_t started;
+  uint64_t fields;
+  uint64_t values;
+  uint64_t size;
+};
+
+/* the segment describes itself, readers need no list of names */
+struct stats_field_t
+{
+  char name[STATS_NAME];
+  char desc[STATS_DESC];
+  uint32_t type;
+};
+
+/* a line each, workers bumping different values do not collide */
+struct stats_value_t
+{
+  uint64_t value __attribute__ ((aligned (64)));
+};
+
+struct stats_t
+{
+  char *name;
+  size_t size;
+  bool owner;
+  stats_head_t *head;
+  const stats_field_t *fields;
+  stats_value_t *values;
+};
+
+/* <prefix>-<port>, the name a server on port publishes under; -1 with
+   ENAMETOOLONG when it does not fit */
+extern int stats_name (char *dst, size_t size, const char *prefix,
+		       unsigned port) attr_nonnull (1, 3);
+
+extern int stats_init (stats_t *st, const char *name,
+		       const stats_field_t *fields, size_t cnt)
+    attr_nonnull (1, 2, 3);
+
+extern void stats_free (stats_t *st) attr_nonnull (1);
+
+extern int stats_open (stats_t *st, const char *name) attr_nonnull (1, 2);
+
+extern bool stats_alive (const stats_t *st) attr_nonnull (1);
+
+/* a disabled segment has no values, updates to it are dropped */
+static inline void
+stats_add (stats_t *st, size_t id, int64_t n)
+{
+  if (st->values)
+    __atomic_fetch_add (&st->values[id].value, n, __ATOMIC_RELAXED);
+}
+
+static inline void
+stats_set (stats_t *st, size_t id, uint64_t v)
+{
+  if (st->values)
+    __atomic_store_n (&st->values[id].value, v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+stats_get (const stats_t *st, size_t id)
+{
+  return __atomic_load_n (&st->values[id].value, __ATOMIC_RELAXED);
+}
+
+#endif
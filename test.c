@@ -1,29 +1,207 @@
+#include "config.h"
 #include "httpd.h"
 #include "util.h"
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static void
+health (context_t *ctx, const request_t *req)
+{
+  (void) req;
+
+  static const char body[] = "{\"status\":\"ok\"}";
+  context_reply (ctx, HTTPD_STATUS_OK, "application/json", body,
+		 sizeof (body) - 1);
+}
+
+static void
+now (context_t *ctx, const request_t *req)
+{
+  (void) req;
+
+  char body[64];
+  int n = snprintf (body, sizeof (body), "{\"time\":%lld}",
+		    (long long) time (NULL));
+
+  /* shared for a second, then served stale while it refreshes */
+  context_cache (ctx, "max-age=1, stale-while-revalidate=5");
+  context_reply (ctx, HTTPD_STATUS_OK, "application/json", body, n);
+}
+
+static void
+bytes_close (void *arg)
+{
+  free (arg);
+}
+
+static ssize_t
+bytes_read (void *arg, void *dst, size_t max)
+{
+  size_t *left = arg;
+  size_t n = *left < max ? *left : max;
+
+  memset (dst, 'x', n);
+  *left -= n;
+  return n;
+}
+
+static void
+bytes (context_t *ctx, const request_t *req)
+{
+  (void) req;
+
+  size_t len, *left;
+  const char *n = context_param (ctx, "n", &len);
+
+  if (!(left = malloc (sizeof (size_t))))
+    return;
+
+  *left = strtoull (n, NULL, 10);
+  context_stream (ctx, HTTPD_STATUS_OK, "application/octet-stream",
+		  bytes_read, bytes_close, left);
+}
+
+static void
+discard (context_t *ctx, const request_t *req)
+{
+  (void) req;
+
+  int fd;
+  ssize_t n;
+  char body[64];
+
+  if ((fd = open ("/dev/null", O_WRONLY | O_CLOEXEC)) == -1)
+    return;
+
+  n = context_splice (ctx, fd);
+  close (fd);
+
+  if (n == -1)
+    return;
+
+  int len = snprintf (body, sizeof (body), "{\"bytes\":%zd}", n);
+  context_reply (ctx, HTTPD_STATUS_OK, "application/json", body, len);
+}
+
+static websocket_t *peers[1024];
+static pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+echo_message (websocket_t *ws, int opcode, const void *data, size_t len,
+	      void *arg)
+{
+  (void) arg;
+
+  if (opcode != WS_CLOSE)
+    {
+      websocket_send (ws, opcode, data, len);
+      return;
+    }
+
+  pthread_mutex_lock (&peers_lock);
+  for (size_t i = 0; i < sizeof (peers) / sizeof (*peers); i++)
+    if (peers[i] == ws)
+      {
+	peers[i] = NULL;
+	websocket_put (ws);
+	break;
+      }
+  pthread_mutex_unlock (&peers_lock);
+}
+
+static void
+echo (context_t *ctx, const request_t *req)
+{
+  (void) req;
+
+  websocket_t *ws;
+  static const char msg[] = "websocket expected";
+
+  if (!(ws = context_websocket (ctx, echo_message, NULL)))
+    {
+      context_reply (ctx, HTTPD_STATUS_BAD_REQUEST, "text/plain", msg,
+		     sizeof (msg) - 1);
+      return;
+    }
+
+  /* kept for notify, released when the socket closes */
+  pthread_mutex_lock (&peers_lock);
+  for (size_t i = 0; i < sizeof (peers) / sizeof (*peers); i++)
+    if (!peers[i])
+      {
+	peers[i] = websocket_hold (ws);
+	break;
+      }
+  pthread_mutex_unlock (&peers_lock);
+}
+
+static void
+notify (context_t *ctx, const request_t *req)
+{
+  (void) req;
+
+  ssize_t len;
+  int sent = 0;
+  char msg[4096], body[64];
+
+  if ((len = context_read (ctx, msg, sizeof (msg))) == -1)
+    return;
+
+  pthread_mutex_lock (&peers_lock);
+  for (size_t i = 0; i < sizeof (peers) / sizeof (*peers); i++)
+    if (peers[i] && websocket_send (peers[i], WS_TEXT, msg, len))
+      sent++;
+  pthread_mutex_unlock (&peers_lock);
+
+  int n = snprintf (body, sizeof (body), "{\"sent\":%d}", sent);
+  context_reply (ctx, HTTPD_STATUS_OK, "application/json", body, n);
+}
 
 int
 main (int argc, char **args)
 {
   if (argc < 2)
-    error ("Usage: %s <port> <dir>", args[0]);
+    error ("Usage: %s <port> <dir> [<cert> <key>]", args[0]);
 
   struct sigaction act;
   act.sa_handler = SIG_IGN;
   if (sigaction (SIGPIPE, &act, NULL) != 0)
     abort ();
 
+  /* reopen the access log after rotation */
+  act = (struct sigaction) { .sa_handler = accesslog_hup,
+			     .sa_flags = SA_RESTART };
+  if (sigaction (SIGHUP, &act, NULL) != 0)
+    abort ();
+
   server_t serv;
 
   server_config_t conf = {
+    .flags = getenv ("LIMIT") ? FLAGS | SERVER_LIMIT : 0,
     .port = atoi (args[1]),
     .root = args[2],
+    .cert = argc > 4 ? args[3] : NULL,
+    .key = argc > 4 ? args[4] : NULL,
+    .upstream = getenv ("UPSTREAM"),
+    .log = getenv ("ACCESS_LOG"),
   };
 
   if (server_init (&serv, &conf) != 0)
     abort ();
 
+  if (server_register (&serv, HTTPD_METHOD_GET, "/health", health) != 0
+      || server_register (&serv, HTTPD_METHOD_GET, "/time", now) != 0
+      || server_register (&serv, HTTPD_METHOD_GET, "/bytes/:n", bytes) != 0
+      || server_register (&serv, HTTPD_METHOD_POST, "/discard", discard) != 0
+      || server_register (&serv, HTTPD_METHOD_GET, "/ws", echo) != 0
+      || server_register (&serv, HTTPD_METHOD_POST, "/notify", notify) != 0)
+    abort ();
+
   for (;;)
     server_poll (&serv);
 
@@ -1,4 +1,5 @@
 #include "threadpool.h"
+#include "probe.h"
 
 #include <stdlib.h>
 
@@ -153,6 +154,8 @@ threadpool_post (threadpool_t *pool, threadpool_func_t *f, void *a)
     case THREADPOOL_STS_RUN:
     case THREADPOOL_STS_STOP:
       __atomic_fetch_add (&pool->remain, 1, __ATOMIC_RELAXED);
+      probe (enqueue, pool, a,
+	     __atomic_load_n (&pool->remain, __ATOMIC_RELAXED));
       pthread_cond_signal (&pool->cond);
       break;
 
@@ -190,6 +193,7 @@ work (void *arg)
       if (status == THREADPOOL_STS_QUIT)
 	break;
 
+      probe (dequeue, pool, task->arg);
       task->func (task->arg);
       __atomic_fetch_sub (&pool->remain, 1, __ATOMIC_RELAXED);
     }
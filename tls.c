@@ -0,0 +1,236 @@
+#include "tls.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+
+/* ALPN wire format, preferred first */
+static const unsigned char protos[] = "\x02h2\x08http/1.1";
+
+/* plaintext waiting to be encrypted in userspace */
+static __thread char stage[TLS_STAGE_SIZE];
+
+static ssize_t io_result (SSL *ssl, int ok, size_t n);
+static int alpn_select (SSL *ssl, const unsigned char **out,
+			unsigned char *outlen, const unsigned char *in,
+			unsigned int inlen, void *arg);
+
+void
+tls_free (tls_t *tls)
+{
+  SSL_CTX_free (tls->ctx);
+}
+
+int
+tls_init (tls_t *tls, const char *cert, const char *key, size_t cache,
+	  bool ktls)
+{
+  static const unsigned char sid[] = "httpd";
+
+  if (!(tls->ctx = SSL_CTX_new (TLS_server_method ())))
+    return -1;
+
+  uint64_t opts = SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF
+		  | SSL_OP_CIPHER_SERVER_PREFERENCE;
+
+  /* hand record encryption to the kernel after the handshake */
+  if (ktls)
+    opts |= SSL_OP_ENABLE_KTLS;
+
+  SSL_CTX_set_options (tls->ctx, opts);
+  SSL_CTX_set_min_proto_version (tls->ctx, TLS1_2_VERSION);
+
+  /* writes are retried from regathered segments */
+  SSL_CTX_set_mode (tls->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+				  | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+				  | SSL_MODE_RELEASE_BUFFERS);
+
+  /* every worker shares this context, its session cache and ticket keys */
+  SSL_CTX_set_session_cache_mode (tls->ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size (tls->ctx, cache);
+  SSL_CTX_set_session_id_context (tls->ctx, sid, sizeof (sid) - 1);
+
+  SSL_CTX_set_alpn_select_cb (tls->ctx, alpn_select, NULL);
+
+  if (SSL_CTX_use_certificate_chain_file (tls->ctx, cert) != 1
+      || SSL_CTX_use_PrivateKey_file (tls->ctx, key, SSL_FILETYPE_PEM) != 1
+      || SSL_CTX_check_private_key (tls->ctx) != 1)
+    {
+      SSL_CTX_free (tls->ctx);
+      return -1;
+    }
+
+  return 0;
+}
+
+SSL *
+tls_accept (tls_t *tls, int sock)
+{
+  SSL *ssl;
+
+  if (!(ssl = SSL_new (tls->ctx)))
+    return NULL;
+
+  if (SSL_set_fd (ssl, sock) != 1)
+    {
+      SSL_free (ssl);
+      return NULL;
+    }
+
+  SSL_set_accept_state (ssl);
+  return ssl;
+}
+
+void
+tls_close (SSL *ssl)
+{
+  /* best effort close_notify, the socket is non-blocking */
+  ERR_clear_error ();
+  if (SSL_is_init_finished (ssl))
+    SSL_shutdown (ssl);
+
+  SSL_free (ssl);
+}
+
+int
+tls_handshake (SSL *ssl)
+{
+  int ret;
+
+  ERR_clear_error ();
+  if ((ret = SSL_do_handshake (ssl)) == 1)
+    return TLS_OK;
+
+  switch (SSL_get_error (ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+      return TLS_WANT_READ;
+
+    case SSL_ERROR_WANT_WRITE:
+      return TLS_WANT_WRITE;
+
+    default:
+      return TLS_ERROR;
+    }
+}
+
+int
+tls_proto (const SSL *ssl)
+{
+  unsigned int len;
+  const unsigned char *data;
+
+  SSL_get0_alpn_selected (ssl, &data, &len);
+  if (len == 2 && memcmp (data, "h2", 2) == 0)
+    return TLS_PROTO_H2;
+
+  return TLS_PROTO_HTTP1;
+}
+
+bool
+tls_offloaded (SSL *ssl)
+{
+  return BIO_get_ktls_send (SSL_get_wbio (ssl));
+}
+
+ssize_t
+tls_recv (SSL *ssl, void *buf, size_t len)
+{
+  size_t n;
+
+  ERR_clear_error ();
+  int ok = SSL_read_ex (ssl, buf, len, &n);
+  return io_result (ssl, ok, n);
+}
+
+ssize_t
+tls_send (SSL *ssl, const void *buf, size_t len)
+{
+  size_t n;
+
+  ERR_clear_error ();
+  int ok = SSL_write_ex (ssl, buf, len, &n);
+  return io_result (ssl, ok, n);
+}
+
+ssize_t
+tls_writev (SSL *ssl, const struct iovec *iov, int cnt)
+{
+  size_t len = 0;
+
+  if (cnt == 1)
+    return tls_send (ssl, iov[0].iov_base, iov[0].iov_len);
+
+  /* records are built from one buffer */
+  for (int i = 0; i < cnt && len < sizeof (stage); i++)
+    {
+      size_t n = iov[i].iov_len;
+      if (n > sizeof (stage) - len)
+	n = sizeof (stage) - len;
+
+      memcpy (stage + len, iov[i].iov_base, n);
+      len += n;
+    }
+
+  return tls_send (ssl, stage, len);
+}
+
+ssize_t
+tls_sendfile (SSL *ssl, int fd, off_t off, size_t len)
+{
+  ssize_t n;
+
+  if (len > sizeof (stage))
+    len = sizeof (stage);
+
+  /* without offload the file passes through userspace */
+  if ((n = pread (fd, stage, len, off)) <= 0)
+    {
+      if (n == 0)
+	errno = EIO;
+      return -1;
+    }
+
+  return tls_send (ssl, stage, n);
+}
+
+static inline ssize_t
+io_result (SSL *ssl, int ok, size_t n)
+{
+  if (ok)
+    return n;
+
+  switch (SSL_get_error (ssl, 0))
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      errno = EAGAIN;
+      return -1;
+
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;
+
+    default:
+      errno = EIO;
+      return -1;
+    }
+}
+
+static int
+alpn_select (SSL *ssl, const unsigned char **out, unsigned char *outlen,
+	     const unsigned char *in, unsigned int inlen, void *arg)
+{
+  (void) ssl;
+  (void) arg;
+
+  unsigned char *sel;
+  if (SSL_select_next_proto (&sel, outlen, protos, sizeof (protos) - 1, in,
+			     inlen)
+      != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+
+  *out = sel;
+  return SSL_TLSEXT_ERR_OK;
+}
@@ -0,0 +1,61 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <openssl/ssl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define TLS_STAGE_SIZE (64 << 10)
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+enum
+{
+  TLS_OK,
+  TLS_WANT_READ,
+  TLS_WANT_WRITE,
+  TLS_ERROR,
+};
+
+enum
+{
+  TLS_PROTO_HTTP1,
+  TLS_PROTO_H2,
+};
+
+typedef struct tls_t tls_t;
+
+struct tls_t
+{
+  SSL_CTX *ctx;
+};
+
+extern void tls_free (tls_t *tls) attr_nonnull (1);
+
+extern int tls_init (tls_t *tls, const char *cert, const char *key,
+		     size_t cache, bool ktls) attr_nonnull (1, 2, 3);
+
+extern SSL *tls_accept (tls_t *tls, int sock) attr_nonnull (1);
+
+extern void tls_close (SSL *ssl) attr_nonnull (1);
+
+extern int tls_handshake (SSL *ssl) attr_nonnull (1);
+
+extern int tls_proto (const SSL *ssl) attr_nonnull (1);
+
+extern bool tls_offloaded (SSL *ssl) attr_nonnull (1);
+
+extern ssize_t tls_recv (SSL *ssl, void *buf, size_t len) attr_nonnull (1, 2);
+
+extern ssize_t tls_send (SSL *ssl, const void *buf, size_t len)
+    attr_nonnull (1, 2);
+
+extern ssize_t tls_writev (SSL *ssl, const struct iovec *iov, int cnt)
+    attr_nonnull (1, 2);
+
+extern ssize_t tls_sendfile (SSL *ssl, int fd, off_t off, size_t len)
+    attr_nonnull (1);
+
+#endif
@@ -0,0 +1,157 @@
+#include "wheel.h"
+
+#include <string.h>
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+static void place (wheel_t *w, wheel_node_t *n);
+static void cascade (wheel_t *w, int level, int idx);
+
+void
+wheel_init (wheel_t *w, uint64_t now)
+{
+  memset (w, 0, sizeof (wheel_t));
+  w->now = now;
+}
+
+void
+wheel_arm (wheel_t *w, wheel_node_t *n, uint64_t expires)
+{
+  if (wheel_armed (n))
+    wheel_cancel (w, n);
+
+  /* the current tick is done, the earliest left is the next one */
+  n->expires = expires > w->now ? expires : w->now + 1;
+  place (w, n);
+  w->count++;
+}
+
+void
+wheel_cancel (wheel_t *w, wheel_node_t *n)
+{
+  if (!wheel_armed (n))
+    return;
+
+  int level = n->slot / WHEEL_SLOTS, idx = n->slot % WHEEL_SLOTS;
+
+  if ((*n->pprev = n->next))
+    n->next->pprev = n->pprev;
+  else if (!w->slots[level][idx])
+    w->used[level] &= ~((uint64_t) 1 << idx);
+
+  n->slot = -1;
+  w->count--;
+}
+
+wheel_node_t *
+wheel_advance (wheel_t *w, uint64_t now)
+{
+  wheel_node_t *due = NULL;
+
+  while (w->now < now)
+    {
+      /* nothing armed, no slot to visit on the way */
+      if (!w->count)
+	{
+	  w->now = now;
+	  break;
+	}
+
+      w->now++;
+
+      /* a level wrapped, its next slot moves down */
+      for (int level = 1; level < WHEEL_LEVELS; level++)
+	{
+	  if (w->now & (((uint64_t) 1 << (WHEEL_BITS * level)) - 1))
+	    break;
+	  cascade (w, level, (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+	}
+
+      int idx = w->now & WHEEL_MASK;
+      wheel_node_t *n = w->slots[0][idx], *next;
+
+      w->slots[0][idx] = NULL;
+      w->used[0] &= ~((uint64_t) 1 << idx);
+
+      for (; n; n = next)
+	{
+	  next = n->next;
+	  n->slot = -1;
+	  n->next = due;
+	  due = n;
+	  w->count--;
+	}
+    }
+
+  return due;
+}
+
+uint64_t
+wheel_next (const wheel_t *w)
+{
+  uint64_t next = UINT64_MAX;
+
+  if (!w->count)
+    return next;
+
+  /* the level 0 slots hold the next 64 ticks, in a ring from now */
+  int idx = (w->now + 1) & WHEEL_MASK;
+  uint64_t ring = w->used[0] >> idx;
+  if (idx)
+    ring |= w->used[0] << (WHEEL_SLOTS - idx);
+
+  if (ring)
+    next = w->now + 1 + __builtin_ctzll (ring);
+
+  /* anything higher comes down no earlier than the next wrap */
+  for (int level = 1; level < WHEEL_LEVELS; level++)
+    if (w->used[level])
+      {
+	uint64_t wrap = ((w->now >> WHEEL_BITS) + 1) << WHEEL_BITS;
+	return wrap < next ? wrap : next;
+      }
+
+  return next;
+}
+
+/* expires is never behind now */
+static void
+place (wheel_t *w, wheel_node_t *n)
+{
+  int level = 0;
+  uint64_t delta = n->expires - w->now;
+
+  if (delta >= WHEEL_SPAN)
+    n->expires = w->now + (delta = WHEEL_SPAN - 1);
+
+  while (level < WHEEL_LEVELS - 1
+	 && delta >= (uint64_t) 1 << (WHEEL_BITS * (level + 1)))
+    level++;
+
+  int idx = (n->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+  wheel_node_t **head = &w->slots[level][idx];
+
+  if ((n->next = *head))
+    n->next->pprev = &n->next;
+  n->pprev = head;
+  *head = n;
+
+  n->slot = level * WHEEL_SLOTS + idx;
+  w->used[level] |= (uint64_t) 1 << idx;
+}
+
+static void
+cascade (wheel_t *w, int level, int idx)
+{
+  wheel_node_t *n = w->slots[level][idx], *next;
+
+  w->slots[level][idx] = NULL;
+  w->used[level] &= ~((uint64_t) 1 << idx);
+
+  for (; n; n = next)
+    {
+      next = n->next;
+      place (w, n);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* four levels of 64 slots, deadlines up to 2^24 ticks ahead */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+#define WHEEL_NODE_INIT ((wheel_node_t) { .slot = -1 })
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+typedef struct wheel_t wheel_t;
+typedef struct wheel_node_t wheel_node_t;
+
+/* intrusive, slot is -1 while it is not armed */
+struct wheel_node_t
+{
+  int slot;
+  uint64_t expires;
+  wheel_node_t *next;
+  wheel_node_t **pprev;
+};
+
+/* not locked, its owner serializes arm, cancel and advance */
+struct wheel_t
+{
+  uint64_t now;
+  size_t count;
+  uint64_t used[WHEEL_LEVELS];
+  wheel_node_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+extern void wheel_init (wheel_t *w, uint64_t now) attr_nonnull (1);
+
+extern void wheel_arm (wheel_t *w, wheel_node_t *n, uint64_t expires)
+    attr_nonnull (1, 2);
+
+extern void wheel_cancel (wheel_t *w, wheel_node_t *n) attr_nonnull (1, 2);
+
+/* the nodes due by now, linked through next and no longer armed */
+extern wheel_node_t *wheel_advance (wheel_t *w, uint64_t now)
+    attr_nonnull (1);
+
+/* the first tick with work to do, UINT64_MAX when nothing is armed */
+extern uint64_t wheel_next (const wheel_t *w) attr_nonnull (1);
+
+static inline int
+wheel_armed (const wheel_node_t *n)
+{
+  return n->slot != -1;
+}
+
+#endif
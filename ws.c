@@ -0,0 +1,132 @@
+#include "ws.h"
+
+#include <string.h>
+
+#include <openssl/evp.h>
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+typedef uint8_t ws_vec_t __attribute__ ((vector_size (32)));
+
+ssize_t
+ws_parse (ws_frame_t *frame, const void *data, size_t len)
+{
+  const uint8_t *pos = data;
+  size_t need = 2;
+
+  if (len < need)
+    return 0;
+
+  /* no extensions are negotiated, so every RSV bit is an error */
+  if (pos[0] & 0x70)
+    return -1;
+
+  frame->fin = pos[0] & 0x80;
+  frame->opcode = pos[0] & 0x0f;
+  frame->len = pos[1] & 0x7f;
+
+  /* clients always mask */
+  if (!(pos[1] & 0x80))
+    return -1;
+
+  if ((frame->opcode > WS_BINARY && frame->opcode < WS_CLOSE)
+      || frame->opcode > WS_PONG)
+    return -1;
+
+  if (frame->len == 126)
+    need += 2;
+  else if (frame->len == 127)
+    need += 8;
+
+  if (len < need + 4)
+    return 0;
+
+  if (frame->len == 126)
+    frame->len = (uint64_t) pos[2] << 8 | pos[3];
+  else if (frame->len == 127)
+    {
+      frame->len = 0;
+      for (int i = 0; i < 8; i++)
+	frame->len = frame->len << 8 | pos[2 + i];
+
+      if (frame->len >> 63)
+	return -1;
+    }
+
+  /* control frames are short and never fragmented */
+  if (ws_is_control (frame->opcode)
+      && (!frame->fin || frame->len > WS_CONTROL_MAX))
+    return -1;
+
+  memcpy (frame->mask, pos + need, 4);
+  return need + 4;
+}
+
+size_t
+ws_head (void *dst, int opcode, bool fin, size_t len)
+{
+  uint8_t *pos = dst;
+
+  pos[0] = (fin ? 0x80 : 0) | opcode;
+
+  if (len < 126)
+    {
+      pos[1] = len;
+      return 2;
+    }
+
+  if (len <= 0xffff)
+    {
+      pos[1] = 126;
+      pos[2] = len >> 8;
+      pos[3] = len;
+      return 4;
+    }
+
+  pos[1] = 127;
+  for (int i = 0; i < 8; i++)
+    pos[2 + i] = (uint64_t) len >> (56 - 8 * i);
+
+  return 10;
+}
+
+__attribute__ ((target_clones ("avx2", "default"))) void
+ws_unmask (void *data, size_t len, const uint8_t mask[4], size_t off)
+{
+  ws_vec_t key;
+  uint8_t *pos = data;
+
+  /* rotate the key to the phase of the first byte */
+  for (size_t i = 0; i < sizeof (key); i++)
+    key[i] = mask[(off + i) & 3];
+
+  for (; len >= sizeof (key); pos += sizeof (key), len -= sizeof (key))
+    {
+      ws_vec_t v;
+      memcpy (&v, pos, sizeof (v));
+      v ^= key;
+      memcpy (pos, &v, sizeof (v));
+    }
+
+  for (size_t i = 0; i < len; i++)
+    pos[i] ^= key[i];
+}
+
+bool
+ws_accept (const char *key, size_t len, char *out)
+{
+  unsigned int n;
+  char buf[128];
+  unsigned char md[EVP_MAX_MD_SIZE];
+
+  if (len + sizeof (WS_GUID) > sizeof (buf))
+    return false;
+
+  memcpy (buf, key, len);
+  memcpy (buf + len, WS_GUID, sizeof (WS_GUID) - 1);
+
+  if (!EVP_Digest (buf, len + sizeof (WS_GUID) - 1, md, &n, EVP_sha1 (), NULL))
+    return false;
+
+  return EVP_EncodeBlock ((unsigned char *) out, md, n) == WS_ACCEPT_LEN;
+}
@@ -0,0 +1,58 @@
+#ifndef WS_H
+#define WS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define WS_HEAD_MAX 14
+#define WS_CONTROL_MAX 125
+#define WS_ACCEPT_LEN 28
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+enum
+{
+  WS_CONT,
+  WS_TEXT,
+  WS_BINARY,
+  WS_CLOSE = 0x8,
+  WS_PING,
+  WS_PONG,
+};
+
+enum
+{
+  WS_CLOSE_NORMAL = 1000,
+  WS_CLOSE_GOING_AWAY = 1001,
+  WS_CLOSE_PROTOCOL = 1002,
+  WS_CLOSE_TOO_BIG = 1009,
+  WS_CLOSE_INTERNAL = 1011,
+};
+
+typedef struct ws_frame_t ws_frame_t;
+
+struct ws_frame_t
+{
+  bool fin;
+  int opcode;
+  uint8_t mask[4];
+  uint64_t len;
+};
+
+#define ws_is_control(op) ((op) & 0x8)
+
+extern ssize_t ws_parse (ws_frame_t *frame, const void *data, size_t len)
+    attr_nonnull (1, 2);
+
+extern size_t ws_head (void *dst, int opcode, bool fin, size_t len)
+    attr_nonnull (1);
+
+extern void ws_unmask (void *data, size_t len, const uint8_t mask[4],
+		       size_t off) attr_nonnull (3);
+
+extern bool ws_accept (const char *key, size_t len, char *out)
+    attr_nonnull (1, 3);
+
+#endif